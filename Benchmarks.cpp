@@ -0,0 +1,791 @@
+#define MSTRING_IMPLEMENTATION
+#include "MString.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if __cplusplus >= 201703L || (defined _MSVC_LANG && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define MSTRING_BENCHMARK_STRING_VIEW 1
+#endif
+
+// Timings for the things we care about, for MString next to std::string (and IString next to
+// std::string_view, in C++17 builds). Build in release mode unless you want to benchmark the debug
+// runtime. The 32-bit size type build from build.sh covers the other short string threshold, and
+// the MSTRING_POOL build covers the buffer pool.
+//
+// Usage: MStringBenchmarks [--quick] [--filter name] [--csv path] [--json path]
+//   --quick        Shorter runs, for checking that everything works rather than getting good numbers.
+//   --filter name  Only run benchmarks whose name contains this.
+//   --csv path     Also write the results as CSV. The size type and short string length are included
+//   --json path    in every row/file, so results from different builds can be concatenated and compared.
+
+#ifndef MSTRING_BENCHMARK_COMMIT
+#define MSTRING_BENCHMARK_COMMIT "unknown"
+#endif
+
+#if defined __clang__
+#define MSTRING_BENCHMARK_COMPILER "clang " __clang_version__
+#elif defined __GNUC__
+#define MSTRING_BENCHMARK_COMPILER "gcc " __VERSION__
+#elif defined _MSC_VER
+#define MSTRING_BENCHMARK_COMPILER "msvc"
+#else
+#define MSTRING_BENCHMARK_COMPILER "unknown"
+#endif
+
+struct BenchmarkResult
+{
+    const char* benchmark;
+    const char* type;
+    unsigned long long length;
+    double ns_per_op;
+    long long iterations;
+};
+
+static std::vector<BenchmarkResult> results;
+static const char* filter = nullptr;
+static double min_run_seconds = 0.02;
+static int repetitions = 5;
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Stops the compiler from optimizing away work on a value, or hoisting it out of the timing loop.
+static volatile size_t sink;
+#if defined __GNUC__ || defined __clang__
+template <class T> static void Clobber(T& value) {asm volatile("" : : "r"(&value) : "memory");}
+#else
+static void* volatile escaped;
+template <class T> static void Clobber(T& value) {escaped = (void*)&value;}
+#endif
+
+// Runs body(iterations) with more and more iterations until one run takes long enough to time, then
+// keeps the best of a few runs at that count. Records the time per iteration.
+template <class Body>
+static void Measure(const char* benchmark, const char* type, MSTRING_SIZE_T length, Body body)
+{
+    if (filter && !strstr(benchmark, filter)) return;
+
+    long long iterations = 1;
+    double best = 0.0;
+    for (;;)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body(iterations);
+        best = Seconds(start);
+        if (best >= min_run_seconds || iterations >= (1ll << 40)) break;
+        iterations *= (best * 16.0 < min_run_seconds) ? 8 : 2;
+    }
+    for (int i = 1; i < repetitions; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body(iterations);
+        double seconds = Seconds(start);
+        if (seconds < best) best = seconds;
+    }
+
+    BenchmarkResult result = {benchmark, type, (unsigned long long)length, best * 1e9 / (double)iterations, iterations};
+    results.push_back(result);
+    printf("%-20s %-16s %8llu %12.2f ns\n", result.benchmark, result.type, result.length, result.ns_per_op);
+}
+
+// The few places where MString and std::string spell things differently.
+static void InsertBytes(MString& str, MSTRING_SIZE_T index, const char* ptr, MSTRING_SIZE_T length) {str.Insert(index, ptr, length);}
+static void InsertBytes(std::string& str, MSTRING_SIZE_T index, const char* ptr, MSTRING_SIZE_T length) {str.insert(index, ptr, length);}
+static void RemoveBytes(MString& str, MSTRING_SIZE_T index, MSTRING_SIZE_T count) {str.Remove(index, count);}
+static void RemoveBytes(std::string& str, MSTRING_SIZE_T index, MSTRING_SIZE_T count) {str.erase(index, count);}
+static void ReserveBytes(MString& str, MSTRING_SIZE_T capacity) {str.Reserve(capacity);}
+static void ReserveBytes(std::string& str, MSTRING_SIZE_T capacity) {str.reserve(capacity);}
+static void ShrinkBytes(MString& str) {str.ShrinkToFit();}
+static void ShrinkBytes(std::string& str) {str.shrink_to_fit();}
+static size_t FindByte(const MString& str, char c) {return (size_t)str.Find(c);}
+static size_t FindByte(const std::string& str, char c) {return str.find(c);}
+static size_t FirstByte(const MString& str) {return str.Length() ? (unsigned char)str.Ptr()[0] : 0;}
+static size_t FirstByte(const std::string& str) {return str.size() ? (unsigned char)str.data()[0] : 0;}
+
+// Every string benchmark, for a single string type at a single length.
+template <class S>
+static void BenchmarkStrings(const char* type, MSTRING_SIZE_T length)
+{
+    std::string source(length, 'a');
+    for (MSTRING_SIZE_T i = 0; i < length; ++i) source[i] = 'a' + (char)(i % 26);
+    const char* chars = source.c_str();
+
+    Measure("construct", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            S str(chars, length);
+            Clobber(str);
+            sink = sink + FirstByte(str);
+        }
+    });
+
+    // Roughly "directory + '/' + name + '.' + extension", split so the total is the requested length
+    // (except for lengths under 2, since the separators alone take 2 bytes).
+    MSTRING_SIZE_T part = (length >= 2) ? (length - 2) / 3 : 0;
+    std::string first(chars, part), second(chars, part), third(chars, (length >= 2) ? length - 2 - 2 * part : 0);
+    Measure("append_chain", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            S str = S(first.c_str()) + '/' + second.c_str() + '.' + third.c_str();
+            Clobber(str);
+            sink = sink + FirstByte(str);
+        }
+    });
+
+    // Appending one byte at a time, which is all about how the capacity grows.
+    Measure("append_grow", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            S str{};
+            for (MSTRING_SIZE_T j = 0; j < length; ++j) str += chars[j];
+            Clobber(str);
+            sink = sink + FirstByte(str);
+        }
+    });
+
+    S base(chars, length);
+    Measure("insert_remove_mid", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            InsertBytes(base, length / 2, "edit", 4);
+            RemoveBytes(base, length / 2, 4);
+            Clobber(base);
+        }
+    });
+
+    Measure("copy", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            S copy = base;
+            Clobber(copy);
+            sink = sink + FirstByte(copy);
+        }
+    });
+
+    Measure("move", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            S moved = static_cast<S&&>(base);
+            Clobber(moved);
+            base = static_cast<S&&>(moved);
+        }
+    });
+
+    // Equal contents in separate buffers, so nothing can short-circuit.
+    S other(chars, length);
+    Measure("equal", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            Clobber(base);
+            Clobber(other);
+            sink = sink + (base == other);
+        }
+    });
+    Measure("less", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            Clobber(base);
+            Clobber(other);
+            sink = sink + (base < other);
+        }
+    });
+
+    Measure("find_char_missing", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            Clobber(base);
+            sink = sink + FindByte(base, '!');
+        }
+    });
+
+    // Growing the capacity and then giving it back.
+    Measure("shrink_round_trip", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            ReserveBytes(base, 2 * length + 32);
+            ShrinkBytes(base);
+            Clobber(base);
+        }
+    });
+}
+
+#ifdef MSTRING_BENCHMARK_STRING_VIEW
+static size_t FindByte(IString str, char c) {return (size_t)str.Find(c);}
+static size_t FindByte(std::string_view str, char c) {return str.find(c);}
+
+// The non-owning string types don't allocate, so only comparison and searching are interesting.
+template <class V>
+static void BenchmarkViews(const char* type, MSTRING_SIZE_T length)
+{
+    std::string source(length, 'a'), copy(length, 'a');
+    for (MSTRING_SIZE_T i = 0; i < length; ++i) source[i] = copy[i] = 'a' + (char)(i % 26);
+    V lhs(source.data(), length), rhs(copy.data(), length);
+
+    Measure("view_equal", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            Clobber(lhs);
+            Clobber(rhs);
+            sink = sink + (lhs == rhs);
+        }
+    });
+
+    Measure("view_find_char", type, length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            Clobber(lhs);
+            sink = sink + FindByte(lhs, '!');
+        }
+    });
+}
+#endif
+
+// Metrics-style number formatting: a line of numbers, with AppendInt/AppendDouble versus the usual
+// snprintf into a temporary buffer and then appending. The length is how many numbers are in a line.
+static void BenchmarkNumbers(MSTRING_SIZE_T count)
+{
+    std::vector<long long> ints(count);
+    std::vector<double> doubles(count);
+    unsigned long long seed = 1;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        ints[i] = (long long)(seed >> 20) - (1ll << 42);
+        doubles[i] = (double)(seed >> 11) / (double)(1ull << 40);
+    }
+
+    Measure("format_int", "MString", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            MString line = {};
+            for (long long value : ints) line.AppendInt(value).Append(' ');
+            Clobber(line);
+        }
+    });
+    Measure("format_int", "snprintf", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::string line;
+            char buffer[32];
+            for (long long value : ints) line.append(buffer, (size_t)snprintf(buffer, sizeof(buffer), "%lld ", value));
+            Clobber(line);
+        }
+    });
+    Measure("format_double", "MString", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            MString line = {};
+            for (double value : doubles) line.AppendDouble(value).Append(' ');
+            Clobber(line);
+        }
+    });
+    Measure("format_double", "snprintf", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::string line;
+            char buffer[32];
+            for (double value : doubles) line.append(buffer, (size_t)snprintf(buffer, sizeof(buffer), "%.17g ", value));
+            Clobber(line);
+        }
+    });
+
+    MString text = {};
+    for (double value : doubles) text.AppendDouble(value).Append(' ');
+    Measure("parse_double", "MString", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            IString rest(text.Ptr(), text.Length());
+            double value, total = 0.0;
+            while (MSTRING_SIZE_T used = rest.ParseDouble(&value))
+            {
+                total += value;
+                rest = IString(rest.Ptr() + used + 1, rest.Length() - used - 1);
+            }
+            Clobber(total);
+        }
+    });
+    Measure("parse_double", "strtod", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            const char* rest = text.Ptr();
+            double total = 0.0;
+            for (MSTRING_SIZE_T j = 0; j < count; ++j) total += strtod(rest, (char**)&rest);
+            Clobber(total);
+        }
+    });
+}
+
+// UTF-8 validation and counting over mixed text, against the byte-at-a-time decoding loop that code
+// had to write before the library could do it.
+static void BenchmarkUTF8(MSTRING_SIZE_T length)
+{
+    MString text = {};
+    const char* words[] = {"plain ascii text ", (const char*)u8"مرحبا بالعالم ", (const char*)u8"你好世界 ", (const char*)u8"😀 "};
+    for (int i = 0; text.Length() < length; ++i) text.Append(words[(i % 7 == 0) ? 1 + (i / 7) % 3 : 0]);
+    text.SetLength(length);
+    while (!text.IsValidUTF8()) text.SetLength(text.Length() - 1);
+
+    Measure("validate_utf8", "MString", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += text.IsValidUTF8();
+    });
+    Measure("validate_utf8", "scalar", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            bool valid = true;
+            char32_t codepoint;
+            for (const char* p = text.Ptr(), *end = p + text.Length(); p < end && valid;)
+            {
+                MSTRING_SIZE_T size = MStringDecodeUTF8(p, end, &codepoint);
+                valid = codepoint != 0xFFFD || (size == 3 && memcmp(p, "\xEF\xBF\xBD", 3) == 0);
+                p += size;
+            }
+            sink += valid;
+        }
+    });
+    Measure("count_codepoints", "MString", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += text.CountCodepoints();
+    });
+    Measure("count_codepoints", "scalar", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            size_t count = 0;
+            for (char32_t codepoint : text.Codepoints()) count += (codepoint != 0);
+            sink += count;
+        }
+    });
+}
+
+// Splitting a log into lines, as views versus the usual std::string per line.
+static void BenchmarkLines(MSTRING_SIZE_T length)
+{
+    MString text = {};
+    for (int i = 0; text.Length() < length; ++i) text.Append("2024-01-01 12:00:00 INFO request handled in ").AppendInt(i % 1000).Append("ms\n");
+    std::string copy(text.Ptr(), text.Length());
+
+    Measure("split_lines", "MString", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            size_t total = 0;
+            for (IString line : text.Lines()) total += line.Length();
+            sink += total;
+        }
+    });
+    Measure("split_lines", "std::string", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            size_t total = 0;
+            for (size_t start = 0, end; start < copy.size(); start = end + 1)
+            {
+                end = copy.find('\n', start);
+                if (end == std::string::npos) end = copy.size();
+                std::string line = copy.substr(start, end - start);
+                total += line.size();
+            }
+            sink += total;
+        }
+    });
+}
+
+// Substring search on input that makes naive search quadratic: a haystack of 'a's, and a needle of
+// 'a's that ends in a 'b', so nearly every position matches all the way up to the last byte.
+static void BenchmarkPeriodicSearch(MSTRING_SIZE_T length)
+{
+    std::string haystack(length, 'a'), needle(63, 'a');
+    needle += 'b';
+    IString h(haystack.data(), length), s(needle.data(), (MSTRING_SIZE_T)needle.size());
+
+    Measure("find_periodic", "IString", length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += (size_t)h.Find(s);
+    });
+    Measure("find_periodic", "std::string", length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += haystack.find(needle);
+    });
+    Measure("rfind_periodic", "IString", length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += (size_t)h.RFind(s);
+    });
+    Measure("rfind_periodic", "std::string", length, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i) sink += haystack.rfind(needle);
+    });
+}
+
+// Template substitution and header normalization on a document, against the usual std::string loops.
+static void BenchmarkRewrites(MSTRING_SIZE_T length)
+{
+    MString text = {};
+    for (int i = 0; text.Length() < length; ++i) text.Append("Hello {name}, your order ").AppendInt(i).Append(" ships to {city} on {date}.\n");
+    std::string copy(text.Ptr(), text.Length());
+
+    Measure("replace_all", "MString", text.Length(), [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            MString result = text;
+            result.ReplaceAll("{name}", "Frog").ReplaceAll("{city}", "Lily Pad Falls").ReplaceAll("{date}", "Tuesday");
+            sink += result.Length();
+        }
+    });
+    Measure("replace_all", "std::string", text.Length(), [&](long long iterations)
+    {
+        const char* pairs[][2] = {{"{name}", "Frog"}, {"{city}", "Lily Pad Falls"}, {"{date}", "Tuesday"}};
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::string result = copy;
+            for (auto& pair : pairs)
+            {
+                size_t from_length = strlen(pair[0]), to_length = strlen(pair[1]);
+                for (size_t at = result.find(pair[0]); at != std::string::npos; at = result.find(pair[0], at + to_length))
+                {
+                    result.replace(at, from_length, pair[1], to_length);
+                }
+            }
+            sink += result.size();
+        }
+    });
+
+    Measure("to_lower", "MString", text.Length(), [&](long long iterations)
+    {
+        MString result = text;
+        for (long long i = 0; i < iterations; ++i)
+        {
+            result.ToLower();
+            Clobber(result);
+        }
+        sink += FirstByte(result);
+    });
+    Measure("to_lower", "std::string", text.Length(), [&](long long iterations)
+    {
+        std::string result = copy;
+        for (long long i = 0; i < iterations; ++i)
+        {
+            for (char& c : result) c = (char)tolower((unsigned char)c);
+            Clobber(result);
+        }
+        sink += FirstByte(result);
+    });
+}
+
+// Heap churn from several threads at once, with strings just past the short string limit, since that
+// is where the allocator gets hit the hardest. Every thread keeps replacing the strings in a ring, so
+// each iteration is one allocation, some appending and one free, per thread.
+template <class S>
+static void BenchmarkChurn(const char* type, int thread_count)
+{
+    Measure("thread_churn", type, (MSTRING_SIZE_T)thread_count, [&](long long iterations)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t) threads.emplace_back([iterations]
+        {
+            S ring[64] = {};
+            for (long long i = 0; i < iterations; ++i)
+            {
+                S& str = ring[i & 63];
+                str = S("a string that is past the limit");
+                for (long long j = 0; j < (i & 7); ++j) str += "and a bit more";
+            }
+            for (S& str : ring) sink += FirstByte(str);
+        });
+        for (std::thread& thread : threads) thread.join();
+    });
+}
+
+// A hash map keyed by identifiers between 24 and 60 bytes long, which is past the default short string
+// limit, but mostly inside MString64's. Each iteration builds the map and looks every key up again.
+template <class S>
+static void BenchmarkIdentifierMap(const char* type, MSTRING_SIZE_T count)
+{
+    std::vector<std::string> identifiers;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        std::string id = "module.component_" + std::to_string(i * 7919);
+        while (id.size() < 24 + (i * 37) % 37) id += "_field";
+        id.resize(24 + (i * 37) % 37);
+        identifiers.push_back(id);
+    }
+    Measure("identifier_map", type, count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::unordered_map<S, int> map;
+            for (MSTRING_SIZE_T j = 0; j < count; ++j) map.emplace(S(identifiers[j].data(), identifiers[j].size()), (int)j);
+            for (MSTRING_SIZE_T j = 0; j < count; ++j) sink += (size_t)map.find(S(identifiers[j].data(), identifiers[j].size()))->second;
+        }
+    });
+}
+
+// Sorting a million keys, a mix of short codes and longer paths with shared prefixes. Every iteration
+// shuffles the array the same way first, which costs the same for every type.
+static void SortStrings(std::vector<MString>& strings, bool parallel) {MStringSort(strings.data(), strings.size(), parallel);}
+static void SortStrings(std::vector<std::string>& strings, bool) {std::sort(strings.begin(), strings.end());}
+
+template <class S>
+static void BenchmarkSort(const char* type, MSTRING_SIZE_T count, bool parallel)
+{
+    std::vector<S> strings;
+    unsigned int seed = 1;
+    char buffer[64];
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        int length = (seed >> 28 & 1) ? snprintf(buffer, sizeof(buffer), "%x", seed)
+                                      : snprintf(buffer, sizeof(buffer), "services/storage/index/segment_%u", seed >> 12);
+        strings.emplace_back(buffer, length);
+    }
+    Measure(parallel ? "sort_parallel" : "sort", type, count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::mt19937 rng(7);
+            std::shuffle(strings.begin(), strings.end(), rng);
+            SortStrings(strings, parallel);
+            sink += FirstByte(strings[0]);
+        }
+    });
+}
+
+// A dictionary of keys, built into a table versus a vector of MStrings, and then loaded from disk
+// (mapped, versus splitting a text file into a vector).
+static void BenchmarkTable(MSTRING_SIZE_T count)
+{
+    std::vector<MString> keys;
+    char buffer[64];
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        int length = snprintf(buffer, sizeof(buffer), "dictionary/entries/%08x/word", (unsigned)(i * 2654435761u));
+        keys.emplace_back(buffer, length);
+    }
+
+    Measure("table_build", "MStringTable", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            MStringTable table;
+            table.Append(keys.data(), keys.size());
+            sink += table.DataLength();
+        }
+    });
+    Measure("table_build", "vector<MString>", count, [&](long long iterations)
+    {
+        for (long long i = 0; i < iterations; ++i)
+        {
+            std::vector<MString> copy;
+            copy.reserve(keys.size());
+            for (const MString& key : keys) copy.emplace_back(key.Ptr(), key.Length());
+            sink += copy.size();
+        }
+    });
+
+    const char* table_path = "MStringBenchmarkTable.tmp";
+    const char* text_path = "MStringBenchmarkText.tmp";
+    MStringTable table;
+    table.Append(keys.data(), keys.size());
+    MString text = {};
+    for (const MString& key : keys) text.Append(key).Append('\n');
+    FILE* file = fopen(text_path, "wb");
+    bool saved = table.Save(table_path) && file && fwrite(text.Ptr(), 1, text.Length(), file) == text.Length();
+    if (file) fclose(file);
+    if (saved)
+    {
+        Measure("table_load", "MStringTable", count, [&](long long iterations)
+        {
+            for (long long i = 0; i < iterations; ++i)
+            {
+                MStringTable loaded;
+                loaded.Load(table_path);
+                for (MSTRING_SIZE_T j = 0; j < loaded.Count(); ++j) sink += loaded[j].Length();
+            }
+        });
+        Measure("table_load", "vector<MString>", count, [&](long long iterations)
+        {
+            for (long long i = 0; i < iterations; ++i)
+            {
+                MStringMappedFile mapped(text_path);
+                std::vector<MString> loaded;
+                for (IString line : mapped.Lines()) loaded.emplace_back(line);
+                sink += loaded[loaded.size() / 2].Length();
+            }
+        });
+    }
+    remove(table_path);
+    remove(text_path);
+}
+
+// Editor-style workload: a big document, and lots of small edits around a cursor that wanders slowly.
+static void BenchmarkLocalizedEdits(MSTRING_SIZE_T document_size, int edit_count)
+{
+    if (filter && !strstr("localized_edits", filter)) return;
+
+    MString document = {};
+    document.SetLength(document_size);
+    for (MSTRING_SIZE_T i = 0; i < document_size; ++i) document[i] = 'a' + (char)(i % 26);
+
+    unsigned seed = 1;
+    auto next_cursor = [&seed](MSTRING_SIZE_T cursor, MSTRING_SIZE_T length)
+    {
+        seed = seed * 1103515245u + 12345u;
+        MSTRING_SIZE_T step = (seed >> 16) % 64;
+        cursor = ((seed >> 8) & 1) ? cursor + step : (cursor > step) ? cursor - step : 0;
+        return (cursor > length) ? length : cursor;
+    };
+
+    MString with_memmove = document;
+    auto start = std::chrono::steady_clock::now();
+    MSTRING_SIZE_T cursor = document_size / 2;
+    for (int i = 0; i < edit_count; ++i)
+    {
+        cursor = next_cursor(cursor, with_memmove.Length());
+        if (i % 3 == 2 && cursor + 4 <= with_memmove.Length()) with_memmove.Remove(cursor, 4);
+        else with_memmove.Insert(cursor, "edit", 4);
+    }
+    double memmove_time = Seconds(start);
+
+    seed = 1;
+    MStringEditor editor{MString(document)};
+    start = std::chrono::steady_clock::now();
+    cursor = document_size / 2;
+    for (int i = 0; i < edit_count; ++i)
+    {
+        cursor = next_cursor(cursor, editor.Length());
+        if (i % 3 == 2 && cursor + 4 <= editor.Length()) editor.Remove(cursor, 4);
+        else editor.Insert(cursor, "edit", 4);
+    }
+    MString result = editor.Take();
+    double editor_time = Seconds(start);
+
+    if (!(result == with_memmove)) printf("localized_edits: RESULTS DIFFER!\n");
+    BenchmarkResult memmove_result = {"localized_edits", "MString", (unsigned long long)document_size, memmove_time * 1e9 / edit_count, edit_count};
+    BenchmarkResult editor_result = {"localized_edits", "MStringEditor", (unsigned long long)document_size, editor_time * 1e9 / edit_count, edit_count};
+    for (const BenchmarkResult& r : {memmove_result, editor_result})
+    {
+        results.push_back(r);
+        printf("%-20s %-16s %8llu %12.2f ns\n", r.benchmark, r.type, r.length, r.ns_per_op);
+    }
+}
+
+static bool WriteCSV(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "benchmark,type,length,ns_per_op,iterations,size_type_bytes,max_short_length,compiler,commit\n");
+    for (const BenchmarkResult& r : results)
+    {
+        fprintf(file, "%s,%s,%llu,%.4f,%lld,%d,%d,\"%s\",%s\n", r.benchmark, r.type, r.length, r.ns_per_op, r.iterations,
+                (int)sizeof(MSTRING_SIZE_T), (int)MString::MaxShortLength, MSTRING_BENCHMARK_COMPILER, MSTRING_BENCHMARK_COMMIT);
+    }
+    return fclose(file) == 0;
+}
+
+static bool WriteJSON(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "{\n  \"compiler\": \"%s\",\n  \"commit\": \"%s\",\n  \"size_type_bytes\": %d,\n  \"max_short_length\": %d,\n  \"results\": [\n",
+            MSTRING_BENCHMARK_COMPILER, MSTRING_BENCHMARK_COMMIT, (int)sizeof(MSTRING_SIZE_T), (int)MString::MaxShortLength);
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchmarkResult& r = results[i];
+        fprintf(file, "    {\"benchmark\": \"%s\", \"type\": \"%s\", \"length\": %llu, \"ns_per_op\": %.4f, \"iterations\": %lld}%s\n",
+                r.benchmark, r.type, r.length, r.ns_per_op, r.iterations, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* csv_path = nullptr;
+    const char* json_path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--quick")) {min_run_seconds = 0.002; repetitions = 2;}
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "--csv") && i + 1 < argc) csv_path = argv[++i];
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc) json_path = argv[++i];
+        else
+        {
+            printf("Usage: %s [--quick] [--filter name] [--csv path] [--json path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("MString benchmarks: %d byte size type, %d byte short strings, %s, commit %s\n\n",
+           (int)sizeof(MSTRING_SIZE_T), (int)MString::MaxShortLength, MSTRING_BENCHMARK_COMPILER, MSTRING_BENCHMARK_COMMIT);
+
+    // Lengths on both sides of the short string limits for 4 and 8 byte size types (15 and 23), and
+    // libstdc++'s (15), plus a few longer ones.
+    const MSTRING_SIZE_T lengths[] = {0, 8, 14, 15, 16, 22, 23, 24, 32, 64, 256, 4096, 65536};
+    for (MSTRING_SIZE_T length : lengths)
+    {
+        BenchmarkStrings<MString>("MString", length);
+        BenchmarkStrings<std::string>("std::string", length);
+#ifdef MSTRING_BENCHMARK_STRING_VIEW
+        BenchmarkViews<IString>("IString", length);
+        BenchmarkViews<std::string_view>("std::string_view", length);
+#endif
+    }
+    BenchmarkNumbers(1000);
+    BenchmarkUTF8(4096);
+    BenchmarkUTF8(1024 * 1024);
+    BenchmarkLines(1024 * 1024);
+    BenchmarkPeriodicSearch(65536);
+    BenchmarkRewrites(4096);
+    BenchmarkRewrites(1024 * 1024);
+    for (int threads : {1, 4})
+    {
+        BenchmarkChurn<MString>("MString", threads);
+        BenchmarkChurn<std::string>("std::string", threads);
+    }
+    BenchmarkSort<MString>("MString", 1000000, false);
+    BenchmarkSort<MString>("MString", 1000000, true);
+    BenchmarkSort<std::string>("std::string", 1000000, false);
+    BenchmarkIdentifierMap<MString>("MString", 10000);
+    BenchmarkIdentifierMap<MString64>("MString64", 10000);
+    BenchmarkIdentifierMap<std::string>("std::string", 10000);
+    BenchmarkTable(1000000);
+    BenchmarkLocalizedEdits(64 * 1024, 100000);
+    BenchmarkLocalizedEdits(4 * 1024 * 1024, 100000);
+
+    if (csv_path && !WriteCSV(csv_path)) {printf("Couldn't write %s\n", csv_path); return 1;}
+    if (json_path && !WriteJSON(json_path)) {printf("Couldn't write %s\n", json_path); return 1;}
+    return 0;
+}
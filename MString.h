@@ -13,10 +13,17 @@
 // short strings to be 23 bytes long. A 4-byte integer type produces a 16 byte struct and allows 15-byte
 // short strings. This type can be signed or unsigned, whichever you prefer (this library doesn't use
 // negative values anywhere, and the asserts/bounds checks do still check for incorrect negative values).
-typedef size_t MSTRING_SIZE_T;
+// You can also #define MSTRING_SIZE_TYPE before every include of this header instead of editing it.
+// MString is the default size of BasicMString, and if you want a different short string limit for
+// some of your strings, you can use another size of it (see BasicMString).
+#ifndef MSTRING_SIZE_TYPE
+#include <stddef.h>
+#define MSTRING_SIZE_TYPE size_t
+#endif
+typedef MSTRING_SIZE_TYPE MSTRING_SIZE_T;
 
-// If you #define your own MSTRING_MALLOC, MSTRING_REALLOC, and MSTRING_FREE,
-// then we don't need to #include <stdlib.h>, and will use your versions instead.
+// If you #define your own MSTRING_MALLOC, MSTRING_REALLOC, MSTRING_FREE, and MSTRING_STRTOD (which is
+// only used to parse hard doubles), then we don't need to #include <stdlib.h>, and will use your versions instead.
 
 // If you #define MSTRING_MEMCPY, MSTRING_MEMMOVE, MSTRING_MEMCMP, and MSTRING_STRLEN,
 // then we don't need to #include <string.h>, and will use your versions instead.
@@ -24,6 +31,317 @@ typedef size_t MSTRING_SIZE_T;
 // If you #define MSTRING_ASSERT, then we don't need to #include <assert.h>.
 // You can also define it to nothing if you don't want the asserts at all.
 
+// On x86, we use SSE2 everywhere and check for SSSE3 and AVX2 support at runtime. If you #define
+// MSTRING_NO_SIMD, then we don't include any intrinsics headers and just use the scalar versions of everything.
+
+// If you #define MSTRING_STATS, then we count allocations, growth and string lengths, which you can read
+// with MStringStatsSnapshot(). Only the implementation needs to see this macro. Without it, none of the
+// counting code gets compiled, and the snapshot is always empty.
+
+// If you #define MSTRING_POOL, then heap buffers that don't come from an MStringAllocator come from a
+// built-in pool, instead of going to MSTRING_MALLOC and MSTRING_FREE every time. Sizes get rounded up
+// to size classes (16 byte steps up to 128, then four per power of two up to 32KB), and every thread
+// keeps its own cache of free buffers for each class, so most allocations and frees don't touch malloc
+// or take any locks. Only the implementation needs to see this macro.
+
+// If you #define MSTRING_GOOD_SIZE(size), then we round default heap buffer sizes up with it, and use
+// the extra bytes as capacity. For example, jemalloc's nallocx(size, 0) would work. MSTRING_POOL
+// defines it to round up to its size classes.
+
+// If you #define MSTRING_COPY_ON_WRITE, then copies of heap strings share one reference-counted buffer,
+// and only make their own copy the first time they get mutated. Short strings are unaffected. Only the
+// implementation needs to see this macro. Reference counts are atomic, so copies can be handed to other
+// threads, unless you also #define MSTRING_SINGLE_THREADED.
+
+// We provide std::hash specializations for IString, MString and IAtom, which means that we need to
+// #include <functional>. If you #define MSTRING_NO_STD_HASH, then we won't.
+
+// When compiling as C++20, IString and MString get operator<=> as well as the other comparison
+// operators, which needs <compare>.
+#if __cplusplus >= 202002L || (defined _MSVC_LANG && _MSVC_LANG >= 202002L)
+#include <compare>
+#define MSTRING_THREE_WAY_COMPARE 1
+#endif
+
+// The file helpers (MStringMappedFile, MStringFileReader and MStringReadFile) need <stdio.h> and the
+// OS headers for memory mapping in the implementation. If you #define MSTRING_NO_FILES, then we
+// don't include any of those, and the file helpers don't exist.
+
+// Hashes some bytes. This is wyhash for shorter inputs, and an xxh3-style vectorized loop for longer
+// ones. It is fast and good enough for hash tables, but it is not cryptographically secure. Results
+// are the same on every code path within a build, but don't store them on disk.
+unsigned int MStringHash(const void* data, MSTRING_SIZE_T length, unsigned int seed = 0);
+
+// The same hash, at compile time (see the _hash literal below). It gives exactly the same results as
+// MStringHash() on little-endian machines, just slower, since it can only read a byte at a time.
+constexpr unsigned int MStringConstHash(const char* str, MSTRING_SIZE_T length, unsigned int seed = 0);
+
+// Hash constants. Inputs longer than MStringHashLongThreshold are hashed xxh3-style: 8 lanes of 64-bit
+// accumulators eat 64-byte stripes, each lane doing a 32x32 -> 64 bit multiply of the input xor-ed
+// with a key, and the lanes get scrambled after every block of 16 stripes. Stripe n of a block uses
+// the key at byte offset n * 8.
+constexpr static unsigned long long MStringHashSecret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+constexpr static MSTRING_SIZE_T MStringHashLongThreshold = 256;
+constexpr static MSTRING_SIZE_T MStringHashStripesPerBlock = 16;
+constexpr static MSTRING_SIZE_T MStringHashScrambleKey = 128;
+constexpr static MSTRING_SIZE_T MStringHashLastStripeKey = 71;
+constexpr static unsigned long long MStringHashPrime32 = 0x9E3779B1ull;
+alignas(32) constexpr static unsigned long long MStringHashLongSecret[24] =
+{
+    0x6e789e6aa1b965f4ull, 0x06c45d188009454full, 0xf88bb8a8724c81ecull, 0x1b39896a51a8749bull,
+    0x53cb9f0c747ea2eaull, 0x2c829abe1f4532e1ull, 0xc584133ac916ab3cull, 0x3ee5789041c98ac3ull,
+    0xf3b8488c368cb0a6ull, 0x657eecdd3cb13d09ull, 0xc2d326e0055bdef6ull, 0x8621a03fe0bbdb7bull,
+    0x8e1f7555983aa92full, 0xb54e0f1600cc4d19ull, 0x84bb3f97971d80abull, 0x7d29825c75521255ull,
+    0xc3cf17102b7f7f86ull, 0x3466e9a083914f64ull, 0xd81a8d2b5a4485acull, 0xdb01602b100b9ed7ull,
+    0xa9038a921825f10dull, 0xedf5f1d90dca2f6aull, 0x54496ad67bd2634cull, 0xdd7c01d4f5407269ull,
+};
+
+// 64x64 -> 128 bit multiply, returning the high and low halves xor-ed together.
+constexpr unsigned long long MStringConstMix(unsigned long long a, unsigned long long b)
+{
+    unsigned long long ha = a >> 32, hb = b >> 32, la = (unsigned int)a, lb = (unsigned int)b;
+    unsigned long long rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    unsigned long long t = rl + (rm0 << 32);
+    unsigned long long lo = t + (rm1 << 32);
+    unsigned long long hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    return lo ^ hi;
+}
+
+// Little-endian reads, from a string or from the long secret.
+constexpr unsigned long long MStringConstRead(const char* p, int bytes)
+{
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; ++i) value |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+    return value;
+}
+
+constexpr unsigned long long MStringConstKey(MSTRING_SIZE_T offset)
+{
+    unsigned long long value = 0;
+    for (MSTRING_SIZE_T i = offset; i < offset + 8; ++i) value |= ((MStringHashLongSecret[i / 8] >> (8 * (i % 8))) & 0xff) << (8 * (i - offset));
+    return value;
+}
+
+constexpr void MStringConstStripe(unsigned long long* acc, const char* p, MSTRING_SIZE_T key)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        unsigned long long value = MStringConstRead(p + i * 8, 8);
+        unsigned long long keyed = value ^ MStringConstKey(key + i * 8);
+        acc[i ^ 1] += value;
+        acc[i] += (keyed & 0xffffffffull) * (keyed >> 32);
+    }
+}
+
+constexpr unsigned int MStringConstHash(const char* p, MSTRING_SIZE_T length, unsigned int seed_in)
+{
+    const unsigned long long* s = MStringHashSecret;
+    unsigned long long seed = seed_in ^ MStringConstMix(seed_in ^ s[0], s[1]);
+    unsigned long long h = 0;
+    if (length > MStringHashLongThreshold)
+    {
+        unsigned long long acc[8] =
+        {
+            MStringHashPrime32, 0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+            0x85EBCA77C2B2AE63ull, 0x85EBCA77ull, 0x27D4EB2F165667C5ull, 0xC2B2AE3Dull,
+        };
+        MSTRING_SIZE_T stripes = (length - 1) / 64;
+        for (MSTRING_SIZE_T n = 0; n < stripes; ++n)
+        {
+            MStringConstStripe(acc, p + n * 64, (n % MStringHashStripesPerBlock) * 8);
+            if (n % MStringHashStripesPerBlock != MStringHashStripesPerBlock - 1) continue;
+            for (int i = 0; i < 8; ++i) acc[i] = (acc[i] ^ (acc[i] >> 47) ^ MStringConstKey(MStringHashScrambleKey + i * 8)) * MStringHashPrime32;
+        }
+        MStringConstStripe(acc, p + length - 64, MStringHashLastStripeKey);
+
+        h = length * 0x9E3779B185EBCA87ull;
+        for (int i = 0; i < 4; ++i) h += MStringConstMix(acc[i * 2] ^ MStringConstKey(11 + i * 16), acc[i * 2 + 1] ^ MStringConstKey(19 + i * 16));
+        h = MStringConstMix(h ^ seed, s[1] ^ length);
+        return (unsigned int)(h ^ (h >> 32));
+    }
+
+    unsigned long long a = 0, b = 0;
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            a = (MStringConstRead(p, 4) << 32) | MStringConstRead(p + ((length >> 3) << 2), 4);
+            b = (MStringConstRead(p + length - 4, 4) << 32) | MStringConstRead(p + length - 4 - ((length >> 3) << 2), 4);
+        }
+        else if (length > 0)
+        {
+            a = ((unsigned long long)(unsigned char)p[0] << 16) | ((unsigned long long)(unsigned char)p[length >> 1] << 8) | (unsigned char)p[length - 1];
+        }
+    }
+    else
+    {
+        MSTRING_SIZE_T i = length;
+        if (i > 48)
+        {
+            unsigned long long see1 = seed, see2 = seed;
+            do
+            {
+                seed = MStringConstMix(MStringConstRead(p, 8) ^ s[1], MStringConstRead(p + 8, 8) ^ seed);
+                see1 = MStringConstMix(MStringConstRead(p + 16, 8) ^ s[2], MStringConstRead(p + 24, 8) ^ see1);
+                see2 = MStringConstMix(MStringConstRead(p + 32, 8) ^ s[3], MStringConstRead(p + 40, 8) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = MStringConstMix(MStringConstRead(p, 8) ^ s[1], MStringConstRead(p + 8, 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = MStringConstRead(p + i - 16, 8);
+        b = MStringConstRead(p + i - 8, 8);
+    }
+    h = MStringConstMix(s[1] ^ length, MStringConstMix(a ^ s[1], b ^ seed));
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+// Returned by the search functions when there is no match.
+constexpr MSTRING_SIZE_T MStringNotFound = (MSTRING_SIZE_T)-1;
+
+// Interface for custom allocators (arenas, frame allocators, etc). By default MString heap buffers
+// go through MSTRING_MALLOC/MSTRING_REALLOC/MSTRING_FREE, but while an MStringAllocatorScope is alive
+// on the current thread, any new heap buffer comes from that scope's allocator instead. The buffer
+// remembers which allocator made it, so growing, shrinking and freeing it later always goes back to
+// the right place, even after the scope has ended. Sizes passed in always include the null terminator.
+struct MStringAllocator
+{
+    virtual void* Allocate(MSTRING_SIZE_T size) = 0;
+    virtual void* Reallocate(void* ptr, MSTRING_SIZE_T old_size, MSTRING_SIZE_T new_size) = 0;
+    virtual void Free(void* ptr, MSTRING_SIZE_T size) = 0;
+
+    // The allocator used for new heap buffers on this thread, or null for the default MSTRING_MALLOC.
+    static MStringAllocator* Current();
+};
+
+// Makes an allocator current for this thread until the scope ends. Scopes can be nested.
+struct MStringAllocatorScope
+{
+    explicit MStringAllocatorScope(MStringAllocator* allocator);
+    ~MStringAllocatorScope();
+    MStringAllocatorScope(const MStringAllocatorScope&) = delete;
+    MStringAllocatorScope& operator=(const MStringAllocatorScope&) = delete;
+
+    private:
+    MStringAllocator* previous;
+};
+
+// A simple bump allocator. Allocations are carved out of big blocks and are only actually freed all
+// at once, by Reset() or the destructor. The newest allocation can grow and shrink in place, which
+// means that building up a single string in an arena basically never has to copy. Strings allocated
+// from an arena must not outlive it (or be used after a Reset()).
+struct MStringArena : MStringAllocator
+{
+    explicit MStringArena(MSTRING_SIZE_T block_size = 64 * 1024) : block_size(block_size) {}
+    ~MStringArena();
+    MStringArena(const MStringArena&) = delete;
+    MStringArena& operator=(const MStringArena&) = delete;
+
+    void* Allocate(MSTRING_SIZE_T size) override;
+    void* Reallocate(void* ptr, MSTRING_SIZE_T old_size, MSTRING_SIZE_T new_size) override;
+    void Free(void* ptr, MSTRING_SIZE_T size) override;
+
+    // Releases every allocation at once. Keeps the most recent block around for reuse.
+    void Reset();
+
+    private:
+    struct Block
+    {
+        Block* next;
+        MSTRING_SIZE_T size;
+        MSTRING_SIZE_T used;
+    };
+    Block* blocks = nullptr;
+    char* last = nullptr; // Most recent allocation, which is the only one we can resize in place.
+    MSTRING_SIZE_T block_size;
+};
+
+// Memory instrumentation counters (see MSTRING_STATS). Each thread counts into its own copy, and the
+// snapshot adds them all up. Byte counts include the null terminator and any buffer headers.
+struct MStringStats
+{
+    bool enabled;                             // False if the implementation was built without MSTRING_STATS.
+    unsigned long long constructions;         // Strings constructed from a C string, IString, etc.
+    unsigned long long copies;                // Copy constructions and assignments.
+    unsigned long long shared_copies;         // Copies that shared a buffer instead of allocating (MSTRING_COPY_ON_WRITE).
+    unsigned long long moves;                 // Move constructions and assignments.
+    unsigned long long short_placements;      // Constructions and copies that fit in a short string.
+    unsigned long long heap_placements;       // Strings that started out on the heap, or moved there by growing.
+    unsigned long long expansions;            // Times ExpandIfNeeded() actually had to grow a string.
+    unsigned long long allocations;           // Heap buffers allocated.
+    unsigned long long reallocations;         // Heap buffers resized.
+    unsigned long long frees;                 // Heap buffers freed.
+    unsigned long long bytes_allocated;       // Bytes gained from allocations, and reallocations that grew.
+    unsigned long long bytes_freed;           // Bytes given back by frees, and reallocations that shrunk.
+    unsigned long long freed_capacity;        // Total capacity of heap buffers when they were freed...
+    unsigned long long freed_length;          // ...and the total length that was actually in them.
+    unsigned long long shrinks;               // ShrinkToFit() calls that gave anything back.
+    unsigned long long shrink_bytes_saved;    // Bytes that those calls gave back.
+    unsigned long long length_histogram[64];  // Lengths of strings when they get freed. Bucket i counts
+                                              // lengths in [2^i, 2^(i+1)). Empty strings aren't counted,
+                                              // since every moved-from string is empty.
+};
+
+// Returns the counts from every thread since the last reset, including threads that have exited.
+MStringStats MStringStatsSnapshot();
+// Starts counting from zero again, for every thread.
+void MStringStatsReset();
+
+// Frees the buffers cached by the pool (see MSTRING_POOL): all of this thread's, and all of the ones
+// that other threads have handed back to the shared lists. We can't touch other threads' own caches,
+// but those get handed back when the thread exits. Does nothing without MSTRING_POOL.
+void MStringPoolTrim();
+
+// UTF-8 helpers. Decoding returns how many bytes the codepoint at the start of [ptr, end) took up.
+// Invalid or truncated sequences decode as U+FFFD, one "maximal subpart" at a time like browsers do,
+// so decoding always makes progress. Encoding writes up to 4 bytes and returns how many it wrote.
+// Codepoints that can't be encoded (surrogates, or past U+10FFFF) are written as U+FFFD.
+MSTRING_SIZE_T MStringDecodeUTF8(const char* ptr, const char* end, char32_t* codepoint);
+MSTRING_SIZE_T MStringEncodeUTF8(char32_t codepoint, char* dst);
+
+// Iterates over the codepoints in some UTF-8, decoding them with MStringDecodeUTF8().
+struct MStringCodepointIterator
+{
+    MStringCodepointIterator(const char* ptr, const char* end) : ptr(ptr), end(end) {Decode();}
+
+    char32_t operator*() const {return codepoint;}
+    MStringCodepointIterator& operator++() {ptr += size; Decode(); return *this;}
+    bool operator==(const MStringCodepointIterator& other) const {return ptr == other.ptr;}
+    bool operator!=(const MStringCodepointIterator& other) const {return ptr != other.ptr;}
+    const char* Ptr() const {return ptr;} // Where the current codepoint starts.
+
+    private:
+    void Decode()
+    {
+        if (ptr >= end) size = 0;
+        else if ((unsigned char)*ptr < 0x80) codepoint = (unsigned char)*ptr, size = 1;
+        else size = MStringDecodeUTF8(ptr, end, &codepoint);
+    }
+
+    const char* ptr;
+    const char* end;
+    char32_t codepoint = 0;
+    MSTRING_SIZE_T size = 0;
+};
+
+struct MStringCodepoints
+{
+    MStringCodepointIterator begin() const {return {first, last};}
+    MStringCodepointIterator end() const {return {last, last};}
+    const char* first;
+    const char* last;
+};
+
+struct MStringSplit;
+struct MStringEditor;
+template <int N, int InlineBytes> struct MStringChain;
+
 // An immutable string. Can be a wrapper for a const char* and length, or for other data.
 // This does not own the string memory, and we don't do any checks for validity, this
 // is just a convenience wrapper to simplify passing strings around.
@@ -32,6 +350,7 @@ struct IString
     IString() = default;
     IString(const char* ptr);
     constexpr IString(const char* ptr, MSTRING_SIZE_T length) : ptr(ptr), length(length) {}
+    IString(MStringEditor& editor); // Closes the editor's gap. A constructor, so (IString)editor isn't ambiguous.
     constexpr operator const char*() const {return ptr;}
 
     // Accessors for length and pointer. I would leave these as public fields, but
@@ -47,53 +366,251 @@ struct IString
     constexpr const char* begin() const {return Ptr();}
     constexpr const char* end() const {return Ptr() + Length();}
 
+    // Same as MStringHash(Ptr(), Length()).
+    unsigned int Hash() const;
+
+    // Searching. These return a byte index, or MStringNotFound if there is no match. Forward searches
+    // can start partway through the string. Substring searches in both directions stay linear, even
+    // for nasty inputs.
+    MSTRING_SIZE_T Find(char c, MSTRING_SIZE_T start = 0) const;
+    MSTRING_SIZE_T Find(IString str, MSTRING_SIZE_T start = 0) const;
+    MSTRING_SIZE_T RFind(char c) const;
+    MSTRING_SIZE_T RFind(IString str) const;
+    MSTRING_SIZE_T FindAnyOf(IString set, MSTRING_SIZE_T start = 0) const; // First byte that is in the set.
+    MSTRING_SIZE_T FindNotOf(IString set, MSTRING_SIZE_T start = 0) const; // First byte that is not in the set.
+    MSTRING_SIZE_T Count(char c) const;
+    MSTRING_SIZE_T Count(IString str) const; // Counts non-overlapping occurrences.
+    bool Contains(char c) const    {return Find(c) != MStringNotFound;}
+    bool Contains(IString str) const {return Find(str) != MStringNotFound;}
+    bool StartsWith(IString str) const;
+    bool EndsWith(IString str) const;
+
+    // Trimming. These return a view without the ASCII whitespace (space, \t, \n, \v, \f and \r) at
+    // either end, or both.
+    IString Trim() const;
+    IString TrimLeft() const;
+    IString TrimRight() const;
+
+    // Number parsing. These parse a number from the start of the string, and return how many bytes it
+    // took up, or 0 if there isn't a valid number there (value is left alone in that case). There is
+    // no whitespace skipping, and nothing past the string length gets read, so the string doesn't need
+    // a null terminator. Check the result against Length() to make sure the whole string was a number.
+    // ParseInt and ParseUInt accept an optional sign followed by decimal digits, and fail on overflow.
+    // ParseDouble accepts the usual decimal and exponent forms, as well as "inf" and "nan" (in any case),
+    // and rounds correctly. It doesn't depend on the C locale.
+    MSTRING_SIZE_T ParseInt(long long* value) const;
+    MSTRING_SIZE_T ParseUInt(unsigned long long* value) const;
+    MSTRING_SIZE_T ParseDouble(double* value) const;
+
+    // UTF-8. Validation checks for everything that the standard rules out (overlong forms, surrogates,
+    // codepoints past U+10FFFF, truncated sequences), and like the searches it uses SIMD and runs at
+    // close to memory speed. Counting is exact for valid UTF-8, since it just counts the bytes that
+    // aren't continuation bytes (10xxxxxx). Transcoding validates as it goes, and returns how many code
+    // units it wrote, or MStringNotFound if the string isn't valid UTF-8. It never writes more than
+    // UTF16Length() or CountCodepoints() units, even for invalid input.
+    bool IsValidUTF8() const;
+    MSTRING_SIZE_T CountCodepoints() const;
+    MSTRING_SIZE_T UTF16Length() const; // Number of UTF-16 code units, counting surrogate pairs as 2.
+    MSTRING_SIZE_T ToUTF16(char16_t* dst) const;
+    MSTRING_SIZE_T ToUTF32(char32_t* dst) const;
+    MStringCodepoints Codepoints() const {return {ptr, ptr + length};} // For range-based for loops.
+
+    // Splitting, without copying anything. See MStringSplit.
+    MStringSplit Split(char delimiter) const;
+    MStringSplit Lines() const;
+
+    // Three-way comparison in byte order, like memcmp(), except that a string comes before anything
+    // that it is a prefix of. Returns a negative number, zero, or a positive number.
+    int Compare(IString other) const;
+
     // Comparison operators. Comparison with MString is implemented inside of MString.
-    inline friend bool operator==(IString lhs, IString rhs);
-    inline friend bool operator==(IString lhs, const char* rhs);
-    inline friend bool operator==(const char* lhs, IString rhs);
+    friend bool operator==(IString lhs, IString rhs);
+    friend bool operator==(IString lhs, const char* rhs);
+    friend bool operator==(const char* lhs, IString rhs);
     inline friend bool operator!=(IString lhs, IString rhs)     {return !(lhs == rhs);}
     inline friend bool operator!=(IString lhs, const char* rhs) {return !(lhs == rhs);}
     inline friend bool operator!=(const char* lhs, IString rhs) {return !(lhs == rhs);}
 
+    // Ordering. Without these, the conversion to const char* would quietly compare pointers.
+    inline friend bool operator<(IString lhs, IString rhs)      {return lhs.Compare(rhs) < 0;}
+    inline friend bool operator<(IString lhs, const char* rhs)  {return lhs.Compare(rhs) < 0;}
+    inline friend bool operator<(const char* lhs, IString rhs)  {return IString(lhs).Compare(rhs) < 0;}
+    inline friend bool operator>(IString lhs, IString rhs)      {return lhs.Compare(rhs) > 0;}
+    inline friend bool operator>(IString lhs, const char* rhs)  {return lhs.Compare(rhs) > 0;}
+    inline friend bool operator>(const char* lhs, IString rhs)  {return IString(lhs).Compare(rhs) > 0;}
+    inline friend bool operator<=(IString lhs, IString rhs)     {return lhs.Compare(rhs) <= 0;}
+    inline friend bool operator<=(IString lhs, const char* rhs) {return lhs.Compare(rhs) <= 0;}
+    inline friend bool operator<=(const char* lhs, IString rhs) {return IString(lhs).Compare(rhs) <= 0;}
+    inline friend bool operator>=(IString lhs, IString rhs)     {return lhs.Compare(rhs) >= 0;}
+    inline friend bool operator>=(IString lhs, const char* rhs) {return lhs.Compare(rhs) >= 0;}
+    inline friend bool operator>=(const char* lhs, IString rhs) {return IString(lhs).Compare(rhs) >= 0;}
+#ifdef MSTRING_THREE_WAY_COMPARE
+    inline friend std::strong_ordering operator<=>(IString lhs, IString rhs)     {return lhs.Compare(rhs) <=> 0;}
+    inline friend std::strong_ordering operator<=>(IString lhs, const char* rhs) {return lhs.Compare(rhs) <=> 0;}
+    inline friend std::strong_ordering operator<=>(const char* lhs, IString rhs) {return IString(lhs).Compare(rhs) <=> 0;}
+#endif
+
     private:
     const char* ptr;
     MSTRING_SIZE_T length;
 };
 
+// Splits a string at a delimiter, handing out each piece as an IString view into the original. Pieces
+// are found with the same SIMD search as Find(), so there are no copies and no allocations. A delimiter
+// at the very end doesn't produce an empty last piece, so "a\nb\n" is two lines, not three. Lines()
+// also drops the '\r' from "\r\n" line endings. Use a range-based for loop, or call Next() until it
+// returns false.
+struct MStringSplitIterator;
+struct MStringSplit
+{
+    MStringSplit(IString str, char delimiter, bool lines = false) : rest(str), delimiter(delimiter), lines(lines) {}
+    bool Next(IString* piece);
+
+    inline MStringSplitIterator begin() const;
+    inline MStringSplitIterator end() const;
+
+    private:
+    IString rest;
+    char delimiter;
+    bool lines;
+};
+
+struct MStringSplitIterator
+{
+    IString operator*() const {return piece;}
+    MStringSplitIterator& operator++() {done = !split.Next(&piece); return *this;}
+    bool operator!=(const MStringSplitIterator& other) const {return done != other.done;}
+
+    MStringSplit split;
+    IString piece;
+    bool done;
+};
+
+MStringSplitIterator MStringSplit::begin() const {MStringSplitIterator it = {*this, {}, false}; return ++it;}
+MStringSplitIterator MStringSplit::end() const {return {*this, {}, true};}
+
+// Literals with their length (and optionally hash) worked out at compile time, so nothing calls strlen()
+// at runtime: "Content-Type"_is is a constexpr IString, and "Content-Type"_hash is its Hash(). Hashes
+// make a cheap string switch, and since case labels have to be unique, the compiler catches any hash
+// collisions between the keys. The hash only picks the case, so always compare the string too:
+//
+//     switch (key.Hash())
+//     {
+//         case "Content-Type"_hash:   if (key == "Content-Type"_is) return ParseContentType(value); break;
+//         case "Content-Length"_hash: if (key == "Content-Length"_is) return ParseContentLength(value); break;
+//     }
+constexpr IString operator""_is(const char* str, decltype(sizeof(0)) length) {return IString(str, (MSTRING_SIZE_T)length);}
+constexpr unsigned int operator""_hash(const char* str, decltype(sizeof(0)) length) {return MStringConstHash(str, (MSTRING_SIZE_T)length);}
+
+// Heap buffers of strings that don't have room for their capacity in the struct keep it in a header
+// right before the string data, padded to the pointer size like the other headers.
+constexpr static MSTRING_SIZE_T MStringCapacityHeaderSize = (sizeof(MSTRING_SIZE_T) + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+// The heap layout of a BasicMString: the buffer pointer, the capacity (if it fits), spare bytes for
+// caching the hash, and the flags, which have to land on the last inline byte.
+template <int InlineBytes, bool HasCapacity = (InlineBytes > (int)(sizeof(char*) + sizeof(MSTRING_SIZE_T) + 1))>
+struct MStringHeapLayout
+{
+    char* ptr;
+    MSTRING_SIZE_T capacity;
+    mutable char unused[InlineBytes - sizeof(char*) - sizeof(MSTRING_SIZE_T) - 1];
+    mutable char flags;
+
+    constexpr MSTRING_SIZE_T Capacity() const {return capacity;}
+    void SetCapacity(MSTRING_SIZE_T new_capacity, bool header)
+    {
+        capacity = new_capacity;
+        if (header) *(MSTRING_SIZE_T*)(ptr - MStringCapacityHeaderSize) = new_capacity;
+    }
+};
+
+// Without the capacity, the pointer only gets 4-byte alignment, so that a 4-byte MSTRING_SIZE_T can
+// make a 16-byte string.
+#pragma pack(push, 4)
+template <int InlineBytes>
+struct MStringHeapLayout<InlineBytes, false>
+{
+    char* ptr;
+    mutable char unused[InlineBytes - sizeof(char*) - 1];
+    mutable char flags;
+
+    MSTRING_SIZE_T Capacity() const {return *(const MSTRING_SIZE_T*)(ptr - MStringCapacityHeaderSize);}
+    void SetCapacity(MSTRING_SIZE_T new_capacity, bool) {*(MSTRING_SIZE_T*)(ptr - MStringCapacityHeaderSize) = new_capacity;}
+};
+#pragma pack(pop)
+
 // A mutable string. Doesn't allocate until the string length is long enough.
 // Tries to stay null-terminated, but you can put non null-terminated strings
 // in here too, if you know not to pass the result to somebody that expects a
 // null-terminated string.
-struct MString
+// InlineBytes is the size of the buffer for short strings, including the null terminator, and the
+// struct is that plus the length (and any padding). MString is the default size, see below for the
+// others. Strings of different sizes convert to each other explicitly, and all of them convert to IString.
+// The member functions are compiled in the implementation for the sizes declared below. For any other
+// size, add "template struct BasicMString<40>;" (or whatever size) after the implementation include.
+template <int InlineBytes>
+struct BasicMString
 {
     // Maximum length of a "short" string, not including the null terminator. The length is always
     // stored directly, but the rest of the struct can either contain a pointer + capacity + padding, or
     // can be repurposed to store shorter strings.
-    constexpr static MSTRING_SIZE_T MaxShortLength = (2 * sizeof(MSTRING_SIZE_T)) + sizeof(char*) - 1;
+    constexpr static MSTRING_SIZE_T MaxShortLength = InlineBytes - 1;
+    static_assert(InlineBytes >= (int)sizeof(char*) + 2, "The inline buffer needs room for a heap pointer and the flags.");
 
     // Constructors. Default constructor produces a valid empty string.
-    MString() = default;
-    MString(const char* ptr, MSTRING_SIZE_T length);
-    MString(const char* ptr);
+    BasicMString() = default;
+    BasicMString(const char* ptr, MSTRING_SIZE_T length);
+    BasicMString(const char* ptr);
 
     // Construction from IString has to be explicit since it might allocate.
-    explicit MString(IString str) : MString(str.Ptr(), str.Length()) {}
+    explicit BasicMString(IString str) : BasicMString(str.Ptr(), str.Length()) {}
+
+    // Conversion from other inline sizes. Copies always copy the bytes. Moves take over the heap buffer
+    // instead, unless it is missing the capacity header that we need (when we don't have room for the
+    // capacity in the struct, and the other string does), so conversions between sizes usually don't allocate.
+    template <int OtherBytes>
+    explicit BasicMString(const BasicMString<OtherBytes>& other) : BasicMString(other.Ptr(), other.Length()) {}
+    template <int OtherBytes>
+    explicit BasicMString(BasicMString<OtherBytes>&& other) : data(), length(0)
+    {
+        if (other.IsHeap() && (InlineCapacity || (other.data.heap.flags & CapacityFlag)))
+        {
+            TakeBuffer(other.data.heap.ptr, other.data.heap.Capacity(), other.data.heap.flags, other.length);
+            other.data = {};
+            other.length = 0;
+        }
+        else
+        {
+            *this = BasicMString(other.Ptr(), other.Length());
+            other.Free();
+        }
+    }
 
     // Getters and setters for length and capacity and whatnot.
-    constexpr bool IsHeap() const {return data.heap.is_heap;}
+    constexpr bool IsHeap() const {return (data.heap.flags & HeapFlag) != 0;}
+    bool IsShared() const; // True if our heap buffer is shared with copies (see MSTRING_COPY_ON_WRITE).
     constexpr MSTRING_SIZE_T Length() const {return length;}
-    constexpr MSTRING_SIZE_T Capacity() const {return (IsHeap()) ? data.heap.capacity : MaxShortLength;}
+    constexpr MSTRING_SIZE_T Capacity() const {return (IsHeap()) ? data.heap.Capacity() : MaxShortLength;}
     void SetLength(MSTRING_SIZE_T new_length);
-    void ExpandIfNeeded(MSTRING_SIZE_T required_capacity);
+    void ExpandIfNeeded(MSTRING_SIZE_T required_capacity);  // Grows by doubling (or more if that isn't enough).
+    void Reserve(MSTRING_SIZE_T capacity);                  // Grows to this capacity (or the size class above it), if we are smaller.
     void ShrinkToFit();
 
-    // Accessors for the raw pointer, auto-cast, and array subscript operators.
+    // The allocator that owns our heap buffer, or null if we are on the stack or using MSTRING_MALLOC.
+    MStringAllocator* Allocator() const;
+
+    // Accessors for the raw pointer, auto-cast, and array subscript operators. The non-const ones count
+    // as a mutation, so they make our own copy of a shared buffer.
     constexpr const char* Ptr() const {return (IsHeap()) ? data.heap.ptr : data.stack;}
-    constexpr char* Ptr() {return (IsHeap()) ? data.heap.ptr : data.stack;}
+    constexpr char* Ptr() {if (data.heap.flags & RefCountFlag) Detach(); InvalidateHash(); return (IsHeap()) ? data.heap.ptr : data.stack;}
 
     constexpr operator IString() const {return IString(Ptr(), Length());}
     constexpr operator const char*() const {return Ptr();}
+    constexpr operator const char*() {return static_cast<const BasicMString*>(this)->Ptr();} // Read-only, so it doesn't detach.
     constexpr operator char*() {return Ptr();}
+    // Our pointer is never null, so truth tests are always true. These just keep if (str) unambiguous.
+    constexpr explicit operator bool() const {return true;}
+    constexpr explicit operator bool() {return true;}
 
     constexpr const char& operator[](MSTRING_SIZE_T i) const {return Ptr()[i];}
     constexpr char& operator[](MSTRING_SIZE_T i) {return Ptr()[i];}
@@ -104,280 +621,4701 @@ struct MString
     constexpr const char* begin() const {return Ptr();}
     constexpr const char* end() const {return Ptr() + Length();}
 
-    // Comparison operators.
-    // @Speed(Frog): These could be faster if they didn't call memcmp(), we don't care about lexicographic ordering.
-    inline friend bool operator==(const MString& lhs, const MString& rhs);
-    inline friend bool operator==(const MString& lhs, IString rhs);
-    inline friend bool operator==(const MString& lhs, const char* rhs);
-    inline friend bool operator==(IString lhs, const MString& rhs);
-    inline friend bool operator==(const char* lhs, const MString& rhs);
+    // Same as MStringHash(Ptr(), Length()). Heap strings cache their hash in the struct padding (when
+    // there is enough of it), and the cache gets cleared by anything that can mutate the string,
+    // including the non-const accessors above. Filling in the cache is atomic, so several threads can
+    // hash the same const string at once (unless MSTRING_SINGLE_THREADED is defined).
+    unsigned int Hash() const;
+
+    // Searching. See IString for details.
+    MSTRING_SIZE_T Find(char c, MSTRING_SIZE_T start = 0) const        {return IString(Ptr(), Length()).Find(c, start);}
+    MSTRING_SIZE_T Find(IString str, MSTRING_SIZE_T start = 0) const   {return IString(Ptr(), Length()).Find(str, start);}
+    MSTRING_SIZE_T RFind(char c) const                                 {return IString(Ptr(), Length()).RFind(c);}
+    MSTRING_SIZE_T RFind(IString str) const                            {return IString(Ptr(), Length()).RFind(str);}
+    MSTRING_SIZE_T FindAnyOf(IString set, MSTRING_SIZE_T start = 0) const {return IString(Ptr(), Length()).FindAnyOf(set, start);}
+    MSTRING_SIZE_T FindNotOf(IString set, MSTRING_SIZE_T start = 0) const {return IString(Ptr(), Length()).FindNotOf(set, start);}
+    MSTRING_SIZE_T Count(char c) const                                 {return IString(Ptr(), Length()).Count(c);}
+    MSTRING_SIZE_T Count(IString str) const                            {return IString(Ptr(), Length()).Count(str);}
+    bool Contains(char c) const                                        {return IString(Ptr(), Length()).Contains(c);}
+    bool Contains(IString str) const                                   {return IString(Ptr(), Length()).Contains(str);}
+    bool StartsWith(IString str) const                                 {return IString(Ptr(), Length()).StartsWith(str);}
+    bool EndsWith(IString str) const                                   {return IString(Ptr(), Length()).EndsWith(str);}
+
+    // Number parsing. See IString for details.
+    MSTRING_SIZE_T ParseInt(long long* value) const           {return IString(Ptr(), Length()).ParseInt(value);}
+    MSTRING_SIZE_T ParseUInt(unsigned long long* value) const {return IString(Ptr(), Length()).ParseUInt(value);}
+    MSTRING_SIZE_T ParseDouble(double* value) const           {return IString(Ptr(), Length()).ParseDouble(value);}
+
+    // UTF-8. See IString for details.
+    bool IsValidUTF8() const                        {return IString(Ptr(), Length()).IsValidUTF8();}
+    MSTRING_SIZE_T CountCodepoints() const          {return IString(Ptr(), Length()).CountCodepoints();}
+    MSTRING_SIZE_T UTF16Length() const              {return IString(Ptr(), Length()).UTF16Length();}
+    MSTRING_SIZE_T ToUTF16(char16_t* dst) const     {return IString(Ptr(), Length()).ToUTF16(dst);}
+    MSTRING_SIZE_T ToUTF32(char32_t* dst) const     {return IString(Ptr(), Length()).ToUTF32(dst);}
+    MStringCodepoints Codepoints() const            {return {Ptr(), Ptr() + Length()};}
+
+    // Splitting. See MStringSplit.
+    MStringSplit Split(char delimiter) const        {return IString(Ptr(), Length()).Split(delimiter);}
+    MStringSplit Lines() const                      {return IString(Ptr(), Length()).Lines();}
+
+    // Three-way comparison. See IString for details. Like the operators, this compares two short strings
+    // straight out of their inline buffers.
+    int Compare(const BasicMString& other) const;
+    int Compare(IString other) const     {return IString(Ptr(), Length()).Compare(other);}
+    int Compare(const char* other) const {return IString(Ptr(), Length()).Compare(IString(other));}
+    template <int OtherBytes>
+    int Compare(const BasicMString<OtherBytes>& other) const {return IString(Ptr(), Length()).Compare(IString(other.Ptr(), other.Length()));}
 
-    inline friend bool operator!=(const MString& lhs, const MString& rhs) {return !(lhs == rhs);}
-    inline friend bool operator!=(const MString& lhs, IString rhs)        {return !(lhs == rhs);}
-    inline friend bool operator!=(const MString& lhs, const char* rhs)    {return !(lhs == rhs);}
-    inline friend bool operator!=(IString lhs, const MString& rhs)        {return !(lhs == rhs);}
-    inline friend bool operator!=(const char* lhs, const MString& rhs)    {return !(lhs == rhs);}
+    // Comparison operators. Two short strings get compared with a couple of SIMD (or word-sized) loads
+    // from their inline buffers, with the bytes past the length masked off, and anything else uses an
+    // inlined compare that checks the first block before looping, and only calls memcmp() for long
+    // strings. Heap strings that both have a cached hash can skip the bytes entirely if the hashes differ.
+    inline friend bool operator==(const BasicMString& lhs, const BasicMString& rhs) {return lhs.Equals(rhs);}
+    inline friend bool operator==(const BasicMString& lhs, IString rhs)             {return IString(lhs.Ptr(), lhs.Length()) == rhs;}
+    inline friend bool operator==(const BasicMString& lhs, const char* rhs)         {return IString(lhs.Ptr(), lhs.Length()) == rhs;}
+    inline friend bool operator==(IString lhs, const BasicMString& rhs)             {return lhs == IString(rhs.Ptr(), rhs.Length());}
+    inline friend bool operator==(const char* lhs, const BasicMString& rhs)         {return lhs == IString(rhs.Ptr(), rhs.Length());}
+
+    inline friend bool operator!=(const BasicMString& lhs, const BasicMString& rhs) {return !(lhs == rhs);}
+    inline friend bool operator!=(const BasicMString& lhs, IString rhs)             {return !(lhs == rhs);}
+    inline friend bool operator!=(const BasicMString& lhs, const char* rhs)         {return !(lhs == rhs);}
+    inline friend bool operator!=(IString lhs, const BasicMString& rhs)             {return !(lhs == rhs);}
+    inline friend bool operator!=(const char* lhs, const BasicMString& rhs)         {return !(lhs == rhs);}
+
+    inline friend bool operator<(const BasicMString& lhs, const BasicMString& rhs)  {return lhs.Compare(rhs) < 0;}
+    inline friend bool operator<(const BasicMString& lhs, IString rhs)              {return lhs.Compare(rhs) < 0;}
+    inline friend bool operator<(const BasicMString& lhs, const char* rhs)          {return lhs.Compare(rhs) < 0;}
+    inline friend bool operator<(IString lhs, const BasicMString& rhs)              {return lhs.Compare(IString(rhs.Ptr(), rhs.Length())) < 0;}
+    inline friend bool operator<(const char* lhs, const BasicMString& rhs)          {return IString(lhs).Compare(IString(rhs.Ptr(), rhs.Length())) < 0;}
+
+    inline friend bool operator>(const BasicMString& lhs, const BasicMString& rhs)  {return lhs.Compare(rhs) > 0;}
+    inline friend bool operator>(const BasicMString& lhs, IString rhs)              {return lhs.Compare(rhs) > 0;}
+    inline friend bool operator>(const BasicMString& lhs, const char* rhs)          {return lhs.Compare(rhs) > 0;}
+    inline friend bool operator>(IString lhs, const BasicMString& rhs)              {return lhs.Compare(IString(rhs.Ptr(), rhs.Length())) > 0;}
+    inline friend bool operator>(const char* lhs, const BasicMString& rhs)          {return IString(lhs).Compare(IString(rhs.Ptr(), rhs.Length())) > 0;}
+
+    inline friend bool operator<=(const BasicMString& lhs, const BasicMString& rhs) {return lhs.Compare(rhs) <= 0;}
+    inline friend bool operator<=(const BasicMString& lhs, IString rhs)             {return lhs.Compare(rhs) <= 0;}
+    inline friend bool operator<=(const BasicMString& lhs, const char* rhs)         {return lhs.Compare(rhs) <= 0;}
+    inline friend bool operator<=(IString lhs, const BasicMString& rhs)             {return lhs.Compare(IString(rhs.Ptr(), rhs.Length())) <= 0;}
+    inline friend bool operator<=(const char* lhs, const BasicMString& rhs)         {return IString(lhs).Compare(IString(rhs.Ptr(), rhs.Length())) <= 0;}
+
+    inline friend bool operator>=(const BasicMString& lhs, const BasicMString& rhs) {return lhs.Compare(rhs) >= 0;}
+    inline friend bool operator>=(const BasicMString& lhs, IString rhs)             {return lhs.Compare(rhs) >= 0;}
+    inline friend bool operator>=(const BasicMString& lhs, const char* rhs)         {return lhs.Compare(rhs) >= 0;}
+    inline friend bool operator>=(IString lhs, const BasicMString& rhs)             {return lhs.Compare(IString(rhs.Ptr(), rhs.Length())) >= 0;}
+    inline friend bool operator>=(const char* lhs, const BasicMString& rhs)         {return IString(lhs).Compare(IString(rhs.Ptr(), rhs.Length())) >= 0;}
+
+#ifdef MSTRING_THREE_WAY_COMPARE
+    inline friend std::strong_ordering operator<=>(const BasicMString& lhs, const BasicMString& rhs) {return lhs.Compare(rhs) <=> 0;}
+    inline friend std::strong_ordering operator<=>(const BasicMString& lhs, IString rhs)             {return lhs.Compare(rhs) <=> 0;}
+    inline friend std::strong_ordering operator<=>(const BasicMString& lhs, const char* rhs)         {return lhs.Compare(rhs) <=> 0;}
+    inline friend std::strong_ordering operator<=>(IString lhs, const BasicMString& rhs)             {return lhs.Compare(IString(rhs.Ptr(), rhs.Length())) <=> 0;}
+    inline friend std::strong_ordering operator<=>(const char* lhs, const BasicMString& rhs)         {return IString(lhs).Compare(IString(rhs.Ptr(), rhs.Length())) <=> 0;}
+#endif
 
     // These are the methods that do actual work. Most remaining methods and operators
     // will just inline a call to Insert(), and many are only here to remove type ambiguity.
-    MString& Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T str_length);
-    MString& Remove(MSTRING_SIZE_T index, MSTRING_SIZE_T count);
-
-    inline MString& Insert(MSTRING_SIZE_T index, const MString& str) {return Insert(index, str.Ptr(), str.Length());}
-    inline MString& Insert(MSTRING_SIZE_T index, const char* str); // Defined in implementation since it has to call strlen().
-    inline MString& Insert(MSTRING_SIZE_T index, IString str)        {return Insert(index, str.Ptr(), str.Length());}
-    inline MString& Insert(MSTRING_SIZE_T index, char c)             {return Insert(index, &c, 1);}
-
-    inline MString& Prepend(const char* str, MSTRING_SIZE_T len) {return Insert(0, str, len);}
-    inline MString& Prepend(const MString& str)                  {return Insert(0, str.Ptr(), str.Length());}
-    inline MString& Prepend(const char* str); // Defined in implementation since it has to call strlen().
-    inline MString& Prepend(IString str)                         {return Insert(0, str.Ptr(), str.Length());}
-    inline MString& Prepend(char c)                              {return Insert(0, &c, 1);}
-
-    inline MString& Append(const char* str, MSTRING_SIZE_T len) {return Insert(Length(), str, len);}
-    inline MString& Append(const MString& str)                  {return Insert(Length(), str.Ptr(), str.Length());}
-    inline MString& Append(const char* str); // Defined in implementation since it has to call strlen().
-    inline MString& Append(IString str)                         {return Insert(Length(), str.Ptr(), str.Length());}
-    inline MString& Append(char c)                              {return Insert(Length(), &c, 1);}
-
-    inline MString& operator+=(const MString& rhs) {return Insert(Length(), rhs);}
-    inline MString& operator+=(const char* rhs)    {return Insert(Length(), rhs);}
-    inline MString& operator+=(IString rhs)        {return Insert(Length(), rhs);}
-    inline MString& operator+=(char rhs)           {return Insert(Length(), rhs);}
-
-    // Passing one argument by value and then returning it helps the compiler figure out that it should
-    // use the move constructor when we chain a bunch of + operators together.
-    inline friend MString operator+(MString lhs, const MString& rhs) {lhs.Insert(lhs.Length(), rhs); return lhs;}
-    inline friend MString operator+(MString lhs, const char* rhs)    {lhs.Insert(lhs.Length(), rhs); return lhs;}
-    inline friend MString operator+(MString lhs, IString rhs)        {lhs.Insert(lhs.Length(), rhs); return lhs;}
-    inline friend MString operator+(MString lhs, char rhs)           {lhs.Insert(lhs.Length(), rhs); return lhs;}
-
-    inline friend MString operator+(const char* lhs, MString rhs)    {rhs.Insert(0, lhs); return rhs;}
-    inline friend MString operator+(IString lhs, MString rhs)        {rhs.Insert(0, lhs); return rhs;}
-    inline friend MString operator+(char lhs, MString rhs)           {rhs.Insert(0, lhs); return rhs;}
+    BasicMString& Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T str_length);
+    BasicMString& Remove(MSTRING_SIZE_T index, MSTRING_SIZE_T count);
+
+    inline BasicMString& Insert(MSTRING_SIZE_T index, const BasicMString& str) {return Insert(index, str.Ptr(), str.Length());}
+    BasicMString& Insert(MSTRING_SIZE_T index, const char* str); // Defined in implementation since it has to call strlen().
+    inline BasicMString& Insert(MSTRING_SIZE_T index, IString str)            {return Insert(index, str.Ptr(), str.Length());}
+    inline BasicMString& Insert(MSTRING_SIZE_T index, char c)                 {return Insert(index, &c, 1);}
+
+    inline BasicMString& Prepend(const char* str, MSTRING_SIZE_T len) {return Insert(0, str, len);}
+    inline BasicMString& Prepend(const BasicMString& str)             {return Insert(0, str.Ptr(), str.Length());}
+    BasicMString& Prepend(const char* str); // Defined in implementation since it has to call strlen().
+    inline BasicMString& Prepend(IString str)                         {return Insert(0, str.Ptr(), str.Length());}
+    inline BasicMString& Prepend(char c)                              {return Insert(0, &c, 1);}
+
+    inline BasicMString& Append(const char* str, MSTRING_SIZE_T len) {return Insert(Length(), str, len);}
+    inline BasicMString& Append(const BasicMString& str)             {return Insert(Length(), str.Ptr(), str.Length());}
+    BasicMString& Append(const char* str); // Defined in implementation since it has to call strlen().
+    inline BasicMString& Append(IString str)                         {return Insert(Length(), str.Ptr(), str.Length());}
+    inline BasicMString& Append(char c)                              {return Insert(Length(), &c, 1);}
+
+    inline BasicMString& operator+=(const BasicMString& rhs) {return Insert(Length(), rhs);}
+    inline BasicMString& operator+=(const char* rhs)         {return Insert(Length(), rhs);}
+    inline BasicMString& operator+=(IString rhs)             {return Insert(Length(), rhs);}
+    inline BasicMString& operator+=(char rhs)                {return Insert(Length(), rhs);}
+
+    // In-place rewrites. ToLower() and ToUpper() only touch ASCII letters, 16 or 32 bytes at a time, so
+    // UTF-8 passes through unchanged. The trims remove the same whitespace as IString's, which you can
+    // use instead if you only want a view. ReplaceAll() counts the matches first, so the string gets
+    // sized once and rebuilt in a single pass, instead of moving the tail on every match like a loop of
+    // Remove() and Insert() would. Matches are found left to right and don't overlap.
+    BasicMString& ToLower();
+    BasicMString& ToUpper();
+    BasicMString& Trim();
+    BasicMString& TrimLeft();
+    BasicMString& TrimRight();
+    BasicMString& ReplaceAll(IString from, IString to);
+
+    // Number formatting. These write straight into the end of the string, without going through a
+    // temporary buffer. AppendHex writes lowercase digits without a prefix, padded with zeros up to
+    // min_digits. AppendDouble writes the shortest digits that read back as the same double (almost
+    // always, see the implementation), like JavaScript does: "0.1", "100", "1.5e+300", "inf", "nan".
+    BasicMString& AppendInt(long long value);
+    BasicMString& AppendUInt(unsigned long long value);
+    BasicMString& AppendHex(unsigned long long value, int min_digits = 1);
+    BasicMString& AppendDouble(double value);
+
+    // UTF-8 encoding. These work out the exact encoded length first, so the string only grows once.
+    // Unpaired surrogates and invalid codepoints get written as U+FFFD.
+    BasicMString& AppendCodepoint(char32_t codepoint);
+    BasicMString& AppendUTF16(const char16_t* str, MSTRING_SIZE_T length);
+    BasicMString& AppendUTF32(const char32_t* str, MSTRING_SIZE_T length);
+
+    // The + operators are defined below MString. They build an MStringChain, which only allocates once,
+    // when it gets turned back into an MString here. These are constructors rather than a conversion on
+    // the chain, so that MString(a + b) doesn't have to choose between that and the chain's IString.
+    template <int N, int ChainBytes> BasicMString(MStringChain<N, ChainBytes>&& chain);
+    template <int N, int ChainBytes> BasicMString(const MStringChain<N, ChainBytes>& chain);
 
     // Copy and move constructor/assignment nonsense.
-    MString(const MString& other);
-    MString(MString&& other);
-    MString& operator=(const MString& other);
-    MString& operator=(MString&& other);
+    BasicMString(const BasicMString& other);
+    BasicMString(BasicMString&& other);
+    BasicMString& operator=(const BasicMString& other);
+    BasicMString& operator=(BasicMString&& other);
 
     // Destructor (or you can call Free() to deallocate).
     void Free();
-    ~MString() {Free();}
+    ~BasicMString() {Free();}
 
     private:
+    template <int> friend struct BasicMString;
+
+    // Bits stored in the last byte of the struct. For short strings that byte is the null terminator
+    // of a max-length string, so "no flags set" has to mean "on the stack".
+    enum : char
+    {
+        HeapFlag = 1 << 0,      // Data lives in data.heap.ptr.
+        AllocatorFlag = 1 << 1, // Heap buffer came from an MStringAllocator, which is stored right before it.
+        RefCountFlag = 1 << 3,  // Heap buffer has a reference count stored before it, and can be shared.
+        CapacityFlag = 1 << 4,  // Heap buffer has its capacity stored right before it (after the other headers).
+    };
+
+    // Whether the capacity fits in the heap layout, and the spare bytes left over. We need 5 of them to
+    // cache a hash: the hash, and then a marker byte that says it's there. The marker lives in the
+    // padding rather than the flags, because const Hash() calls fill it in (see there).
+    constexpr static bool InlineCapacity = InlineBytes > (int)(sizeof(char*) + sizeof(MSTRING_SIZE_T) + 1);
+    constexpr static MSTRING_SIZE_T HeapPadding = sizeof(MStringHeapLayout<InlineBytes>::unused);
+    constexpr static bool CachesHash = HeapPadding > sizeof(unsigned int);
+    constexpr static MSTRING_SIZE_T HashMarker = CachesHash ? sizeof(unsigned int) : 0;
+    constexpr void InvalidateHash() {if (CachesHash && IsHeap()) data.heap.unused[HashMarker] = 0;}
+    bool HasCachedHash() const;
+
+    // Heap buffer management. These handle the choice between the default heap and a custom allocator,
+    // and the reference count for shared buffers. The default heap can round the capacity up.
+    static char* AllocateBuffer(MSTRING_SIZE_T* capacity, char* flags, MStringAllocator* allocator);
+    void ReallocateBuffer(MSTRING_SIZE_T capacity);
+    void FreeBuffer();
+    MSTRING_SIZE_T HeaderSize() const;
+    bool ShareBuffer(const BasicMString& other); // Shares other's buffer if we can, returns false if we can't.
+    void Detach();                               // Makes our own copy of the buffer if it is shared.
+    void TakeBuffer(char* ptr, MSTRING_SIZE_T capacity, char flags, MSTRING_SIZE_T length); // From a string of another size.
+    void SetHeapCapacity(MSTRING_SIZE_T capacity) {data.heap.SetCapacity(capacity, (data.heap.flags & CapacityFlag) != 0);}
+    bool Equals(const BasicMString& other) const;
+
     union
     {
         char stack[MaxShortLength + 1];
-        struct
-        {
-            char* ptr;
-            MSTRING_SIZE_T capacity;
-            char unused[MaxShortLength - sizeof(MSTRING_SIZE_T) - sizeof(char*)];
-            char is_heap;
-        } heap;
+        MStringHeapLayout<InlineBytes> heap;
     } data;
     MSTRING_SIZE_T length;
 };
 
-#define MSTRING_H
-#endif
-
-// ========================================================================== //
-// End of header. Implementation below.
-// ========================================================================== //
+// The sizes that get compiled in the implementation. The default has room for a pointer, the capacity
+// and some padding. MString64 is exactly one cache line, with 55-byte short strings. MStringCompact is
+// 24 bytes with 15-byte short strings, or 16 bytes with 11-byte short strings if MSTRING_SIZE_T is 4
+// bytes. It doesn't have room for the capacity, so its heap buffers keep it in a header.
+constexpr static int MStringDefaultInlineBytes = 2 * sizeof(MSTRING_SIZE_T) + sizeof(char*);
+constexpr static int MString64InlineBytes = 64 - sizeof(char*);
+constexpr static int MStringCompactInlineBytes = (sizeof(MSTRING_SIZE_T) < sizeof(char*)) ? 16 - sizeof(MSTRING_SIZE_T) : 2 * sizeof(char*);
 
-#ifdef MSTRING_IMPLEMENTATION
+typedef BasicMString<MStringDefaultInlineBytes> MString;
+typedef BasicMString<MString64InlineBytes> MString64;
+typedef BasicMString<MStringCompactInlineBytes> MStringCompact;
 
-// Include and use standard library versions of malloc, realloc, free, memcpy, memmove, memcmp, and strlen,
-// if they were not defined by the user.
-#if !defined MSTRING_MALLOC || !defined MSTRING_REALLOC || !defined MSTRING_FREE
-#include <stdlib.h>
-#endif
-#if !defined MSTRING_MEMCPY || !defined MSTRING_MEMMOVE || ~defined MSTRING_MEMCMP || !defined MSTRING_STRLEN
-#include <string.h>
-#endif
-#ifndef MSTRING_ASSERT
-#include <cassert>
-#define MSTRING_ASSERT assert
-#endif
+extern template struct BasicMString<MStringDefaultInlineBytes>;
+extern template struct BasicMString<MString64InlineBytes>;
+extern template struct BasicMString<MStringCompactInlineBytes>;
 
-#ifndef MSTRING_MALLOC
-#define MSTRING_MALLOC(size) malloc(size)
-#endif
-#ifndef MSTRING_REALLOC
-#define MSTRING_REALLOC(old_ptr, size) realloc(old_ptr, size)
-#endif
-#ifndef MSTRING_FREE
-#define MSTRING_FREE(ptr) free(ptr)
-#endif
-#ifndef MSTRING_MEMCPY
-#define MSTRING_MEMCPY(dst, src, size) memcpy(dst, src, size)
-#endif
-#ifndef MSTRING_MEMMOVE
-#define MSTRING_MEMMOVE(dst, src, size) memmove(dst, src, size)
-#endif
-#ifndef MSTRING_MEMCMP
-#define MSTRING_MEMCMP(lhs, rhs, size) memcmp(lhs, rhs, size)
-#endif
-#ifndef MSTRING_STRLEN
-#define MSTRING_STRLEN(str) strlen(str)
+// Comparison between different sizes, which would otherwise be ambiguous.
+template <int L, int R> bool operator==(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return IString(lhs.Ptr(), lhs.Length()) == IString(rhs.Ptr(), rhs.Length());}
+template <int L, int R> bool operator!=(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return IString(lhs.Ptr(), lhs.Length()) != IString(rhs.Ptr(), rhs.Length());}
+template <int L, int R> bool operator<(const BasicMString<L>& lhs, const BasicMString<R>& rhs)  {return lhs.Compare(rhs) < 0;}
+template <int L, int R> bool operator>(const BasicMString<L>& lhs, const BasicMString<R>& rhs)  {return lhs.Compare(rhs) > 0;}
+template <int L, int R> bool operator<=(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return lhs.Compare(rhs) <= 0;}
+template <int L, int R> bool operator>=(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return lhs.Compare(rhs) >= 0;}
+#ifdef MSTRING_THREE_WAY_COMPARE
+template <int L, int R> std::strong_ordering operator<=>(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return lhs.Compare(rhs) <=> 0;}
 #endif
 
-// Misc one-liners that have to be in the implementation section because they call
-// strlen() or memcmp(), which the caller of this library might re-define.
-bool operator==(IString lhs, IString rhs)     {return (lhs.Length() == rhs.Length() && MSTRING_MEMCMP(lhs.Ptr(), rhs.Ptr(), lhs.Length()) == 0);}
-bool operator==(IString lhs, const char* rhs) {return (lhs.Length() == (MSTRING_SIZE_T)MSTRING_STRLEN(rhs) && MSTRING_MEMCMP(lhs.Ptr(), rhs, lhs.Length()) == 0);}
-bool operator==(const char* lhs, IString rhs) {return ((MSTRING_SIZE_T)MSTRING_STRLEN(lhs) == rhs.Length() && MSTRING_MEMCMP(lhs, rhs.Ptr(), rhs.Length()) == 0);}
+// One operand of a + chain: a view of some string bytes, or a single character. Keeping track of
+// the length here means that we only call strlen() once per C string.
+struct MStringPiece
+{
+    MStringPiece() = default;
+    MStringPiece(const char* str); // Defined in implementation since it has to call strlen().
+    MStringPiece(IString str)        : ptr(str.Ptr()), length(str.Length()) {}
+    template <int N>
+    MStringPiece(const BasicMString<N>& str) : ptr(str.Ptr()), length(str.Length()) {}
+    MStringPiece(char c)             : ptr(nullptr), length(1), c(c) {}
 
-bool operator==(const MString& lhs, const MString& rhs) {return (lhs.Length() == rhs.Length() && MSTRING_MEMCMP(lhs.Ptr(), rhs.Ptr(), lhs.Length()) == 0);}
-bool operator==(const MString& lhs, IString rhs)        {return (lhs.Length() == rhs.Length() && MSTRING_MEMCMP(lhs.Ptr(), rhs.Ptr(), lhs.Length()) == 0);}
-bool operator==(const MString& lhs, const char* rhs)    {return (lhs.Length() == (MSTRING_SIZE_T)MSTRING_STRLEN(rhs) && MSTRING_MEMCMP(lhs.Ptr(), rhs, lhs.Length()) == 0);}
-bool operator==(IString lhs, const MString& rhs)        {return (lhs.Length() == rhs.Length() && MSTRING_MEMCMP(lhs.Ptr(), rhs.Ptr(), lhs.Length()) == 0);}
-bool operator==(const char* lhs, const MString& rhs)    {return ((MSTRING_SIZE_T)MSTRING_STRLEN(lhs) == rhs.Length() && MSTRING_MEMCMP(lhs, rhs.Ptr(), rhs.Length()) == 0);}
+    MSTRING_SIZE_T Length() const {return length;}
+    char* Write(char* dst) const; // Copies the piece to dst, and returns the end of what it wrote.
 
-IString::IString(const char* ptr) : ptr(ptr), length((MSTRING_SIZE_T)MSTRING_STRLEN(ptr)) {}
-MString::MString(const char* ptr) : MString(ptr, (MSTRING_SIZE_T)MSTRING_STRLEN(ptr)) {}
+    private:
+    const char* ptr = nullptr;
+    MSTRING_SIZE_T length = 0;
+    char c = 0;
+};
 
-MString& MString::Insert(MSTRING_SIZE_T index, const char* str) {return Insert(index, str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
-MString& MString::Prepend(const char* str) {return Insert(0, str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
-MString& MString::Append(const char* str) {return Insert(Length(), str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
+// Turns a chain into a single string. The head string's buffer is reused for the result, and gets
+// resized exactly once. The first head_index pieces go before the head, and the rest go after it.
+template <int InlineBytes>
+BasicMString<InlineBytes> MStringBuildChain(BasicMString<InlineBytes>&& head, int head_index, const MStringPiece* pieces, int count);
 
-MString::MString(const char* ptr, MSTRING_SIZE_T len) : MString()
+// The result of chaining + operators, like MString("C:\\") + "Users" + '\\' + name. Nothing gets
+// copied until the chain is turned into an MString, at which point we know the total length and can
+// allocate exactly once (or not at all, if the result fits in a short string).
+// If the chain starts with a temporary MString, we take it over and use it as the result buffer.
+// The head (and so the string the chain builds) has the size of the first MString operand.
+// Later temporary MStrings get copied into that buffer straight away (see MStringChainAppendTemporary),
+// since they are gone by the end of the statement. Every other operand is just a view, so like any
+// view, don't keep a chain around past the end of the statement that made it (e.g. with auto) unless
+// everything it points to outlives it.
+template <int N, int InlineBytes>
+struct MStringChain
 {
-    MSTRING_ASSERT(ptr && len >= 0);
+    BasicMString<InlineBytes> head;
+    int head_index;
+    MStringPiece pieces[N];
 
-    if (len > 0)
+    MSTRING_SIZE_T Length() const
     {
-        if (len <= MaxShortLength) MSTRING_MEMCPY(data.stack, ptr, len);
-        else
-        {
-            data.heap.is_heap = true;
-            data.heap.ptr = (char*)MSTRING_MALLOC(len + 1);
-            MSTRING_MEMCPY(data.heap.ptr, ptr, len);
-            data.heap.capacity = len;
-        }
+        MSTRING_SIZE_T length = head.Length();
+        for (int i = 0; i < N; ++i) length += pieces[i].Length();
+        return length;
     }
 
-    Ptr()[len] = '\0';
-    length = len;
-}
+    // Using a temporary chain as a string directly, like f(a + b) for an f that takes an IString, or
+    // (a + b).Ptr(). The chain gets built into its own head, so the result lives as long as the chain
+    // does, which is the end of the statement, the same as a temporary MString.
+    IString Build()
+    {
+        head = MStringBuildChain(static_cast<BasicMString<InlineBytes>&&>(head), head_index, pieces, N);
+        head_index = 0;
+        for (int i = 0; i < N; ++i) pieces[i] = MStringPiece();
+        return IString(head.Ptr(), head.Length());
+    }
+    operator IString() && {return Build();}
+    const char* Ptr() && {return Build().Ptr();}
 
-void MString::SetLength(MSTRING_SIZE_T len)
-{
-    MSTRING_ASSERT(len >= 0);
-    if (len == length) return;
+    // Comparisons with anything that converts to IString, like (a + b) == "ab". These build the chain too.
+    static IString View(IString str) {return str;}
+    template <class T> friend auto operator==(MStringChain&& lhs, T&& rhs) -> decltype(View(rhs), true) {return lhs.Build() == View(rhs);}
+    template <class T> friend auto operator!=(MStringChain&& lhs, T&& rhs) -> decltype(View(rhs), true) {return lhs.Build() != View(rhs);}
+    template <class T> friend auto operator<(MStringChain&& lhs, T&& rhs)  -> decltype(View(rhs), true) {return lhs.Build().Compare(View(rhs)) < 0;}
+    template <class T> friend auto operator>(MStringChain&& lhs, T&& rhs)  -> decltype(View(rhs), true) {return lhs.Build().Compare(View(rhs)) > 0;}
+    template <class T> friend auto operator<=(MStringChain&& lhs, T&& rhs) -> decltype(View(rhs), true) {return lhs.Build().Compare(View(rhs)) <= 0;}
+    template <class T> friend auto operator>=(MStringChain&& lhs, T&& rhs) -> decltype(View(rhs), true) {return lhs.Build().Compare(View(rhs)) >= 0;}
+    template <class T> friend auto operator==(T&& lhs, MStringChain&& rhs) -> decltype(View(lhs), true) {return View(lhs) == rhs.Build();}
+    template <class T> friend auto operator!=(T&& lhs, MStringChain&& rhs) -> decltype(View(lhs), true) {return View(lhs) != rhs.Build();}
+    template <class T> friend auto operator<(T&& lhs, MStringChain&& rhs)  -> decltype(View(lhs), true) {return View(lhs).Compare(rhs.Build()) < 0;}
+    template <class T> friend auto operator>(T&& lhs, MStringChain&& rhs)  -> decltype(View(lhs), true) {return View(lhs).Compare(rhs.Build()) > 0;}
+    template <class T> friend auto operator<=(T&& lhs, MStringChain&& rhs) -> decltype(View(lhs), true) {return View(lhs).Compare(rhs.Build()) <= 0;}
+    template <class T> friend auto operator>=(T&& lhs, MStringChain&& rhs) -> decltype(View(lhs), true) {return View(lhs).Compare(rhs.Build()) >= 0;}
+#ifdef MSTRING_THREE_WAY_COMPARE
+    template <class T> friend auto operator<=>(MStringChain&& lhs, T&& rhs) -> decltype(View(rhs), std::strong_ordering::equal) {return lhs.Build().Compare(View(rhs)) <=> 0;}
+    template <class T> friend auto operator<=>(T&& lhs, MStringChain&& rhs) -> decltype(View(lhs), std::strong_ordering::equal) {return View(lhs).Compare(rhs.Build()) <=> 0;}
+#endif
+};
 
-    ExpandIfNeeded(len);
-    Ptr()[len] = '\0';
-    length = len;
-}
+// A chain builds into a string of its own size, which then gets moved into ours (usually taking over
+// its buffer, see the conversions between sizes).
+template <int InlineBytes>
+template <int N, int ChainBytes>
+BasicMString<InlineBytes>::BasicMString(MStringChain<N, ChainBytes>&& chain)
+    : BasicMString(MStringBuildChain(static_cast<BasicMString<ChainBytes>&&>(chain.head), chain.head_index, chain.pieces, N)) {}
 
-void MString::ExpandIfNeeded(MSTRING_SIZE_T required_capacity)
-{
-    if (Capacity() >= required_capacity) return;
-    // We'll double in size, or if that isn't enough we will just allocate exactly the required number of bytes.
-    MSTRING_SIZE_T capacity = (Capacity() * 2 > required_capacity) ? Capacity() * 2 : required_capacity;
-    // If we are already on the heap, just reallocate.
-    if (IsHeap()) data.heap.ptr = (char*)MSTRING_REALLOC(data.heap.ptr, capacity + 1);
-    else // Otherwise if we need to move to the heap for the first time, allocate and copy.
-    {
-        char* new_ptr = (char*)MSTRING_MALLOC(capacity + 1);
-        if (length) MSTRING_MEMCPY(new_ptr, data.stack, length + 1);
-        data.heap = {new_ptr, capacity, {}, true};
-    }
-}
+template <int InlineBytes>
+template <int N, int ChainBytes>
+BasicMString<InlineBytes>::BasicMString(const MStringChain<N, ChainBytes>& chain)
+    : BasicMString(MStringBuildChain(BasicMString<ChainBytes>(chain.head), chain.head_index, chain.pieces, N)) {}
 
-void MString::ShrinkToFit()
+// Adds a temporary string to the end of a chain. A piece would point at it after it has been freed,
+// so instead it becomes the head if the head is empty (keeping its buffer), and otherwise the chain so
+// far gets built into the head with it on the end, which is the one allocation that building the chain
+// later would have made anyway.
+template <int N, int InlineBytes, int M>
+MStringChain<N + 1, InlineBytes> MStringChainAppendTemporary(BasicMString<InlineBytes>&& head, int head_index, const MStringPiece* pieces, BasicMString<M>&& str)
 {
-    if (!IsHeap()) return; // If we aren't on the heap, there is nothing to shrink!
-
-    if (length <= MaxShortLength) // Move back onto the stack if we are small enough.
+    MStringChain<N + 1, InlineBytes> result = {BasicMString<InlineBytes>(), 0, {}};
+    if (head.Length() == 0)
     {
-        char* ptr = data.heap.ptr;
-        data = {};
-        MSTRING_MEMCPY(data.stack, ptr, length + 1);
-        MSTRING_FREE(ptr);
+        result.head = BasicMString<InlineBytes>(static_cast<BasicMString<M>&&>(str));
+        result.head_index = N;
+        for (int i = 0; i < N; ++i) result.pieces[i] = pieces[i];
     }
     else
     {
-        data.heap.ptr = (char*)MSTRING_REALLOC(data.heap.ptr, length + 1);
-        data.heap.capacity = length;
+        MStringPiece all[N + 1];
+        for (int i = 0; i < N; ++i) all[i] = pieces[i];
+        all[N] = MStringPiece(str);
+        result.head = MStringBuildChain(static_cast<BasicMString<InlineBytes>&&>(head), head_index, all, N + 1);
     }
+    return result;
 }
 
-MString& MString::Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T len)
+// Starting a chain. A temporary MString becomes the head, and everything else becomes a piece. There
+// is an overload for every combination, since C strings can also be implicitly converted to MStrings.
+// The chain builds into the size of the left hand MString, or the right hand one if that's the only one.
+template <int L, int R>
+MStringChain<1, L> operator+(BasicMString<L>&& lhs, const BasicMString<R>& rhs) {return {static_cast<BasicMString<L>&&>(lhs), 0, {rhs}};}
+template <int L, int R>
+MStringChain<1, L> operator+(BasicMString<L>&& lhs, BasicMString<R>&& rhs)
 {
-    MSTRING_ASSERT(str && index <= length && len >= 0);
-    if (len <= 0 || index < 0 || !str) return *this;
-
-    MSTRING_SIZE_T old_length = length;
-    SetLength(old_length + len);
-    if (index < old_length) MSTRING_MEMMOVE(Ptr() + index + len, Ptr() + index, old_length - index);
-    else if (index == old_length) MSTRING_MEMCPY(Ptr() + index, str, len);
-    return *this;
+    return MStringChainAppendTemporary<0>(static_cast<BasicMString<L>&&>(lhs), 0, nullptr, static_cast<BasicMString<R>&&>(rhs));
 }
+template <int L> MStringChain<1, L> operator+(BasicMString<L>&& lhs, const char* rhs) {return {static_cast<BasicMString<L>&&>(lhs), 0, {rhs}};}
+template <int L> MStringChain<1, L> operator+(BasicMString<L>&& lhs, IString rhs)     {return {static_cast<BasicMString<L>&&>(lhs), 0, {rhs}};}
+template <int L> MStringChain<1, L> operator+(BasicMString<L>&& lhs, char rhs)        {return {static_cast<BasicMString<L>&&>(lhs), 0, {rhs}};}
 
+template <int L, int R>
+MStringChain<2, L> operator+(const BasicMString<L>& lhs, const BasicMString<R>& rhs) {return {BasicMString<L>(), 0, {lhs, rhs}};}
+template <int L, int R>
+MStringChain<1, L> operator+(const BasicMString<L>& lhs, BasicMString<R>&& rhs) {return {BasicMString<L>(static_cast<BasicMString<R>&&>(rhs)), 1, {lhs}};}
+template <int L> MStringChain<2, L> operator+(const BasicMString<L>& lhs, const char* rhs) {return {BasicMString<L>(), 0, {lhs, rhs}};}
+template <int L> MStringChain<2, L> operator+(const BasicMString<L>& lhs, IString rhs)     {return {BasicMString<L>(), 0, {lhs, rhs}};}
+template <int L> MStringChain<2, L> operator+(const BasicMString<L>& lhs, char rhs)        {return {BasicMString<L>(), 0, {lhs, rhs}};}
 
-MString& MString::Remove(MSTRING_SIZE_T index, MSTRING_SIZE_T count)
-{
-    MSTRING_SIZE_T shift_index = index + count; // Start index of the bytes we need to shift forwards.
-    MSTRING_ASSERT(index >= 0 && count >= 0 && shift_index <= length);
-    if (count <= 0 || index < 0 || index >= length) return *this;
+template <int R> MStringChain<1, R> operator+(const char* lhs, BasicMString<R>&& rhs) {return {static_cast<BasicMString<R>&&>(rhs), 1, {lhs}};}
+template <int R> MStringChain<1, R> operator+(IString lhs, BasicMString<R>&& rhs)     {return {static_cast<BasicMString<R>&&>(rhs), 1, {lhs}};}
+template <int R> MStringChain<1, R> operator+(char lhs, BasicMString<R>&& rhs)        {return {static_cast<BasicMString<R>&&>(rhs), 1, {lhs}};}
 
-    if (shift_index < length) MSTRING_MEMMOVE(Ptr() + index, Ptr() + shift_index, length - shift_index);
-    else if (shift_index > length) count = length - index;
-    SetLength(length - count);
-    return *this;
+template <int R> MStringChain<2, R> operator+(const char* lhs, const BasicMString<R>& rhs) {return {BasicMString<R>(), 0, {lhs, rhs}};}
+template <int R> MStringChain<2, R> operator+(IString lhs, const BasicMString<R>& rhs)     {return {BasicMString<R>(), 0, {lhs, rhs}};}
+template <int R> MStringChain<2, R> operator+(char lhs, const BasicMString<R>& rhs)        {return {BasicMString<R>(), 0, {lhs, rhs}};}
+
+// Continuing a chain. The right hand side is deduced rather than converted, otherwise converting the
+// chain itself to an MString would be an equally good match (for temporaries too, hence the T&&).
+template <int N, int InlineBytes, class T>
+auto operator+(MStringChain<N, InlineBytes>&& lhs, T&& rhs) -> decltype(MStringPiece(rhs), MStringChain<N + 1, InlineBytes>())
+{
+    MStringChain<N + 1, InlineBytes> result = {static_cast<BasicMString<InlineBytes>&&>(lhs.head), lhs.head_index, {}};
+    for (int i = 0; i < N; ++i) result.pieces[i] = lhs.pieces[i];
+    result.pieces[N] = MStringPiece(rhs);
+    return result;
 }
 
-MString::MString(const MString& other)
+template <int N, int InlineBytes, class T>
+auto operator+(const MStringChain<N, InlineBytes>& lhs, T&& rhs) -> decltype(MStringPiece(rhs), MStringChain<N + 1, InlineBytes>())
 {
-    if (other.IsHeap())
-    {
-        data.heap.is_heap = true;
-        data.heap.ptr = (char*)MSTRING_MALLOC(other.data.heap.capacity + 1);
-        MSTRING_MEMCPY(data.heap.ptr, other.data.heap.ptr, other.length + 1);
-        data.heap.capacity = other.data.heap.capacity;
+    MStringChain<N + 1, InlineBytes> result = {lhs.head, lhs.head_index, {}};
+    for (int i = 0; i < N; ++i) result.pieces[i] = lhs.pieces[i];
+    result.pieces[N] = MStringPiece(rhs);
+    return result;
+}
 
-    }
-    else data = other.data;
-    length = other.length;
+template <int N, int InlineBytes, int M>
+MStringChain<N + 1, InlineBytes> operator+(MStringChain<N, InlineBytes>&& lhs, BasicMString<M>&& rhs)
+{
+    return MStringChainAppendTemporary<N>(static_cast<BasicMString<InlineBytes>&&>(lhs.head), lhs.head_index, lhs.pieces, static_cast<BasicMString<M>&&>(rhs));
 }
 
-MString::MString(MString&& other)
+template <int N, int InlineBytes, int M>
+MStringChain<N + 1, InlineBytes> operator+(const MStringChain<N, InlineBytes>& lhs, BasicMString<M>&& rhs)
 {
-    data = other.data;
-    other.data = {};
+    return MStringChainAppendTemporary<N>(BasicMString<InlineBytes>(lhs.head), lhs.head_index, lhs.pieces, static_cast<BasicMString<M>&&>(rhs));
 }
 
-MString& MString::operator=(const MString& other)
+// A temporary chain on the right, like user + (a + b), is gone by the end of the statement just like a
+// temporary MString, so it gets built and then appended as one.
+template <class L, int N, int InlineBytes>
+auto operator+(L&& lhs, MStringChain<N, InlineBytes>&& rhs) -> decltype(static_cast<L&&>(lhs) + BasicMString<InlineBytes>())
+{
+    return static_cast<L&&>(lhs) + BasicMString<InlineBytes>(static_cast<MStringChain<N, InlineBytes>&&>(rhs));
+}
+
+template <int N, int L, int M, int R>
+MStringChain<N + 1, L> operator+(MStringChain<N, L>&& lhs, MStringChain<M, R>&& rhs)
+{
+    return static_cast<MStringChain<N, L>&&>(lhs) + BasicMString<R>(static_cast<MStringChain<M, R>&&>(rhs));
+}
+
+template <int N, int L, int M, int R>
+MStringChain<N + 1, L> operator+(const MStringChain<N, L>& lhs, MStringChain<M, R>&& rhs)
+{
+    return lhs + BasicMString<R>(static_cast<MStringChain<M, R>&&>(rhs));
+}
+
+// Concatenates any number of strings (MString, IString, C strings or chars) with a single allocation.
+template <class First, class... Rest>
+MString MStringConcat(const First& first, const Rest&... rest)
+{
+    MStringPiece pieces[] = {MStringPiece(first), MStringPiece(rest)...};
+    return MStringBuildChain(MString(), 0, pieces, 1 + (int)sizeof...(Rest));
+}
+
+// A gap buffer, for making lots of edits in the middle of a big string. The text lives in an MString
+// with a "gap" of unused bytes at the cursor, so inserting or removing at the cursor only touches the
+// bytes being edited, and moving the cursor only moves the bytes between its old and new positions.
+// The gap gets pushed to the end (making the text contiguous again) when you ask for Ptr(), an
+// IString, or the MString back.
+struct MStringEditor
+{
+    MStringEditor() = default;
+    explicit MStringEditor(MString str); // Takes over the string's buffer. The cursor starts at the end.
+    explicit MStringEditor(IString str) : MStringEditor(MString(str)) {}
+
+    MSTRING_SIZE_T Length() const {return buffer.Length() - (gap_end - gap_start);}
+    MSTRING_SIZE_T Cursor() const {return gap_start;}
+    void SetCursor(MSTRING_SIZE_T index);
+
+    // Editing at the cursor. Inserted text goes before the cursor, like typing.
+    MStringEditor& Insert(const char* str, MSTRING_SIZE_T len) {return Insert(gap_start, str, len);}
+    MStringEditor& Insert(IString str) {return Insert(str.Ptr(), str.Length());}
+    MStringEditor& Insert(char c)      {return Insert(&c, 1);}
+    MStringEditor& Erase(MSTRING_SIZE_T count);     // Removes bytes after the cursor, like the delete key.
+    MStringEditor& EraseBack(MSTRING_SIZE_T count); // Removes bytes before the cursor, like backspace.
+
+    // Editing anywhere, with the same arguments as MString. These move the cursor to the edit first.
+    // Like MString, the inserted text can come from the editor itself (e.g. from Ptr()).
+    MStringEditor& Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T len);
+    MStringEditor& Insert(MSTRING_SIZE_T index, IString str) {return Insert(index, str.Ptr(), str.Length());}
+    MStringEditor& Insert(MSTRING_SIZE_T index, char c)      {SetCursor(index); return Insert(c);}
+    MStringEditor& Remove(MSTRING_SIZE_T index, MSTRING_SIZE_T count) {SetCursor(index); return Erase(count);}
+
+    // Reading a single byte doesn't need to close the gap.
+    char operator[](MSTRING_SIZE_T i) const {return buffer[(i < gap_start) ? i : i + (gap_end - gap_start)];}
+
+    // These close the gap by moving the cursor to the end, so they cost O(n) after an edit in the middle
+    // (and nothing otherwise).
+    // IString has a constructor for the editor, rather than a conversion here, so that casts to it
+    // aren't ambiguous with the const char* conversion.
+    const char* Ptr();
+    operator const char*() {return Ptr();}
+    MString Take(); // Gives back the text as an MString, and leaves the editor empty.
+
+    // Comparisons with anything that converts to IString. These also close the gap. They have to be
+    // spelled out, since with two conversions, comparing an editor would otherwise be ambiguous.
+    static IString View(IString str) {return str;}
+    template <class T> friend auto operator==(MStringEditor& lhs, T&& rhs) -> decltype(View(rhs), true) {return IString(lhs) == View(rhs);}
+    template <class T> friend auto operator!=(MStringEditor& lhs, T&& rhs) -> decltype(View(rhs), true) {return IString(lhs) != View(rhs);}
+    template <class T> friend auto operator<(MStringEditor& lhs, T&& rhs)  -> decltype(View(rhs), true) {return IString(lhs).Compare(View(rhs)) < 0;}
+    template <class T> friend auto operator>(MStringEditor& lhs, T&& rhs)  -> decltype(View(rhs), true) {return IString(lhs).Compare(View(rhs)) > 0;}
+    template <class T> friend auto operator<=(MStringEditor& lhs, T&& rhs) -> decltype(View(rhs), true) {return IString(lhs).Compare(View(rhs)) <= 0;}
+    template <class T> friend auto operator>=(MStringEditor& lhs, T&& rhs) -> decltype(View(rhs), true) {return IString(lhs).Compare(View(rhs)) >= 0;}
+    template <class T> friend auto operator==(T&& lhs, MStringEditor& rhs) -> decltype(View(lhs), true) {return View(lhs) == IString(rhs);}
+    template <class T> friend auto operator!=(T&& lhs, MStringEditor& rhs) -> decltype(View(lhs), true) {return View(lhs) != IString(rhs);}
+    template <class T> friend auto operator<(T&& lhs, MStringEditor& rhs)  -> decltype(View(lhs), true) {return View(lhs).Compare(IString(rhs)) < 0;}
+    template <class T> friend auto operator>(T&& lhs, MStringEditor& rhs)  -> decltype(View(lhs), true) {return View(lhs).Compare(IString(rhs)) > 0;}
+    template <class T> friend auto operator<=(T&& lhs, MStringEditor& rhs) -> decltype(View(lhs), true) {return View(lhs).Compare(IString(rhs)) <= 0;}
+    template <class T> friend auto operator>=(T&& lhs, MStringEditor& rhs) -> decltype(View(lhs), true) {return View(lhs).Compare(IString(rhs)) >= 0;}
+    friend bool operator==(MStringEditor& lhs, MStringEditor& rhs) {return IString(lhs) == IString(rhs);}
+    friend bool operator!=(MStringEditor& lhs, MStringEditor& rhs) {return IString(lhs) != IString(rhs);}
+    friend bool operator<(MStringEditor& lhs, MStringEditor& rhs)  {return IString(lhs).Compare(IString(rhs)) < 0;}
+    friend bool operator>(MStringEditor& lhs, MStringEditor& rhs)  {return IString(lhs).Compare(IString(rhs)) > 0;}
+    friend bool operator<=(MStringEditor& lhs, MStringEditor& rhs) {return IString(lhs).Compare(IString(rhs)) <= 0;}
+    friend bool operator>=(MStringEditor& lhs, MStringEditor& rhs) {return IString(lhs).Compare(IString(rhs)) >= 0;}
+#ifdef MSTRING_THREE_WAY_COMPARE
+    template <class T> friend auto operator<=>(MStringEditor& lhs, T&& rhs) -> decltype(View(rhs), std::strong_ordering::equal) {return IString(lhs).Compare(View(rhs)) <=> 0;}
+    template <class T> friend auto operator<=>(T&& lhs, MStringEditor& rhs) -> decltype(View(lhs), std::strong_ordering::equal) {return View(lhs).Compare(IString(rhs)) <=> 0;}
+    friend std::strong_ordering operator<=>(MStringEditor& lhs, MStringEditor& rhs) {return IString(lhs).Compare(IString(rhs)) <=> 0;}
+#endif
+
+    private:
+    void Grow(MSTRING_SIZE_T required_gap);
+
+    // The buffer's length covers the text and the gap. Text is [0, gap_start) and [gap_end, buffer.Length()).
+    MString buffer;
+    MSTRING_SIZE_T gap_start = 0;
+    MSTRING_SIZE_T gap_end = 0;
+};
+
+// An interned string. Atoms are handed out by an MStringInternTable, which stores exactly one copy of
+// each distinct string, so two atoms from the same table are equal exactly when their pointers are.
+// Atoms also carry their length and hash, and they stay valid for as long as the table is alive.
+// A default-constructed atom is "null", and is only equal to other null atoms.
+struct IAtom
+{
+    IAtom() = default;
+
+    MSTRING_SIZE_T Length() const {return entry->length;}
+    unsigned int Hash() const {return entry->hash;}
+    const char* Ptr() const {return (const char*)(entry + 1);} // Always null-terminated.
+    explicit operator bool() const {return entry != nullptr;}
+    operator IString() const {return IString(Ptr(), Length());}
+
+    inline friend bool operator==(IAtom lhs, IAtom rhs) {return lhs.entry == rhs.entry;}
+    inline friend bool operator!=(IAtom lhs, IAtom rhs) {return lhs.entry != rhs.entry;}
+
+    private:
+    friend struct MStringInternTable;
+    struct Entry
+    {
+        MSTRING_SIZE_T length;
+        unsigned int hash;
+    };
+    explicit IAtom(const Entry* entry) : entry(entry) {}
+    const Entry* entry = nullptr;
+};
+
+// Maps strings to atoms. String bytes are copied into large blocks owned by the table, so interning
+// doesn't do one allocation per string. In single-threaded mode there is no locking at all. In
+// thread-safe mode the table is split into independently locked shards (picked by hash), so threads
+// interning different strings rarely wait on each other.
+struct MStringInternTable
+{
+    explicit MStringInternTable(bool thread_safe = false);
+    ~MStringInternTable();
+    MStringInternTable(const MStringInternTable&) = delete;
+    MStringInternTable& operator=(const MStringInternTable&) = delete;
+
+    // Returns the atom for this string, adding it to the table if needed.
+    IAtom Intern(IString str);
+    // Returns the atom for this string if it has been interned already, or a null atom otherwise.
+    IAtom Find(IString str) const;
+    // Number of distinct strings in the table.
+    MSTRING_SIZE_T Count() const;
+
+    private:
+    struct Shard;
+    Shard& ShardFor(unsigned int hash) const;
+    Shard* shards;
+    unsigned int shard_count;
+};
+
+// Sorts an array of strings in byte order (like memcmp(), and a string comes before anything that it
+// is a prefix of). This is an MSD radix sort over a separate array of keys, which keep 8 bytes of
+// their string next to its pointer and length. Most of the work only looks at those cached bytes, so
+// heap strings get read once per 8 bytes of prefix that they share with other strings, instead of on
+// every comparison. With parallel set, large buckets get split between all of the cores. Arrays of
+// MStrings are sorted by moving the structs around, so none of their buffers get copied.
+void MStringSort(IString* strings, MSTRING_SIZE_T count, bool parallel = false);
+template <int InlineBytes>
+void MStringSort(BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count, bool parallel = false);
+
+// Removes adjacent duplicates from a sorted array, keeping the first of each, and returns the number
+// of strings left. Like std::unique, except that the MStrings past the end get freed.
+MSTRING_SIZE_T MStringUnique(IString* strings, MSTRING_SIZE_T count);
+template <int InlineBytes>
+MSTRING_SIZE_T MStringUnique(BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count);
+
+// Sorts an array of structs of the given size, which view() turns into strings. The structs get moved
+// with memcpy(). This is what MStringSort() uses for MStrings of every size.
+void MStringSortStructs(void* structs, MSTRING_SIZE_T count, MSTRING_SIZE_T size, IString (*view)(const void*), bool parallel);
+
+template <int InlineBytes>
+void MStringSort(BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count, bool parallel)
+{
+    IString (*view)(const void*) = [](const void* ptr)
+    {
+        const BasicMString<InlineBytes>* str = (const BasicMString<InlineBytes>*)ptr;
+        return IString(str->Ptr(), str->Length());
+    };
+    MStringSortStructs(strings, count, sizeof(BasicMString<InlineBytes>), view, parallel);
+}
+
+template <int InlineBytes>
+MSTRING_SIZE_T MStringUnique(BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count)
+{
+    MSTRING_SIZE_T kept = 0;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        if (kept && strings[i] == strings[kept - 1]) continue;
+        if (i != kept) strings[kept] = static_cast<BasicMString<InlineBytes>&&>(strings[i]);
+        ++kept;
+    }
+    for (MSTRING_SIZE_T i = kept; i < count; ++i) strings[i].Free();
+    return kept;
+}
+
+#ifndef MSTRING_NO_FILES
+// A read-only memory-mapped file. Contents() is a view straight into the mapping, so opening a file of
+// any size doesn't copy or allocate anything, and the OS pages it in as it gets read. Views into the
+// contents are only valid while the file stays open. Empty files open fine, with empty contents.
+struct MStringMappedFile
+{
+    MStringMappedFile() = default;
+    explicit MStringMappedFile(const char* path) {Open(path);}
+    ~MStringMappedFile() {Close();}
+    MStringMappedFile(MStringMappedFile&& other);
+    MStringMappedFile& operator=(MStringMappedFile&& other);
+    MStringMappedFile(const MStringMappedFile&) = delete;
+    MStringMappedFile& operator=(const MStringMappedFile&) = delete;
+
+    bool Open(const char* path); // Closes whatever we had open first. Returns false on failure.
+    void Close();
+    bool IsOpen() const {return is_open;}
+    IString Contents() const {return IString(ptr, length);}
+    MStringSplit Lines() const {return MStringSplit(Contents(), '\n', true);}
+
+    private:
+    const char* ptr = nullptr;
+    MSTRING_SIZE_T length = 0;
+    bool is_open = false;
+};
+
+// Reads a file a chunk at a time, for files too big to map (or pipes, which can't be mapped at all).
+// Records are handed out as IString views into our buffer, which stay valid until the next call.
+// When a record runs past the end of the buffer, the partial record moves to the front before the
+// next read, and the buffer only grows when a single record doesn't fit in it. Splitting works the
+// same way as MStringSplit.
+struct MStringFileReader
+{
+    explicit MStringFileReader(MSTRING_SIZE_T buffer_size = 1024 * 1024) : buffer_size(buffer_size) {}
+    ~MStringFileReader() {Close();}
+    MStringFileReader(const MStringFileReader&) = delete;
+    MStringFileReader& operator=(const MStringFileReader&) = delete;
+
+    bool Open(const char* path); // Closes whatever we had open first. Returns false on failure.
+    void Close();
+    bool IsOpen() const {return file != nullptr;}
+    bool Failed() const {return failed;} // True if a read failed, rather than reaching the end.
+
+    bool Next(IString* record, char delimiter);
+    bool NextLine(IString* line);
+
+    private:
+    bool Next(IString* record, char delimiter, bool lines);
+
+    MString buffer = {};         // Its length is how much of it has been filled.
+    MSTRING_SIZE_T start = 0;    // Where the next record starts.
+    MSTRING_SIZE_T scanned = 0;  // Everything before here has been searched for a delimiter already.
+    MSTRING_SIZE_T buffer_size;
+    void* file = nullptr;
+    bool at_end = false;
+    bool failed = false;
+};
+
+// Reads a whole file into a string. Regular files get a single allocation of exactly their size.
+// Returns false if the file can't be opened or read.
+bool MStringReadFile(const char* path, MString* contents);
+#endif
+
+// A flat table of strings. Every string's bytes go back to back in one buffer (each with a null
+// terminator), and an index keeps each one's offset and length, so a big table is two allocations
+// and 12 bytes of overhead per string, instead of a 32-byte MString and often a heap block each.
+// Strings are handed out as IString views, which stay valid until the next change to the table.
+// Set() and Remove() leave the old bytes behind as garbage, and Compact() gets rid of it.
+// Tables can be saved to a file, and loading one maps the file and uses it as is, with no parsing
+// and no allocations. The first change to a loaded table copies it into memory. The file is a
+// 32-byte header (the magic "MStrTab", a version, a byte order mark, the string count and the data
+// size), then the index, then the data. Load() checks the header and the sizes. Call Validate() as
+// well if the file might be corrupt, which checks every entry.
+struct MStringTable
+{
+    MStringTable() = default;
+    ~MStringTable() {Clear();}
+    MStringTable(MStringTable&& other);
+    MStringTable& operator=(MStringTable&& other);
+    MStringTable(const MStringTable&) = delete;
+    MStringTable& operator=(const MStringTable&) = delete;
+
+    MSTRING_SIZE_T Count() const {return entry_count;}
+    IString operator[](MSTRING_SIZE_T i) const {return IString(data + entries[i].offset, (MSTRING_SIZE_T)entries[i].length);}
+    MSTRING_SIZE_T DataLength() const {return data_length;}  // Bytes in the buffer, including terminators and garbage.
+    MSTRING_SIZE_T WastedBytes() const {return wasted;}      // Garbage that Compact() would get rid of.
+    bool IsMapped() const {return mapped;}
+
+    // Appending returns the index of the new string. Building in bulk sizes both buffers once. Strings
+    // are limited to 4 GB each.
+    MSTRING_SIZE_T Append(IString str);
+    void Append(const IString* strings, MSTRING_SIZE_T count);
+    template <int InlineBytes>
+    void Append(const BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count);
+    void Reserve(MSTRING_SIZE_T count, MSTRING_SIZE_T data_bytes); // Room for this many strings and bytes in total.
+
+    // Set() overwrites the old bytes if the new string fits, and otherwise appends it to the buffer.
+    // Remove() moves the later entries down by one, so it is O(n) in the number of strings.
+    void Set(MSTRING_SIZE_T index, IString str);
+    void Remove(MSTRING_SIZE_T index);
+    void Compact(); // Rewrites the buffer in index order, without the garbage.
+    void Clear();   // Removes everything and frees (or unmaps) the buffers.
+
+#ifndef MSTRING_NO_FILES
+    bool Save(const char* path) const; // Always writes a compacted table. Don't overwrite the file we have mapped.
+    bool Load(const char* path);       // Replaces our contents if it succeeds.
+#endif
+    bool Validate() const;             // True if every entry is inside the data, and null-terminated.
+
+    private:
+#pragma pack(push, 4)
+    struct Entry
+    {
+        unsigned long long offset;
+        unsigned int length;
+    };
+#pragma pack(pop)
+    static_assert(sizeof(Entry) == 12, "Entries are part of the file format.");
+    void Own();
+    void GrowEntries(MSTRING_SIZE_T required);
+    void GrowData(MSTRING_SIZE_T required);
+
+    Entry* entries = nullptr;
+    char* data = nullptr;
+    MSTRING_SIZE_T entry_count = 0;
+    MSTRING_SIZE_T entry_capacity = 0;
+    MSTRING_SIZE_T data_length = 0;
+    MSTRING_SIZE_T data_capacity = 0;
+    MSTRING_SIZE_T wasted = 0;
+    bool mapped = false; // The buffers point into file, and we don't own them.
+#ifndef MSTRING_NO_FILES
+    MStringMappedFile file;
+#endif
+};
+
+template <int InlineBytes>
+void MStringTable::Append(const BasicMString<InlineBytes>* strings, MSTRING_SIZE_T count)
+{
+    MSTRING_SIZE_T bytes = 0;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i) bytes += strings[i].Length() + 1;
+    Reserve(entry_count + count, data_length + bytes);
+    for (MSTRING_SIZE_T i = 0; i < count; ++i) Append(IString(strings[i].Ptr(), strings[i].Length()));
+}
+
+#ifndef MSTRING_NO_STD_HASH
+#include <functional>
+namespace std
+{
+    template <> struct hash<IString> {size_t operator()(IString str) const {return str.Hash();}};
+    template <int N> struct hash<BasicMString<N>> {size_t operator()(const BasicMString<N>& str) const {return str.Hash();}};
+    template <> struct hash<IAtom>   {size_t operator()(IAtom atom) const {return atom.Hash();}};
+}
+#endif
+
+#define MSTRING_H
+#endif
+
+// ========================================================================== //
+// End of header. Implementation below.
+// ========================================================================== //
+
+#ifdef MSTRING_IMPLEMENTATION
+
+// Include and use standard library versions of malloc, realloc, free, strtod, memcpy, memmove, memcmp, and strlen,
+// if they were not defined by the user.
+#if !defined MSTRING_MALLOC || !defined MSTRING_REALLOC || !defined MSTRING_FREE || !defined MSTRING_STRTOD
+#include <stdlib.h>
+#endif
+#if !defined MSTRING_MEMCPY || !defined MSTRING_MEMMOVE || !defined MSTRING_MEMCMP || !defined MSTRING_STRLEN
+#include <string.h>
+#endif
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#if !defined MSTRING_SINGLE_THREADED || defined MSTRING_STATS || defined MSTRING_POOL
+#include <atomic>
+#endif
+#ifdef MSTRING_STATS
+#include <stddef.h>
+#endif
+#ifndef MSTRING_NO_FILES
+#include <stdio.h>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+#ifndef MSTRING_ASSERT
+#include <cassert>
+#define MSTRING_ASSERT assert
+#endif
+
+#ifndef MSTRING_MALLOC
+#define MSTRING_MALLOC(size) malloc(size)
+#endif
+#ifndef MSTRING_REALLOC
+#define MSTRING_REALLOC(old_ptr, size) realloc(old_ptr, size)
+#endif
+#ifndef MSTRING_FREE
+#define MSTRING_FREE(ptr) free(ptr)
+#endif
+#ifndef MSTRING_STRTOD
+#define MSTRING_STRTOD(str) strtod(str, nullptr)
+#endif
+#ifndef MSTRING_MEMCPY
+#define MSTRING_MEMCPY(dst, src, size) memcpy(dst, src, size)
+#endif
+#ifndef MSTRING_MEMMOVE
+#define MSTRING_MEMMOVE(dst, src, size) memmove(dst, src, size)
+#endif
+#ifndef MSTRING_MEMCMP
+#define MSTRING_MEMCMP(lhs, rhs, size) memcmp(lhs, rhs, size)
+#endif
+#ifndef MSTRING_STRLEN
+#define MSTRING_STRLEN(str) strlen(str)
+#endif
+#ifndef MSTRING_GOOD_SIZE
+#ifdef MSTRING_POOL
+#define MSTRING_GOOD_SIZE(size) MStringPoolGoodSize(size)
+#else
+#define MSTRING_GOOD_SIZE(size) (size)
+#endif
+#endif
+
+// SIMD support. SSE2 is part of x64, so we can always use it there. SSSE3 and AVX2 kernels are compiled
+// with a target attribute (MSVC doesn't need one) and are only called if the CPU supports them.
+#if !defined MSTRING_NO_SIMD && (defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2))
+#define MSTRING_SSE2 1
+#include <immintrin.h>
+#if defined _MSC_VER && !defined __clang__
+#include <intrin.h>
+#define MSTRING_TARGET_SSSE3
+#define MSTRING_TARGET_AVX2
+#else
+#define MSTRING_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define MSTRING_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static bool MStringCPUHasSSSE3()
+{
+#if defined _MSC_VER && !defined __clang__
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static bool MStringCPUHasAVX2()
+{
+#if defined _MSC_VER && !defined __clang__
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    if (!os_saves_ymm) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// Every SIMD kernel produces exactly the same results as its scalar version, so it doesn't matter
+// if something runs before this gets initialized and takes the SSE2 path instead.
+static const bool mstring_has_ssse3 = MStringCPUHasSSSE3();
+static const bool mstring_has_avx2 = MStringCPUHasAVX2();
+#endif
+
+// Memory instrumentation. Every thread counts into its own thread_local block, so counting never has
+// to lock anything or use atomic read-modify-writes. The counters are still atomics (with relaxed
+// loads and stores) so that a snapshot can read them from another thread. Blocks are linked into a
+// global list while their thread is alive, and get added to the retired totals when it exits. Strings
+// can still be touched after that (by other thread_local destructors, for example), and those updates
+// go straight into the retired totals under the lock, the same way the pool handles its thread cache.
+// Resetting just remembers the current totals, since other threads' counters aren't ours to write.
+#ifdef MSTRING_STATS
+constexpr static int MStringStatsCounterCount = (int)((sizeof(MStringStats) - offsetof(MStringStats, constructions)) / sizeof(unsigned long long));
+
+struct MStringStatsThread
+{
+    std::atomic<unsigned long long> counters[MStringStatsCounterCount];
+    MStringStatsThread* next;
+
+    MStringStatsThread();
+    ~MStringStatsThread();
+};
+
+static std::mutex mstring_stats_mutex;
+static MStringStatsThread* mstring_stats_threads = nullptr;
+static unsigned long long mstring_stats_retired[MStringStatsCounterCount];
+static unsigned long long mstring_stats_baseline[MStringStatsCounterCount];
+static thread_local MStringStatsThread mstring_stats_thread;
+static thread_local bool mstring_stats_thread_gone = false;
+
+MStringStatsThread::MStringStatsThread()
+{
+    for (auto& counter : counters) counter.store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mstring_stats_mutex);
+    next = mstring_stats_threads;
+    mstring_stats_threads = this;
+}
+
+MStringStatsThread::~MStringStatsThread()
+{
+    std::lock_guard<std::mutex> lock(mstring_stats_mutex);
+    for (int i = 0; i < MStringStatsCounterCount; ++i) mstring_stats_retired[i] += counters[i].load(std::memory_order_relaxed);
+    MStringStatsThread** link = &mstring_stats_threads;
+    while (*link != this) link = &(*link)->next;
+    *link = next;
+    mstring_stats_thread_gone = true;
+}
+
+static void MStringStatsAdd(int index, unsigned long long amount)
+{
+    if (mstring_stats_thread_gone)
+    {
+        std::lock_guard<std::mutex> lock(mstring_stats_mutex);
+        mstring_stats_retired[index] += amount;
+        return;
+    }
+    std::atomic<unsigned long long>& counter = mstring_stats_thread.counters[index];
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+static int MStringStatsLengthBucket(MSTRING_SIZE_T length)
+{
+    int bucket = 0;
+    for (unsigned long long n = (unsigned long long)length; n > 1; n >>= 1) ++bucket;
+    return bucket;
+}
+
+#define MSTRING_STAT_INDEX(field) (int)((offsetof(MStringStats, field) - offsetof(MStringStats, constructions)) / sizeof(unsigned long long))
+#define MSTRING_STAT(field, amount) MStringStatsAdd(MSTRING_STAT_INDEX(field), (unsigned long long)(amount))
+#define MSTRING_STAT_LENGTH(length) MStringStatsAdd(MSTRING_STAT_INDEX(length_histogram) + MStringStatsLengthBucket(length), 1)
+
+// Totals for every thread, without the baseline from the last reset. Expects the mutex to be locked.
+static void MStringStatsTotals(unsigned long long* totals)
+{
+    for (int i = 0; i < MStringStatsCounterCount; ++i) totals[i] = mstring_stats_retired[i];
+    for (MStringStatsThread* thread = mstring_stats_threads; thread; thread = thread->next)
+    {
+        for (int i = 0; i < MStringStatsCounterCount; ++i) totals[i] += thread->counters[i].load(std::memory_order_relaxed);
+    }
+}
+
+MStringStats MStringStatsSnapshot()
+{
+    MStringStats stats = {};
+    unsigned long long totals[MStringStatsCounterCount];
+    {
+        std::lock_guard<std::mutex> lock(mstring_stats_mutex);
+        MStringStatsTotals(totals);
+        for (int i = 0; i < MStringStatsCounterCount; ++i) totals[i] -= mstring_stats_baseline[i];
+    }
+    stats.enabled = true;
+    MSTRING_MEMCPY(&stats.constructions, totals, sizeof(totals));
+    return stats;
+}
+
+void MStringStatsReset()
+{
+    std::lock_guard<std::mutex> lock(mstring_stats_mutex);
+    MStringStatsTotals(mstring_stats_baseline);
+}
+#else
+#define MSTRING_STAT(field, amount) ((void)0)
+#define MSTRING_STAT_LENGTH(length) ((void)0)
+
+MStringStats MStringStatsSnapshot() {return {};}
+void MStringStatsReset() {}
+#endif
+
+// Buffer pool (see MSTRING_POOL). Blocks still come from MSTRING_MALLOC one at a time, but freed blocks
+// get cached by size class instead of going straight back. Each thread allocates from and frees into
+// its own cache without any locking. When a cache gets too full, half of it goes to a shared list for
+// that class, and an empty cache takes the whole shared list. The shared lists are lock-free stacks,
+// and they never have single blocks popped off them (only everything at once, with an exchange), so
+// they don't have ABA problems. A block freed by a different thread than the one that allocated it just
+// joins the freeing thread's cache, so cross-thread frees are no different from any other free.
+#ifdef MSTRING_POOL
+constexpr static MSTRING_SIZE_T MStringPoolMaxSize = 32 * 1024;
+constexpr static int MStringPoolClassCount = 39;
+constexpr static MSTRING_SIZE_T MStringPoolCacheBytes = 64 * 1024; // Per class, per thread.
+
+struct MStringPoolBlock
+{
+    MStringPoolBlock* next;
+};
+
+// Classes go up in steps of 16 bytes from 32 to 128, and then in four steps per power of two.
+static int MStringPoolClass(MSTRING_SIZE_T size)
+{
+    if (size <= 128) return (size <= 32) ? 0 : (int)((size + 15) / 16) - 2;
+    int log = 7;
+    while ((size - 1) >> (log + 1)) ++log;
+    return 7 + (log - 7) * 4 + (int)((size - 1 - ((MSTRING_SIZE_T)1 << log)) >> (log - 2));
+}
+
+static MSTRING_SIZE_T MStringPoolClassSize(int index)
+{
+    if (index < 7) return 32 + 16 * (MSTRING_SIZE_T)index;
+    int log = 7 + (index - 7) / 4;
+    return ((MSTRING_SIZE_T)1 << log) + (MSTRING_SIZE_T)((index - 7) % 4 + 1) * ((MSTRING_SIZE_T)1 << (log - 2));
+}
+
+static MSTRING_SIZE_T MStringPoolGoodSize(MSTRING_SIZE_T size)
+{
+    return (size > MStringPoolMaxSize) ? size : MStringPoolClassSize(MStringPoolClass(size));
+}
+
+static std::atomic<MStringPoolBlock*> mstring_pool_shared[MStringPoolClassCount];
+
+static void MStringPoolPushShared(int index, MStringPoolBlock* first, MStringPoolBlock* last)
+{
+    MStringPoolBlock* head = mstring_pool_shared[index].load(std::memory_order_relaxed);
+    do last->next = head;
+    while (!mstring_pool_shared[index].compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+static void MStringPoolFreeList(MStringPoolBlock* block)
+{
+    while (block)
+    {
+        MStringPoolBlock* next = block->next;
+        MSTRING_FREE(block);
+        block = next;
+    }
+}
+
+struct MStringPoolCache
+{
+    MStringPoolBlock* lists[MStringPoolClassCount] = {};
+    MSTRING_SIZE_T counts[MStringPoolClassCount] = {};
+    ~MStringPoolCache();
+};
+
+// Strings can still be freed after this thread's cache is gone (by other thread_local destructors, for
+// example). Those go straight to the shared lists, and allocations go straight to MSTRING_MALLOC.
+static thread_local MStringPoolCache mstring_pool_cache;
+static thread_local bool mstring_pool_cache_gone = false;
+
+MStringPoolCache::~MStringPoolCache()
+{
+    for (int i = 0; i < MStringPoolClassCount; ++i)
+    {
+        if (!lists[i]) continue;
+        MStringPoolBlock* last = lists[i];
+        while (last->next) last = last->next;
+        MStringPoolPushShared(i, lists[i], last);
+    }
+    mstring_pool_cache_gone = true;
+}
+
+static void* MStringPoolAllocate(MSTRING_SIZE_T size)
+{
+    if (size > MStringPoolMaxSize) return MSTRING_MALLOC(size);
+    int index = MStringPoolClass(size);
+    if (!mstring_pool_cache_gone)
+    {
+        MStringPoolCache& cache = mstring_pool_cache;
+        if (!cache.lists[index])
+        {
+            MStringPoolBlock* list = mstring_pool_shared[index].exchange(nullptr, std::memory_order_acquire);
+            cache.lists[index] = list;
+            for (; list; list = list->next) cache.counts[index]++;
+        }
+        if (MStringPoolBlock* block = cache.lists[index])
+        {
+            cache.lists[index] = block->next;
+            cache.counts[index]--;
+            return block;
+        }
+    }
+    return MSTRING_MALLOC(MStringPoolClassSize(index));
+}
+
+static void MStringPoolFree(void* ptr, MSTRING_SIZE_T size)
+{
+    if (size > MStringPoolMaxSize)
+    {
+        MSTRING_FREE(ptr);
+        return;
+    }
+    int index = MStringPoolClass(size);
+    MStringPoolBlock* block = (MStringPoolBlock*)ptr;
+    if (mstring_pool_cache_gone)
+    {
+        MStringPoolPushShared(index, block, block);
+        return;
+    }
+
+    MStringPoolCache& cache = mstring_pool_cache;
+    block->next = cache.lists[index];
+    cache.lists[index] = block;
+    MSTRING_SIZE_T limit = MStringPoolCacheBytes / MStringPoolClassSize(index);
+    if (++cache.counts[index] <= ((limit > 8) ? limit : 8)) return;
+
+    // Keep the most recently freed half, since it is more likely to still be in the CPU cache.
+    MStringPoolBlock* last = cache.lists[index];
+    for (MSTRING_SIZE_T i = 1; i < cache.counts[index] / 2; ++i) last = last->next;
+    MStringPoolBlock* first = last->next;
+    last->next = nullptr;
+    last = first;
+    while (last->next) last = last->next;
+    MStringPoolPushShared(index, first, last);
+    cache.counts[index] /= 2;
+}
+
+static void* MStringPoolReallocate(void* ptr, MSTRING_SIZE_T old_size, MSTRING_SIZE_T new_size)
+{
+    if (old_size > MStringPoolMaxSize && new_size > MStringPoolMaxSize) return MSTRING_REALLOC(ptr, new_size);
+    if (old_size <= MStringPoolMaxSize && new_size <= MStringPoolMaxSize && MStringPoolClass(old_size) == MStringPoolClass(new_size)) return ptr;
+    void* new_ptr = MStringPoolAllocate(new_size);
+    MSTRING_MEMCPY(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+    MStringPoolFree(ptr, old_size);
+    return new_ptr;
+}
+
+void MStringPoolTrim()
+{
+    for (int i = 0; i < MStringPoolClassCount; ++i)
+    {
+        if (!mstring_pool_cache_gone)
+        {
+            MStringPoolFreeList(mstring_pool_cache.lists[i]);
+            mstring_pool_cache.lists[i] = nullptr;
+            mstring_pool_cache.counts[i] = 0;
+        }
+        MStringPoolFreeList(mstring_pool_shared[i].exchange(nullptr, std::memory_order_acquire));
+    }
+}
+#else
+void MStringPoolTrim() {}
+#endif
+
+// The default heap, for buffers that don't come from an MStringAllocator. Sizes are always the full
+// block size, header included, and they always come from MSTRING_GOOD_SIZE.
+static void* MStringHeapAllocate(MSTRING_SIZE_T size)
+{
+#ifdef MSTRING_POOL
+    return MStringPoolAllocate(size);
+#else
+    return MSTRING_MALLOC(size);
+#endif
+}
+
+static void* MStringHeapReallocate(void* ptr, MSTRING_SIZE_T old_size, MSTRING_SIZE_T new_size)
+{
+#ifdef MSTRING_POOL
+    return MStringPoolReallocate(ptr, old_size, new_size);
+#else
+    (void)old_size;
+    return MSTRING_REALLOC(ptr, new_size);
+#endif
+}
+
+static void MStringHeapFree(void* ptr, MSTRING_SIZE_T size)
+{
+#ifdef MSTRING_POOL
+    MStringPoolFree(ptr, size);
+#else
+    (void)size;
+    MSTRING_FREE(ptr);
+#endif
+}
+
+// Capacity for a default heap buffer that can hold at least `capacity` bytes (plus the null terminator).
+static MSTRING_SIZE_T MStringRoundCapacity(MSTRING_SIZE_T capacity, MSTRING_SIZE_T header)
+{
+    return (MSTRING_SIZE_T)MSTRING_GOOD_SIZE(header + capacity + 1) - header - 1;
+}
+
+// Misc one-liners that have to be in the implementation section because they call
+// strlen() or memcmp(), which the caller of this library might re-define.
+IString::IString(const char* ptr) : ptr(ptr), length((MSTRING_SIZE_T)MSTRING_STRLEN(ptr)) {}
+IString::IString(MStringEditor& editor) : ptr(editor.Ptr()), length(editor.Length()) {}
+unsigned int IString::Hash() const {return MStringHash(ptr, length);}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>::BasicMString(const char* ptr) : BasicMString(ptr, (MSTRING_SIZE_T)MSTRING_STRLEN(ptr)) {}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Insert(MSTRING_SIZE_T index, const char* str) {return Insert(index, str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Prepend(const char* str) {return Insert(0, str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Append(const char* str) {return Insert(Length(), str, (MSTRING_SIZE_T)MSTRING_STRLEN(str));}
+
+// The hash is wyhash (final version 4), folded down to 32 bits at the end. The constants and the
+// compile-time version are up in the header.
+static inline unsigned long long MStringMix(unsigned long long a, unsigned long long b)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)a * b;
+    return (unsigned long long)r ^ (unsigned long long)(r >> 64);
+#else
+    return MStringConstMix(a, b);
+#endif
+}
+
+static inline unsigned long long MStringRead8(const unsigned char* p) {unsigned long long v; MSTRING_MEMCPY(&v, p, 8); return v;}
+static inline unsigned long long MStringRead4(const unsigned char* p) {unsigned int v; MSTRING_MEMCPY(&v, p, 4); return v;}
+static inline unsigned long long MStringRead3(const unsigned char* p, MSTRING_SIZE_T k)
+{
+    return (((unsigned long long)p[0]) << 16) | (((unsigned long long)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static inline void MStringHashStripe(unsigned long long* acc, const unsigned char* p, const unsigned char* key)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        unsigned long long value = MStringRead8(p + i * 8);
+        unsigned long long keyed = value ^ MStringRead8(key + i * 8);
+        acc[i ^ 1] += value;
+        acc[i] += (keyed & 0xffffffffull) * (keyed >> 32);
+    }
+}
+
+static inline void MStringHashScramble(unsigned long long* acc, const unsigned char* key)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        unsigned long long a = acc[i];
+        a ^= a >> 47;
+        a ^= MStringRead8(key + i * 8);
+        acc[i] = a * MStringHashPrime32;
+    }
+}
+
+// Runs every stripe except the last one, which always covers the final 64 bytes of the input.
+static inline void MStringHashAccumulate(unsigned long long* acc, const unsigned char* p, MSTRING_SIZE_T length)
+{
+    const unsigned char* key = (const unsigned char*)MStringHashLongSecret;
+    MSTRING_SIZE_T stripes = (length - 1) / 64;
+    for (MSTRING_SIZE_T n = 0; n < stripes; ++n)
+    {
+        MStringHashStripe(acc, p + n * 64, key + (n % MStringHashStripesPerBlock) * 8);
+        if (n % MStringHashStripesPerBlock == MStringHashStripesPerBlock - 1) MStringHashScramble(acc, key + MStringHashScrambleKey);
+    }
+    MStringHashStripe(acc, p + length - 64, key + MStringHashLastStripeKey);
+}
+
+#ifdef MSTRING_SSE2
+static inline void MStringHashStripeSSE2(__m128i* acc, const unsigned char* p, const unsigned char* key)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(p + i * 16));
+        __m128i keyed = _mm_xor_si128(value, _mm_loadu_si128((const __m128i*)(key + i * 16)));
+        __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+        acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+    }
+}
+
+static inline void MStringHashScrambleSSE2(__m128i* acc, const unsigned char* key)
+{
+    const __m128i prime = _mm_set1_epi32((int)MStringHashPrime32);
+    for (int i = 0; i < 4; ++i)
+    {
+        __m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(key + i * 16)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+}
+
+static void MStringHashAccumulateSSE2(unsigned long long* acc, const unsigned char* p, MSTRING_SIZE_T length)
+{
+    const unsigned char* key = (const unsigned char*)MStringHashLongSecret;
+    __m128i lanes[4];
+    for (int i = 0; i < 4; ++i) lanes[i] = _mm_loadu_si128((const __m128i*)(acc + i * 2));
+    MSTRING_SIZE_T stripes = (length - 1) / 64;
+    for (MSTRING_SIZE_T n = 0; n < stripes; ++n)
+    {
+        MStringHashStripeSSE2(lanes, p + n * 64, key + (n % MStringHashStripesPerBlock) * 8);
+        if (n % MStringHashStripesPerBlock == MStringHashStripesPerBlock - 1) MStringHashScrambleSSE2(lanes, key + MStringHashScrambleKey);
+    }
+    MStringHashStripeSSE2(lanes, p + length - 64, key + MStringHashLastStripeKey);
+    for (int i = 0; i < 4; ++i) _mm_storeu_si128((__m128i*)(acc + i * 2), lanes[i]);
+}
+
+MSTRING_TARGET_AVX2 static inline void MStringHashStripeAVX2(__m256i* acc, const unsigned char* p, const unsigned char* key)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(p + i * 32));
+        __m256i keyed = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i*)(key + i * 32)));
+        __m256i product = _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+        acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(product, swapped));
+    }
+}
+
+MSTRING_TARGET_AVX2 static inline void MStringHashScrambleAVX2(__m256i* acc, const unsigned char* key)
+{
+    const __m256i prime = _mm256_set1_epi32((int)MStringHashPrime32);
+    for (int i = 0; i < 2; ++i)
+    {
+        __m256i a = _mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)(key + i * 32)));
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        acc[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+}
+
+MSTRING_TARGET_AVX2 static void MStringHashAccumulateAVX2(unsigned long long* acc, const unsigned char* p, MSTRING_SIZE_T length)
+{
+    const unsigned char* key = (const unsigned char*)MStringHashLongSecret;
+    __m256i lanes[2];
+    for (int i = 0; i < 2; ++i) lanes[i] = _mm256_loadu_si256((const __m256i*)(acc + i * 4));
+    MSTRING_SIZE_T stripes = (length - 1) / 64;
+    for (MSTRING_SIZE_T n = 0; n < stripes; ++n)
+    {
+        MStringHashStripeAVX2(lanes, p + n * 64, key + (n % MStringHashStripesPerBlock) * 8);
+        if (n % MStringHashStripesPerBlock == MStringHashStripesPerBlock - 1) MStringHashScrambleAVX2(lanes, key + MStringHashScrambleKey);
+    }
+    MStringHashStripeAVX2(lanes, p + length - 64, key + MStringHashLastStripeKey);
+    for (int i = 0; i < 2; ++i) _mm256_storeu_si256((__m256i*)(acc + i * 4), lanes[i]);
+}
+#endif
+
+static unsigned long long MStringHashLong(const unsigned char* p, MSTRING_SIZE_T length, unsigned long long seed)
+{
+    unsigned long long acc[8] =
+    {
+        MStringHashPrime32, 0x9E3779B185EBCA87ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull,
+        0x85EBCA77C2B2AE63ull, 0x85EBCA77ull, 0x27D4EB2F165667C5ull, 0xC2B2AE3Dull,
+    };
+#ifdef MSTRING_SSE2
+    if (mstring_has_avx2) MStringHashAccumulateAVX2(acc, p, length);
+    else MStringHashAccumulateSSE2(acc, p, length);
+#else
+    MStringHashAccumulate(acc, p, length);
+#endif
+
+    const unsigned char* key = (const unsigned char*)MStringHashLongSecret;
+    unsigned long long h = length * 0x9E3779B185EBCA87ull;
+    for (int i = 0; i < 4; ++i) h += MStringMix(acc[i * 2] ^ MStringRead8(key + 11 + i * 16), acc[i * 2 + 1] ^ MStringRead8(key + 19 + i * 16));
+    return MStringMix(h ^ seed, MStringHashSecret[1] ^ length);
+}
+
+unsigned int MStringHash(const void* data, MSTRING_SIZE_T length, unsigned int seed_in)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned long long* s = MStringHashSecret;
+    unsigned long long seed = seed_in ^ MStringMix(seed_in ^ s[0], s[1]);
+    if (length > MStringHashLongThreshold)
+    {
+        unsigned long long h = MStringHashLong(p, length, seed);
+        return (unsigned int)(h ^ (h >> 32));
+    }
+
+    unsigned long long a, b;
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            a = (MStringRead4(p) << 32) | MStringRead4(p + ((length >> 3) << 2));
+            b = (MStringRead4(p + length - 4) << 32) | MStringRead4(p + length - 4 - ((length >> 3) << 2));
+        }
+        else if (length > 0) {a = MStringRead3(p, length); b = 0;}
+        else a = b = 0;
+    }
+    else
+    {
+        MSTRING_SIZE_T i = length;
+        if (i > 48)
+        {
+            unsigned long long see1 = seed, see2 = seed;
+            do
+            {
+                seed = MStringMix(MStringRead8(p) ^ s[1], MStringRead8(p + 8) ^ seed);
+                see1 = MStringMix(MStringRead8(p + 16) ^ s[2], MStringRead8(p + 24) ^ see1);
+                see2 = MStringMix(MStringRead8(p + 32) ^ s[3], MStringRead8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = MStringMix(MStringRead8(p) ^ s[1], MStringRead8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = MStringRead8(p + i - 16);
+        b = MStringRead8(p + i - 8);
+    }
+    unsigned long long h = MStringMix(s[1] ^ length, MStringMix(a ^ s[1], b ^ seed));
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+// Byte loads and stores for the hash cache, which const Hash() calls can fill in from several threads
+// at once. MSVC gives volatile accesses acquire and release semantics on x86 and x64, but not on ARM.
+#ifdef MSTRING_SINGLE_THREADED
+static inline char MStringLoadByte(const char* p, bool) {return *p;}
+static inline void MStringStoreByte(char* p, char value, bool) {*p = value;}
+#elif defined _MSC_VER && !defined __clang__ && (defined _M_X64 || defined _M_IX86)
+static inline char MStringLoadByte(const char* p, bool) {return *(const volatile char*)p;}
+static inline void MStringStoreByte(char* p, char value, bool) {*(volatile char*)p = value;}
+#elif defined _MSC_VER && !defined __clang__
+#include <intrin.h>
+static inline char MStringLoadByte(const char* p, bool) {return _InterlockedOr8((volatile char*)p, 0);}
+static inline void MStringStoreByte(char* p, char value, bool) {_InterlockedExchange8((volatile char*)p, value);}
+#else
+static inline char MStringLoadByte(const char* p, bool acquire) {return __atomic_load_n(p, acquire ? __ATOMIC_ACQUIRE : __ATOMIC_RELAXED);}
+static inline void MStringStoreByte(char* p, char value, bool release) {__atomic_store_n(p, value, release ? __ATOMIC_RELEASE : __ATOMIC_RELAXED);}
+#endif
+
+template <int InlineBytes>
+BasicMString<InlineBytes>::BasicMString(const char* ptr, MSTRING_SIZE_T len) : BasicMString()
+{
+    MSTRING_ASSERT(ptr && len >= 0);
+
+    MSTRING_STAT(constructions, 1);
+    if (len <= MaxShortLength)
+    {
+        MSTRING_STAT(short_placements, 1);
+        if (len > 0) MSTRING_MEMCPY(data.stack, ptr, len);
+    }
+    else
+    {
+        MSTRING_STAT(heap_placements, 1);
+        MSTRING_SIZE_T capacity = len;
+        data.heap.ptr = AllocateBuffer(&capacity, &data.heap.flags, MStringAllocator::Current());
+        MSTRING_MEMCPY(data.heap.ptr, ptr, len);
+        SetHeapCapacity(capacity);
+    }
+
+    Ptr()[len] = '\0';
+    length = len;
+}
+
+// Bit tricks for turning SIMD comparison masks into indices.
+#ifdef MSTRING_SSE2
+static inline unsigned MStringLowestBit(unsigned mask)
+{
+#if defined _MSC_VER && !defined __clang__
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+static inline unsigned MStringHighestBit(unsigned mask)
+{
+#if defined _MSC_VER && !defined __clang__
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return (unsigned)index;
+#else
+    return 31 - (unsigned)__builtin_clz(mask);
+#endif
+}
+
+static inline unsigned MStringPopCount(unsigned mask)
+{
+    mask = mask - ((mask >> 1) & 0x55555555u);
+    mask = (mask & 0x33333333u) + ((mask >> 2) & 0x33333333u);
+    return (((mask + (mask >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+}
+#endif
+
+// Comparison. Short strings are where the call to memcmp() costs more than the comparison, so up to
+// 16 bytes we use two loads of the biggest size that fits, which overlap in the middle. Longer strings
+// go 16 bytes at a time (the first block doubles as an early reject), until they get long enough for
+// memcmp() to be worth calling. Ordering loads big-endian numbers, which compare like the bytes do.
+constexpr static MSTRING_SIZE_T MStringCompareMemcmpLength = 256;
+
+static inline unsigned long long MStringLoadBigEndian8(const char* p)
+{
+    unsigned char b[8];
+    MSTRING_MEMCPY(b, p, 8);
+    return ((unsigned long long)b[0] << 56) | ((unsigned long long)b[1] << 48) | ((unsigned long long)b[2] << 40) |
+           ((unsigned long long)b[3] << 32) | ((unsigned long long)b[4] << 24) | ((unsigned long long)b[5] << 16) |
+           ((unsigned long long)b[6] << 8) | (unsigned long long)b[7];
+}
+
+static inline unsigned long long MStringLoadBigEndian4(const char* p)
+{
+    unsigned char b[4];
+    MSTRING_MEMCPY(b, p, 4);
+    return ((unsigned long long)b[0] << 24) | ((unsigned long long)b[1] << 16) | ((unsigned long long)b[2] << 8) | b[3];
+}
+
+static inline bool MStringBytesEqual(const char* a, const char* b, MSTRING_SIZE_T n)
+{
+    if (n >= 16)
+    {
+#ifdef MSTRING_SSE2
+        if (n < MStringCompareMemcmpLength)
+        {
+            for (MSTRING_SIZE_T i = 0; i + 16 < n; i += 16)
+            {
+                __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+                if (_mm_movemask_epi8(equal) != 0xffff) return false;
+            }
+            // The last block overlaps the one before it.
+            __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + n - 16)), _mm_loadu_si128((const __m128i*)(b + n - 16)));
+            return _mm_movemask_epi8(equal) == 0xffff;
+        }
+#endif
+        return MSTRING_MEMCMP(a, b, n) == 0;
+    }
+    unsigned long long x, y;
+    if (n >= 8)
+    {
+        MSTRING_MEMCPY(&x, a, 8);
+        MSTRING_MEMCPY(&y, b, 8);
+        unsigned long long diff = x ^ y;
+        MSTRING_MEMCPY(&x, a + n - 8, 8);
+        MSTRING_MEMCPY(&y, b + n - 8, 8);
+        return (diff | (x ^ y)) == 0;
+    }
+    if (n >= 4)
+    {
+        unsigned int u, v, w, z;
+        MSTRING_MEMCPY(&u, a, 4);
+        MSTRING_MEMCPY(&v, b, 4);
+        MSTRING_MEMCPY(&w, a + n - 4, 4);
+        MSTRING_MEMCPY(&z, b + n - 4, 4);
+        return ((u ^ v) | (w ^ z)) == 0;
+    }
+    return n == 0 || (a[0] == b[0] && a[n >> 1] == b[n >> 1] && a[n - 1] == b[n - 1]);
+}
+
+static inline int MStringCompareBytes(const char* a, const char* b, MSTRING_SIZE_T n)
+{
+    if (n >= 16)
+    {
+#ifdef MSTRING_SSE2
+        if (n < MStringCompareMemcmpLength)
+        {
+            MSTRING_SIZE_T i = 0;
+            unsigned diff = 0;
+            for (; i + 16 < n && !diff; i += 16)
+            {
+                diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)))) ^ 0xffff;
+            }
+            if (diff) i -= 16;
+            else
+            {
+                i = n - 16; // The last block overlaps the one before it.
+                diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)))) ^ 0xffff;
+                if (!diff) return 0;
+            }
+            MSTRING_SIZE_T at = i + MStringLowestBit(diff);
+            return (int)(unsigned char)a[at] - (int)(unsigned char)b[at];
+        }
+#endif
+        return MSTRING_MEMCMP(a, b, n);
+    }
+    unsigned long long x, y;
+    if (n >= 8)
+    {
+        x = MStringLoadBigEndian8(a);
+        y = MStringLoadBigEndian8(b);
+        if (x == y)
+        {
+            x = MStringLoadBigEndian8(a + n - 8);
+            y = MStringLoadBigEndian8(b + n - 8);
+        }
+    }
+    else if (n >= 4)
+    {
+        x = (MStringLoadBigEndian4(a) << 32) | MStringLoadBigEndian4(a + n - 4);
+        y = (MStringLoadBigEndian4(b) << 32) | MStringLoadBigEndian4(b + n - 4);
+    }
+    else if (n > 0)
+    {
+        x = ((unsigned long long)(unsigned char)a[0] << 16) | ((unsigned long long)(unsigned char)a[n >> 1] << 8) | (unsigned char)a[n - 1];
+        y = ((unsigned long long)(unsigned char)b[0] << 16) | ((unsigned long long)(unsigned char)b[n >> 1] << 8) | (unsigned char)b[n - 1];
+    }
+    else return 0;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+// Two short strings can be compared straight out of their inline buffers, which are always safe to
+// read in full, no matter the length. A 16-byte load covers up to 16 bytes at once, and we mask off
+// the bytes past the length (they can be leftovers from a longer string). Buffers that are smaller
+// than a load, or builds without SIMD, use the functions above.
+template <int Bytes>
+static inline unsigned MStringInlineDiff(const char* a, const char* b, MSTRING_SIZE_T n, MSTRING_SIZE_T* at)
+{
+#ifdef MSTRING_SSE2
+    for (MSTRING_SIZE_T i = 0; i < n; i += 16)
+    {
+        if (i + 16 > (MSTRING_SIZE_T)Bytes) i = Bytes - 16;
+        __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        unsigned diff = (unsigned)_mm_movemask_epi8(equal) ^ 0xffff;
+        if (n - i < 16) diff &= (1u << (n - i)) - 1;
+        if (diff)
+        {
+            *at = i + MStringLowestBit(diff);
+            return diff;
+        }
+    }
+#endif
+    return 0;
+}
+
+template <int Bytes>
+static inline bool MStringInlineEqual(const char* a, const char* b, MSTRING_SIZE_T n)
+{
+#ifdef MSTRING_SSE2
+    MSTRING_SIZE_T at;
+    if (Bytes >= 16) return MStringInlineDiff<Bytes>(a, b, n, &at) == 0;
+#endif
+    return MStringBytesEqual(a, b, n);
+}
+
+template <int Bytes>
+static inline int MStringInlineCompare(const char* a, const char* b, MSTRING_SIZE_T n)
+{
+#ifdef MSTRING_SSE2
+    MSTRING_SIZE_T at;
+    if (Bytes >= 16) return MStringInlineDiff<Bytes>(a, b, n, &at) ? (int)(unsigned char)a[at] - (int)(unsigned char)b[at] : 0;
+#endif
+    return MStringCompareBytes(a, b, n);
+}
+
+bool operator==(IString lhs, IString rhs)     {return lhs.Length() == rhs.Length() && MStringBytesEqual(lhs.Ptr(), rhs.Ptr(), lhs.Length());}
+bool operator==(IString lhs, const char* rhs) {return lhs.Length() == (MSTRING_SIZE_T)MSTRING_STRLEN(rhs) && MStringBytesEqual(lhs.Ptr(), rhs, lhs.Length());}
+bool operator==(const char* lhs, IString rhs) {return (MSTRING_SIZE_T)MSTRING_STRLEN(lhs) == rhs.Length() && MStringBytesEqual(lhs, rhs.Ptr(), rhs.Length());}
+
+int IString::Compare(IString other) const
+{
+    MSTRING_SIZE_T n = (length < other.length) ? length : other.length;
+    int result = MStringCompareBytes(ptr, other.ptr, n);
+    if (result) return result;
+    return (length < other.length) ? -1 : (length > other.length) ? 1 : 0;
+}
+
+template <int InlineBytes>
+bool BasicMString<InlineBytes>::Equals(const BasicMString& other) const
+{
+    if (length != other.length) return false;
+    if (!IsHeap() && !other.IsHeap()) return MStringInlineEqual<InlineBytes>(data.stack, other.data.stack, length);
+    if (Ptr() == other.Ptr()) return true; // Copies that share a buffer.
+    if (HasCachedHash() && other.HasCachedHash() && Hash() != other.Hash()) return false;
+    return MStringBytesEqual(Ptr(), other.Ptr(), length);
+}
+
+template <int InlineBytes>
+int BasicMString<InlineBytes>::Compare(const BasicMString& other) const
+{
+    MSTRING_SIZE_T n = (length < other.length) ? length : other.length;
+    int result;
+    if (!IsHeap() && !other.IsHeap()) result = MStringInlineCompare<InlineBytes>(data.stack, other.data.stack, n);
+    else result = (Ptr() == other.Ptr()) ? 0 : MStringCompareBytes(Ptr(), other.Ptr(), n);
+    if (result) return result;
+    return (length < other.length) ? -1 : (length > other.length) ? 1 : 0;
+}
+
+// Single byte search. The AVX2 kernels hand their last partial block to the SSE2 ones, which hand
+// theirs to the scalar ones.
+static MSTRING_SIZE_T MStringFindByteScalar(const char* p, MSTRING_SIZE_T n, char c)
+{
+    for (MSTRING_SIZE_T i = 0; i < n; ++i) if (p[i] == c) return i;
+    return MStringNotFound;
+}
+
+static MSTRING_SIZE_T MStringRFindByteScalar(const char* p, MSTRING_SIZE_T n, char c)
+{
+    while (n > 0) if (p[--n] == c) return n;
+    return MStringNotFound;
+}
+
+static MSTRING_SIZE_T MStringCountByteScalar(const char* p, MSTRING_SIZE_T n, char c)
+{
+    MSTRING_SIZE_T count = 0;
+    for (MSTRING_SIZE_T i = 0; i < n; ++i) count += (p[i] == c);
+    return count;
+}
+
+#ifdef MSTRING_SSE2
+static MSTRING_SIZE_T MStringFindByteSSE2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    MSTRING_SIZE_T i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), needle));
+        if (mask) return i + MStringLowestBit(mask);
+    }
+    MSTRING_SIZE_T result = MStringFindByteScalar(p + i, n - i, c);
+    return (result == MStringNotFound) ? result : i + result;
+}
+
+static MSTRING_SIZE_T MStringRFindByteSSE2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; n >= 16; n -= 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + n - 16)), needle));
+        if (mask) return n - 16 + MStringHighestBit(mask);
+    }
+    return MStringRFindByteScalar(p, n, c);
+}
+
+static MSTRING_SIZE_T MStringCountByteSSE2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    MSTRING_SIZE_T count = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        count += MStringPopCount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), needle)));
+    }
+    return count + MStringCountByteScalar(p + i, n - i, c);
+}
+
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringFindByteAVX2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    MSTRING_SIZE_T i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), needle));
+        if (mask) return i + MStringLowestBit(mask);
+    }
+    MSTRING_SIZE_T result = MStringFindByteSSE2(p + i, n - i, c);
+    return (result == MStringNotFound) ? result : i + result;
+}
+
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringRFindByteAVX2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (; n >= 32; n -= 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + n - 32)), needle));
+        if (mask) return n - 32 + MStringHighestBit(mask);
+    }
+    return MStringRFindByteSSE2(p, n, c);
+}
+
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringCountByteAVX2(const char* p, MSTRING_SIZE_T n, char c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    MSTRING_SIZE_T count = 0, i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        count += MStringPopCount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), needle)));
+    }
+    return count + MStringCountByteSSE2(p + i, n - i, c);
+}
+#endif
+
+static MSTRING_SIZE_T MStringFindByte(const char* p, MSTRING_SIZE_T n, char c)
+{
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringFindByteAVX2(p, n, c) : MStringFindByteSSE2(p, n, c);
+#else
+    return MStringFindByteScalar(p, n, c);
+#endif
+}
+
+static MSTRING_SIZE_T MStringRFindByte(const char* p, MSTRING_SIZE_T n, char c)
+{
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringRFindByteAVX2(p, n, c) : MStringRFindByteSSE2(p, n, c);
+#else
+    return MStringRFindByteScalar(p, n, c);
+#endif
+}
+
+static MSTRING_SIZE_T MStringCountByte(const char* p, MSTRING_SIZE_T n, char c)
+{
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringCountByteAVX2(p, n, c) : MStringCountByteSSE2(p, n, c);
+#else
+    return MStringCountByteScalar(p, n, c);
+#endif
+}
+
+// ASCII case conversion, which flips the 0x20 bit of every byte from first to first + 25. The SIMD
+// compares are signed, so bytes from 0x80 up count as negative and are never letters.
+static void MStringChangeCaseScalar(char* p, MSTRING_SIZE_T n, char first)
+{
+    for (MSTRING_SIZE_T i = 0; i < n; ++i) if (p[i] >= first && p[i] <= first + 25) p[i] ^= 0x20;
+}
+
+#ifdef MSTRING_SSE2
+static void MStringChangeCaseSSE2(char* p, MSTRING_SIZE_T n, char first)
+{
+    const __m128i low = _mm_set1_epi8((char)(first - 1)), high = _mm_set1_epi8((char)(first + 26)), bit = _mm_set1_epi8(0x20);
+    MSTRING_SIZE_T i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(v, _mm_and_si128(letters, bit)));
+    }
+    MStringChangeCaseScalar(p + i, n - i, first);
+}
+
+MSTRING_TARGET_AVX2 static void MStringChangeCaseAVX2(char* p, MSTRING_SIZE_T n, char first)
+{
+    const __m256i low = _mm256_set1_epi8((char)(first - 1)), high = _mm256_set1_epi8((char)(first + 26)), bit = _mm256_set1_epi8(0x20);
+    MSTRING_SIZE_T i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(high, v));
+        _mm256_storeu_si256((__m256i*)(p + i), _mm256_xor_si256(v, _mm256_and_si256(letters, bit)));
+    }
+    MStringChangeCaseSSE2(p + i, n - i, first);
+}
+#endif
+
+static void MStringChangeCase(char* p, MSTRING_SIZE_T n, char first)
+{
+#ifdef MSTRING_SSE2
+    if (mstring_has_avx2) MStringChangeCaseAVX2(p, n, first);
+    else MStringChangeCaseSSE2(p, n, first);
+#else
+    MStringChangeCaseScalar(p, n, first);
+#endif
+}
+
+// Byte set search. `invert` finds the first byte that is NOT in the set instead.
+static MSTRING_SIZE_T MStringFindInSetScalar(const char* p, MSTRING_SIZE_T n, IString set, bool invert)
+{
+    bool table[256] = {};
+    for (char c : set) table[(unsigned char)c] = true;
+    for (MSTRING_SIZE_T i = 0; i < n; ++i) if (table[(unsigned char)p[i]] != invert) return i;
+    return MStringNotFound;
+}
+
+#ifdef MSTRING_SSE2
+// SSE2 doesn't have a byte shuffle, so we only vectorize small sets, by comparing against each member.
+constexpr static MSTRING_SIZE_T MStringMaxSSE2SetSize = 4;
+
+static MSTRING_SIZE_T MStringFindInSetSSE2(const char* p, MSTRING_SIZE_T n, IString set, bool invert)
+{
+    if (set.Length() == 0 || set.Length() > MStringMaxSSE2SetSize) return MStringFindInSetScalar(p, n, set, invert);
+
+    __m128i members[MStringMaxSSE2SetSize];
+    for (MSTRING_SIZE_T j = 0; j < MStringMaxSSE2SetSize; ++j) members[j] = _mm_set1_epi8(set[(j < set.Length()) ? j : 0]);
+    unsigned flip = (invert) ? 0xffff : 0;
+    MSTRING_SIZE_T i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, members[0]), _mm_cmpeq_epi8(block, members[1])),
+                                     _mm_or_si128(_mm_cmpeq_epi8(block, members[2]), _mm_cmpeq_epi8(block, members[3])));
+        unsigned mask = (unsigned)_mm_movemask_epi8(match) ^ flip;
+        if (mask) return i + MStringLowestBit(mask);
+    }
+    MSTRING_SIZE_T result = MStringFindInSetScalar(p + i, n - i, set, invert);
+    return (result == MStringNotFound) ? result : i + result;
+}
+
+// Exact membership test for any set, using two nibble lookup tables: for each low nibble, the tables
+// hold a bitmask of which high nibbles are in the set (high nibbles 0-7 in one table, 8-15 in the other).
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringFindInSetAVX2(const char* p, MSTRING_SIZE_T n, IString set, bool invert)
+{
+    alignas(16) unsigned char low_table[16] = {}, high_table[16] = {};
+    for (char c : set)
+    {
+        unsigned char b = (unsigned char)c;
+        if (b < 0x80) low_table[b & 15] |= (unsigned char)(1 << (b >> 4));
+        else high_table[b & 15] |= (unsigned char)(1 << ((b >> 4) - 8));
+    }
+    const __m256i low_rows = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)low_table));
+    const __m256i high_rows = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)high_table));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i seven = _mm256_set1_epi8(7);
+    unsigned flip = (invert) ? 0xffffffffu : 0;
+
+    MSTRING_SIZE_T i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i lo = _mm256_and_si256(block, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble);
+        __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(low_rows, lo), _mm256_shuffle_epi8(high_rows, lo), _mm256_cmpgt_epi8(hi, seven));
+        __m256i bit = _mm256_shuffle_epi8(bits, hi);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit)) ^ flip;
+        if (mask) return i + MStringLowestBit(mask);
+    }
+    MSTRING_SIZE_T result = MStringFindInSetSSE2(p + i, n - i, set, invert);
+    return (result == MStringNotFound) ? result : i + result;
+}
+#endif
+
+static MSTRING_SIZE_T MStringFindInSet(const char* p, MSTRING_SIZE_T n, IString set, bool invert)
+{
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringFindInSetAVX2(p, n, set, invert) : MStringFindInSetSSE2(p, n, set, invert);
+#else
+    return MStringFindInSetScalar(p, n, set, invert);
+#endif
+}
+
+// Two-Way reads the needle and haystack through this, so that RFind() can run it on both of them
+// backwards. When reversed, p points one past the end of the bytes.
+template <bool Reverse>
+struct MStringTwoWayBytes
+{
+    const unsigned char* p;
+    unsigned char operator[](MSTRING_SIZE_T i) const {return Reverse ? *(p - 1 - i) : p[i];}
+};
+
+// Two-Way string matching (Crochemore & Perrin), which is linear time and constant space.
+// This is the same formulation that musl uses for memmem(). Needle length must be at least 1.
+// Reversed, it finds the last match instead of the first (and still returns where it starts).
+template <bool Reverse>
+static MSTRING_SIZE_T MStringTwoWay(const char* haystack, MSTRING_SIZE_T n, const char* needle, MSTRING_SIZE_T m)
+{
+    const unsigned char* hay = (const unsigned char*)haystack;
+    const unsigned char* ndl = (const unsigned char*)needle;
+    const MStringTwoWayBytes<Reverse> h = {Reverse ? hay + n : hay};
+    const MStringTwoWayBytes<Reverse> s = {Reverse ? ndl + m : ndl};
+    bool byteset[256] = {};
+    MSTRING_SIZE_T shift[256];
+    for (MSTRING_SIZE_T i = 0; i < m; ++i)
+    {
+        byteset[s[i]] = true;
+        shift[s[i]] = i + 1;
+    }
+
+    // Compute the maximal suffix, for both byte orderings, and use whichever critical factorization is later.
+    MSTRING_SIZE_T ms = 0, p0 = 0, ip = 0, jp, k, p = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ip = (MSTRING_SIZE_T)-1; jp = 0; k = p = 1;
+        while (jp + k < m)
+        {
+            unsigned char a = s[ip + k], b = s[jp + k];
+            if (a == b)
+            {
+                if (k == p) {jp += p; k = 1;}
+                else k++;
+            }
+            else if ((pass == 0) ? (a > b) : (a < b)) {jp += k; k = 1; p = jp - ip;}
+            else {ip = jp++; k = p = 1;}
+        }
+        if (pass == 0) {ms = ip; p0 = p;}
+    }
+    if (ip + 1 > ms + 1) ms = ip;
+    else p = p0;
+
+    // Periodic needles can remember how much of the needle already matched after a shift.
+    bool periodic;
+    if (Reverse)
+    {
+        for (k = 0; k < ms + 1 && s[k] == s[k + p]; ++k) {}
+        periodic = k == ms + 1;
+    }
+    else periodic = MSTRING_MEMCMP(ndl, ndl + p, ms + 1) == 0;
+    MSTRING_SIZE_T mem0, mem = 0;
+    if (!periodic)
+    {
+        mem0 = 0;
+        p = ((ms > m - ms - 1) ? ms : m - ms - 1) + 1;
+    }
+    else mem0 = m - p;
+
+    // pos is where the needle currently lines up with the haystack.
+    for (MSTRING_SIZE_T pos = 0;;)
+    {
+        if (n - pos < m) return MStringNotFound;
+
+        // Check the last byte first, and skip ahead based on where that byte appears in the needle.
+        unsigned char last = h[pos + m - 1];
+        if (byteset[last])
+        {
+            k = m - shift[last];
+            if (k)
+            {
+                if (k < mem) k = mem;
+                pos += k;
+                mem = 0;
+                continue;
+            }
+        }
+        else
+        {
+            pos += m;
+            mem = 0;
+            continue;
+        }
+
+        // Compare the right half, then the left half.
+        for (k = (ms + 1 > mem) ? ms + 1 : mem; k < m && s[k] == h[pos + k]; k++) {}
+        if (k < m)
+        {
+            pos += k - ms;
+            mem = 0;
+            continue;
+        }
+        for (k = ms + 1; k > mem && s[k - 1] == h[pos + k - 1]; k--) {}
+        if (k <= mem) return Reverse ? n - pos - m : pos;
+        pos += p;
+        mem = mem0;
+    }
+}
+
+#ifdef MSTRING_SSE2
+// Substring search with a SIMD filter: we compare the first and last bytes of the needle against
+// 16 or 32 haystack positions at once, and only memcmp() the positions where both match. Inputs like
+// "aaaa...a" would make nearly every position a candidate, so once verification has cost more than
+// a couple of bytes per byte scanned, we hand the rest of the haystack to Two-Way to stay linear.
+// Needle length must be at least 2, and the haystack can't be shorter than the needle.
+static MSTRING_SIZE_T MStringFindFallback(const char* h, MSTRING_SIZE_T n, const char* s, MSTRING_SIZE_T m, MSTRING_SIZE_T i)
+{
+    MSTRING_SIZE_T result = MStringTwoWay<false>(h + i, n - i, s, m);
+    return (result == MStringNotFound) ? result : i + result;
+}
+
+static MSTRING_SIZE_T MStringFindTail(const char* h, MSTRING_SIZE_T n, const char* s, MSTRING_SIZE_T m, MSTRING_SIZE_T i)
+{
+    // Fewer than one block of start positions are left, so checking each one is still linear.
+    for (; i + m <= n; ++i) if (h[i] == s[0] && MSTRING_MEMCMP(h + i + 1, s + 1, m - 1) == 0) return i;
+    return MStringNotFound;
+}
+
+static MSTRING_SIZE_T MStringFindSubstringSSE2(const char* h, MSTRING_SIZE_T n, const char* s, MSTRING_SIZE_T m)
+{
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i last = _mm_set1_epi8(s[m - 1]);
+    MSTRING_SIZE_T verified = 0, i = 0;
+    for (; i + m + 15 <= n; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(h + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(h + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        for (; mask; mask &= mask - 1)
+        {
+            MSTRING_SIZE_T pos = i + MStringLowestBit(mask);
+            if (MSTRING_MEMCMP(h + pos + 1, s + 1, m - 2) == 0) return pos;
+            verified += m;
+        }
+        if (verified > 2 * i + 256) return MStringFindFallback(h, n, s, m, i + 16);
+    }
+    return MStringFindTail(h, n, s, m, i);
+}
+
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringFindSubstringAVX2(const char* h, MSTRING_SIZE_T n, const char* s, MSTRING_SIZE_T m)
+{
+    const __m256i first = _mm256_set1_epi8(s[0]);
+    const __m256i last = _mm256_set1_epi8(s[m - 1]);
+    MSTRING_SIZE_T verified = 0, i = 0;
+    for (; i + m + 31 <= n; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(h + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(h + i + m - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        for (; mask; mask &= mask - 1)
+        {
+            MSTRING_SIZE_T pos = i + MStringLowestBit(mask);
+            if (MSTRING_MEMCMP(h + pos + 1, s + 1, m - 2) == 0) return pos;
+            verified += m;
+        }
+        if (verified > 2 * i + 256) return MStringFindFallback(h, n, s, m, i + 32);
+    }
+    return MStringFindTail(h, n, s, m, i);
+}
+#endif
+
+static MSTRING_SIZE_T MStringFindSubstring(const char* h, MSTRING_SIZE_T n, const char* s, MSTRING_SIZE_T m)
+{
+    if (m == 0) return 0;
+    if (m > n) return MStringNotFound;
+    if (m == 1) return MStringFindByte(h, n, s[0]);
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringFindSubstringAVX2(h, n, s, m) : MStringFindSubstringSSE2(h, n, s, m);
+#else
+    return MStringTwoWay<false>(h, n, s, m);
+#endif
+}
+
+MSTRING_SIZE_T IString::Find(char c, MSTRING_SIZE_T start) const
+{
+    if (start >= length) return MStringNotFound;
+    MSTRING_SIZE_T result = MStringFindByte(ptr + start, length - start, c);
+    return (result == MStringNotFound) ? result : start + result;
+}
+
+MSTRING_SIZE_T IString::Find(IString str, MSTRING_SIZE_T start) const
+{
+    if (start > length) return MStringNotFound;
+    MSTRING_SIZE_T result = MStringFindSubstring(ptr + start, length - start, str.Ptr(), str.Length());
+    return (result == MStringNotFound) ? result : start + result;
+}
+
+MSTRING_SIZE_T IString::RFind(char c) const {return MStringRFindByte(ptr, length, c);}
+
+MSTRING_SIZE_T IString::RFind(IString str) const
+{
+    MSTRING_SIZE_T m = str.Length();
+    if (m == 0) return length;
+    if (m > length) return MStringNotFound;
+
+    // Jump between occurrences of the needle's first byte, working backwards from the last place it
+    // could start. Like Find(), once verifying candidates has cost more than a couple of bytes per byte
+    // scanned, the rest goes to Two-Way (running backwards) to stay linear.
+    MSTRING_SIZE_T verified = 0, first_end = length - m + 1;
+    for (MSTRING_SIZE_T end = first_end; end > 0;)
+    {
+        if (verified > 2 * (first_end - end) + 256) return MStringTwoWay<true>(ptr, end + m - 1, str.Ptr(), m);
+        MSTRING_SIZE_T pos = MStringRFindByte(ptr, end, str[0]);
+        if (pos == MStringNotFound) break;
+        if (MSTRING_MEMCMP(ptr + pos + 1, str.Ptr() + 1, m - 1) == 0) return pos;
+        verified += m;
+        end = pos;
+    }
+    return MStringNotFound;
+}
+
+MSTRING_SIZE_T IString::FindAnyOf(IString set, MSTRING_SIZE_T start) const
+{
+    if (start >= length) return MStringNotFound;
+    MSTRING_SIZE_T result = MStringFindInSet(ptr + start, length - start, set, false);
+    return (result == MStringNotFound) ? result : start + result;
+}
+
+MSTRING_SIZE_T IString::FindNotOf(IString set, MSTRING_SIZE_T start) const
+{
+    if (start >= length) return MStringNotFound;
+    MSTRING_SIZE_T result = MStringFindInSet(ptr + start, length - start, set, true);
+    return (result == MStringNotFound) ? result : start + result;
+}
+
+MSTRING_SIZE_T IString::Count(char c) const {return MStringCountByte(ptr, length, c);}
+
+MSTRING_SIZE_T IString::Count(IString str) const
+{
+    if (str.Length() == 0) return 0;
+    if (str.Length() == 1) return Count(str[0]);
+    MSTRING_SIZE_T count = 0;
+    for (MSTRING_SIZE_T i = Find(str); i != MStringNotFound; i = Find(str, i + str.Length())) count++;
+    return count;
+}
+
+bool IString::StartsWith(IString str) const
+{
+    return str.Length() == 0 || (str.Length() <= length && MSTRING_MEMCMP(ptr, str.Ptr(), str.Length()) == 0);
+}
+
+bool IString::EndsWith(IString str) const
+{
+    return str.Length() == 0 || (str.Length() <= length && MSTRING_MEMCMP(ptr + length - str.Length(), str.Ptr(), str.Length()) == 0);
+}
+
+static bool MStringIsSpace(char c) {return c == ' ' || (c >= '\t' && c <= '\r');}
+
+IString IString::TrimLeft() const
+{
+    MSTRING_SIZE_T start = 0;
+    while (start < length && MStringIsSpace(ptr[start])) start++;
+    return IString(ptr + start, length - start);
+}
+
+IString IString::TrimRight() const
+{
+    MSTRING_SIZE_T end = length;
+    while (end > 0 && MStringIsSpace(ptr[end - 1])) end--;
+    return IString(ptr, end);
+}
+
+IString IString::Trim() const {return TrimLeft().TrimRight();}
+
+// UTF-8. Decoding follows the table of well-formed byte sequences in the Unicode standard (table 3-7).
+// Returns the length of the sequence, or minus the length of its maximal subpart if it's invalid.
+static int MStringUTF8Sequence(const unsigned char* p, const unsigned char* end, char32_t* codepoint)
+{
+    unsigned char c = p[0];
+    if (c < 0x80) {*codepoint = c; return 1;}
+
+    int size;
+    unsigned char low = 0x80, high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) size = 2, *codepoint = c & 0x1F;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        size = 3, *codepoint = c & 0x0F;
+        if (c == 0xE0) low = 0xA0;       // Overlong.
+        else if (c == 0xED) high = 0x9F; // Surrogates.
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        size = 4, *codepoint = c & 0x07;
+        if (c == 0xF0) low = 0x90;       // Overlong.
+        else if (c == 0xF4) high = 0x8F; // Past U+10FFFF.
+    }
+    else return -1;
+
+    for (int i = 1; i < size; ++i, low = 0x80, high = 0xBF)
+    {
+        if (p + i >= end || p[i] < low || p[i] > high) return -i;
+        *codepoint = (*codepoint << 6) | (p[i] & 0x3F);
+    }
+    return size;
+}
+
+static inline bool MStringIsASCII8(const unsigned char* p)
+{
+    unsigned long long word;
+    MSTRING_MEMCPY(&word, p, sizeof(word));
+    return (word & 0x8080808080808080ull) == 0;
+}
+
+static inline MSTRING_SIZE_T MStringUTF8Size(char32_t codepoint)
+{
+    if (codepoint < 0x80) return 1;
+    if (codepoint < 0x800) return 2;
+    return (codepoint < 0x10000 || codepoint > 0x10FFFF) ? 3 : 4;
+}
+
+MSTRING_SIZE_T MStringDecodeUTF8(const char* ptr, const char* end, char32_t* codepoint)
+{
+    if (ptr >= end) return 0;
+    int size = MStringUTF8Sequence((const unsigned char*)ptr, (const unsigned char*)end, codepoint);
+    if (size > 0) return (MSTRING_SIZE_T)size;
+    *codepoint = 0xFFFD;
+    return (MSTRING_SIZE_T)-size;
+}
+
+MSTRING_SIZE_T MStringEncodeUTF8(char32_t codepoint, char* dst)
+{
+    if (codepoint < 0x80)
+    {
+        dst[0] = (char)codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800)
+    {
+        dst[0] = (char)(0xC0 | (codepoint >> 6));
+        dst[1] = (char)(0x80 | (codepoint & 0x3F));
+        return 2;
+    }
+    if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) codepoint = 0xFFFD;
+    if (codepoint < 0x10000)
+    {
+        dst[0] = (char)(0xE0 | (codepoint >> 12));
+        dst[1] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        dst[2] = (char)(0x80 | (codepoint & 0x3F));
+        return 3;
+    }
+    dst[0] = (char)(0xF0 | (codepoint >> 18));
+    dst[1] = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+    dst[2] = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+    dst[3] = (char)(0x80 | (codepoint & 0x3F));
+    return 4;
+}
+
+static bool MStringValidateUTF8Scalar(const unsigned char* p, MSTRING_SIZE_T n)
+{
+    const unsigned char* end = p + n;
+    char32_t codepoint;
+    while (p < end)
+    {
+        if (end - p >= 8 && MStringIsASCII8(p)) p += 8;
+        else if (*p < 0x80) p++;
+        else
+        {
+            int size = MStringUTF8Sequence(p, end, &codepoint);
+            if (size < 0) return false;
+            p += size;
+        }
+    }
+    return true;
+}
+
+// Counts the bytes that start a codepoint, plus (for UTF-16) the ones that start a 4 byte sequence,
+// since those need a surrogate pair. The SIMD versions count with per-byte counters, and add them
+// up before they can overflow.
+static MSTRING_SIZE_T MStringCountUTF8Scalar(const char* p, MSTRING_SIZE_T n, bool utf16)
+{
+    MSTRING_SIZE_T count = 0;
+    for (MSTRING_SIZE_T i = 0; i < n; ++i) count += ((signed char)p[i] > -65) + (utf16 && (unsigned char)p[i] >= 0xF0);
+    return count;
+}
+
+#ifdef MSTRING_SSE2
+static MSTRING_SIZE_T MStringCountUTF8SSE2(const char* p, MSTRING_SIZE_T n, bool utf16)
+{
+    const __m128i continuation = _mm_set1_epi8(-65), four_byte = _mm_set1_epi8((char)0xF0);
+    MSTRING_SIZE_T count = 0, i = 0;
+    while (i + 16 <= n)
+    {
+        __m128i counters = _mm_setzero_si128();
+        for (int blocks = 0; blocks < 127 && i + 16 <= n; ++blocks, i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpgt_epi8(bytes, continuation));
+            if (utf16) counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_max_epu8(bytes, four_byte), bytes));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        count += (MSTRING_SIZE_T)(_mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+    }
+    return count + MStringCountUTF8Scalar(p + i, n - i, utf16);
+}
+
+MSTRING_TARGET_AVX2 static MSTRING_SIZE_T MStringCountUTF8AVX2(const char* p, MSTRING_SIZE_T n, bool utf16)
+{
+    const __m256i continuation = _mm256_set1_epi8(-65), four_byte = _mm256_set1_epi8((char)0xF0);
+    MSTRING_SIZE_T count = 0, i = 0;
+    while (i + 32 <= n)
+    {
+        __m256i counters = _mm256_setzero_si256();
+        for (int blocks = 0; blocks < 127 && i + 32 <= n; ++blocks, i += 32)
+        {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(p + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpgt_epi8(bytes, continuation));
+            if (utf16) counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, four_byte), bytes));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += (MSTRING_SIZE_T)(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+    }
+    return count + MStringCountUTF8SSE2(p + i, n - i, utf16);
+}
+
+// SIMD validation, using the lookup algorithm from simdjson/simdutf (John Keiser and Daniel Lemire,
+// "Validating UTF-8 In Less Than One Instruction Per Byte", 2021). Three table lookups on the high
+// and low nibbles of each byte and the high nibble of the byte before it flag every invalid two byte
+// pattern, and the only thing left to check is that the 3rd and 4th bytes of long sequences are
+// continuation bytes (and nothing else is). Blocks of pure ASCII only have to check that the block
+// before didn't end in the middle of a sequence. The last partial block is zero padded.
+enum
+{
+    MStringUTF8TooShort = 1 << 0,   // Lead byte followed by a lead byte or ASCII.
+    MStringUTF8TooLong = 1 << 1,    // ASCII followed by a continuation byte.
+    MStringUTF8Overlong3 = 1 << 2,  // 11100000 100xxxxx
+    MStringUTF8TooLarge = 1 << 3,   // 11110100 1001xxxx, or 11110101 and up.
+    MStringUTF8Surrogate = 1 << 4,  // 11101101 101xxxxx
+    MStringUTF8Overlong2 = 1 << 5,  // 1100000x 10xxxxxx
+    MStringUTF8TooLarge1000 = 1 << 6,
+    MStringUTF8Overlong4 = 1 << 6,  // 11110000 1000xxxx
+    MStringUTF8TwoConts = 1 << 7,   // Continuation byte followed by a continuation byte.
+    MStringUTF8Carry = MStringUTF8TooShort | MStringUTF8TooLong | MStringUTF8TwoConts,
+};
+
+#define MSTRING_UTF8_BYTE_1_HIGH \
+    MStringUTF8TooLong, MStringUTF8TooLong, MStringUTF8TooLong, MStringUTF8TooLong, \
+    MStringUTF8TooLong, MStringUTF8TooLong, MStringUTF8TooLong, MStringUTF8TooLong, \
+    MStringUTF8TwoConts, MStringUTF8TwoConts, MStringUTF8TwoConts, MStringUTF8TwoConts, \
+    MStringUTF8TooShort | MStringUTF8Overlong2, \
+    MStringUTF8TooShort, \
+    MStringUTF8TooShort | MStringUTF8Overlong3 | MStringUTF8Surrogate, \
+    MStringUTF8TooShort | MStringUTF8TooLarge | MStringUTF8TooLarge1000 | MStringUTF8Overlong4
+#define MSTRING_UTF8_BYTE_1_LOW \
+    MStringUTF8Carry | MStringUTF8Overlong3 | MStringUTF8Overlong2 | MStringUTF8Overlong4, \
+    MStringUTF8Carry | MStringUTF8Overlong2, \
+    MStringUTF8Carry, MStringUTF8Carry, \
+    MStringUTF8Carry | MStringUTF8TooLarge, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000 | MStringUTF8Surrogate, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000, \
+    MStringUTF8Carry | MStringUTF8TooLarge | MStringUTF8TooLarge1000
+#define MSTRING_UTF8_BYTE_2_HIGH \
+    MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort, \
+    MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort, \
+    MStringUTF8TooLong | MStringUTF8Overlong2 | MStringUTF8TwoConts | MStringUTF8Overlong3 | MStringUTF8TooLarge1000 | MStringUTF8Overlong4, \
+    MStringUTF8TooLong | MStringUTF8Overlong2 | MStringUTF8TwoConts | MStringUTF8Overlong3 | MStringUTF8TooLarge, \
+    MStringUTF8TooLong | MStringUTF8Overlong2 | MStringUTF8TwoConts | MStringUTF8Surrogate | MStringUTF8TooLarge, \
+    MStringUTF8TooLong | MStringUTF8Overlong2 | MStringUTF8TwoConts | MStringUTF8Surrogate | MStringUTF8TooLarge, \
+    MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort, MStringUTF8TooShort
+
+MSTRING_TARGET_SSSE3 static inline __m128i MStringUTF8ErrorsSSSE3(__m128i input, __m128i prev_input)
+{
+    const __m128i byte_1_high = _mm_setr_epi8(MSTRING_UTF8_BYTE_1_HIGH);
+    const __m128i byte_1_low = _mm_setr_epi8(MSTRING_UTF8_BYTE_1_LOW);
+    const __m128i byte_2_high = _mm_setr_epi8(MSTRING_UTF8_BYTE_2_HIGH);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i special = _mm_and_si128(_mm_and_si128(
+        _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+        _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    __m128i must_continue = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0x60)), _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+    return _mm_xor_si128(_mm_and_si128(must_continue, _mm_set1_epi8((char)0x80)), special);
+}
+
+MSTRING_TARGET_SSSE3 static bool MStringValidateUTF8SSSE3(const unsigned char* p, MSTRING_SIZE_T n)
+{
+    const __m128i incomplete_max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xEF, (char)0xDF, (char)0xBF);
+    __m128i error = _mm_setzero_si128(), prev_input = _mm_setzero_si128(), prev_incomplete = _mm_setzero_si128();
+    unsigned char tail[16] = {};
+    for (MSTRING_SIZE_T i = 0; i <= n; i += 16)
+    {
+        __m128i input;
+        if (i + 16 <= n) input = _mm_loadu_si128((const __m128i*)(p + i));
+        else
+        {
+            if (i < n) MSTRING_MEMCPY(tail, p + i, n - i);
+            input = _mm_loadu_si128((const __m128i*)tail);
+        }
+
+        if (_mm_movemask_epi8(input) == 0) error = _mm_or_si128(error, prev_incomplete);
+        else
+        {
+            error = _mm_or_si128(error, MStringUTF8ErrorsSSSE3(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, incomplete_max);
+        }
+        prev_input = input;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+MSTRING_TARGET_AVX2 static inline __m256i MStringUTF8ErrorsAVX2(__m256i input, __m256i prev_input)
+{
+    const __m256i byte_1_high = _mm256_setr_epi8(MSTRING_UTF8_BYTE_1_HIGH, MSTRING_UTF8_BYTE_1_HIGH);
+    const __m256i byte_1_low = _mm256_setr_epi8(MSTRING_UTF8_BYTE_1_LOW, MSTRING_UTF8_BYTE_1_LOW);
+    const __m256i byte_2_high = _mm256_setr_epi8(MSTRING_UTF8_BYTE_2_HIGH, MSTRING_UTF8_BYTE_2_HIGH);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    // alignr works within each 128 bit lane, so line up the bytes that come before each lane first.
+    __m256i before = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, before, 15);
+    __m256i special = _mm256_and_si256(_mm256_and_si256(
+        _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+        _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    __m256i prev2 = _mm256_alignr_epi8(input, before, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, before, 13);
+    __m256i must_continue = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)), _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+    return _mm256_xor_si256(_mm256_and_si256(must_continue, _mm256_set1_epi8((char)0x80)), special);
+}
+
+MSTRING_TARGET_AVX2 static bool MStringValidateUTF8AVX2(const unsigned char* p, MSTRING_SIZE_T n)
+{
+    const __m256i incomplete_max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)0xEF, (char)0xDF, (char)0xBF);
+    __m256i error = _mm256_setzero_si256(), prev_input = _mm256_setzero_si256(), prev_incomplete = _mm256_setzero_si256();
+    unsigned char tail[32] = {};
+    for (MSTRING_SIZE_T i = 0; i <= n; i += 32)
+    {
+        __m256i input;
+        if (i + 32 <= n) input = _mm256_loadu_si256((const __m256i*)(p + i));
+        else
+        {
+            if (i < n) MSTRING_MEMCPY(tail, p + i, n - i);
+            input = _mm256_loadu_si256((const __m256i*)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) error = _mm256_or_si256(error, prev_incomplete);
+        else
+        {
+            error = _mm256_or_si256(error, MStringUTF8ErrorsAVX2(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+        }
+        prev_input = input;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error) != 0;
+}
+#undef MSTRING_UTF8_BYTE_1_HIGH
+#undef MSTRING_UTF8_BYTE_1_LOW
+#undef MSTRING_UTF8_BYTE_2_HIGH
+#endif
+
+bool IString::IsValidUTF8() const
+{
+#ifdef MSTRING_SSE2
+    if (mstring_has_avx2) return MStringValidateUTF8AVX2((const unsigned char*)ptr, length);
+    if (mstring_has_ssse3) return MStringValidateUTF8SSSE3((const unsigned char*)ptr, length);
+#endif
+    return MStringValidateUTF8Scalar((const unsigned char*)ptr, length);
+}
+
+static MSTRING_SIZE_T MStringCountUTF8(const char* p, MSTRING_SIZE_T n, bool utf16)
+{
+#ifdef MSTRING_SSE2
+    return (mstring_has_avx2) ? MStringCountUTF8AVX2(p, n, utf16) : MStringCountUTF8SSE2(p, n, utf16);
+#else
+    return MStringCountUTF8Scalar(p, n, utf16);
+#endif
+}
+
+MSTRING_SIZE_T IString::CountCodepoints() const {return MStringCountUTF8(ptr, length, false);}
+MSTRING_SIZE_T IString::UTF16Length() const {return MStringCountUTF8(ptr, length, true);}
+
+// Every unit written comes from a byte that CountCodepoints() counts (or, for the second half of a
+// surrogate pair, one that UTF16Length() counts too), so these can't overrun even if they fail.
+MSTRING_SIZE_T IString::ToUTF16(char16_t* dst) const
+{
+    const unsigned char* p = (const unsigned char*)ptr;
+    const unsigned char* end = p + length;
+    char16_t* out = dst;
+    while (p < end)
+    {
+        if (end - p >= 8 && MStringIsASCII8(p))
+        {
+            for (int i = 0; i < 8; ++i) out[i] = p[i];
+            out += 8, p += 8;
+            continue;
+        }
+        if (*p < 0x80)
+        {
+            *out++ = *p++;
+            continue;
+        }
+        char32_t codepoint;
+        int size = MStringUTF8Sequence(p, end, &codepoint);
+        if (size < 0) return MStringNotFound;
+        if (codepoint >= 0x10000)
+        {
+            *out++ = (char16_t)(0xD800 + ((codepoint - 0x10000) >> 10));
+            *out++ = (char16_t)(0xDC00 + (codepoint & 0x3FF));
+        }
+        else *out++ = (char16_t)codepoint;
+        p += size;
+    }
+    return (MSTRING_SIZE_T)(out - dst);
+}
+
+MSTRING_SIZE_T IString::ToUTF32(char32_t* dst) const
+{
+    const unsigned char* p = (const unsigned char*)ptr;
+    const unsigned char* end = p + length;
+    char32_t* out = dst;
+    while (p < end)
+    {
+        if (end - p >= 8 && MStringIsASCII8(p))
+        {
+            for (int i = 0; i < 8; ++i) out[i] = p[i];
+            out += 8, p += 8;
+            continue;
+        }
+        if (*p < 0x80)
+        {
+            *out++ = *p++;
+            continue;
+        }
+        char32_t codepoint;
+        int size = MStringUTF8Sequence(p, end, &codepoint);
+        if (size < 0) return MStringNotFound;
+        *out++ = codepoint;
+        p += size;
+    }
+    return (MSTRING_SIZE_T)(out - dst);
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendCodepoint(char32_t codepoint)
+{
+    char buffer[4];
+    return Append(buffer, MStringEncodeUTF8(codepoint, buffer));
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendUTF16(const char16_t* str, MSTRING_SIZE_T len)
+{
+    MSTRING_SIZE_T size = 0;
+    for (MSTRING_SIZE_T i = 0; i < len; ++i)
+    {
+        bool pair = str[i] >= 0xD800 && str[i] <= 0xDBFF && i + 1 < len && str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF;
+        size += (pair) ? 4 : MStringUTF8Size(str[i]);
+        i += pair;
+    }
+
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + size);
+    char* dst = Ptr() + old_length;
+    for (MSTRING_SIZE_T i = 0; i < len; ++i)
+    {
+        char32_t codepoint = str[i];
+        if (codepoint >= 0xD800 && codepoint <= 0xDBFF && i + 1 < len && str[i + 1] >= 0xDC00 && str[i + 1] <= 0xDFFF)
+        {
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (str[++i] - 0xDC00);
+        }
+        dst += MStringEncodeUTF8(codepoint, dst);
+    }
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendUTF32(const char32_t* str, MSTRING_SIZE_T len)
+{
+    MSTRING_SIZE_T size = 0;
+    for (MSTRING_SIZE_T i = 0; i < len; ++i) size += MStringUTF8Size(str[i]);
+
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + size);
+    char* dst = Ptr() + old_length;
+    for (MSTRING_SIZE_T i = 0; i < len; ++i) dst += MStringEncodeUTF8(str[i], dst);
+    return *this;
+}
+
+MStringSplit IString::Split(char delimiter) const {return MStringSplit(*this, delimiter);}
+MStringSplit IString::Lines() const {return MStringSplit(*this, '\n', true);}
+
+bool MStringSplit::Next(IString* piece)
+{
+    if (rest.Length() == 0) return false;
+    MSTRING_SIZE_T index = MStringFindByte(rest.Ptr(), rest.Length(), delimiter);
+    if (index == MStringNotFound)
+    {
+        *piece = rest;
+        rest = IString(rest.Ptr() + rest.Length(), 0);
+    }
+    else
+    {
+        *piece = IString(rest.Ptr(), index);
+        rest = IString(rest.Ptr() + index + 1, rest.Length() - index - 1);
+    }
+    if (lines && piece->Length() && (*piece)[piece->Length() - 1] == '\r') *piece = IString(piece->Ptr(), piece->Length() - 1);
+    return true;
+}
+
+template <int InlineBytes>
+bool BasicMString<InlineBytes>::HasCachedHash() const
+{
+    return CachesHash && IsHeap() && MStringLoadByte(&data.heap.unused[HashMarker], true);
+}
+
+template <int InlineBytes>
+unsigned int BasicMString<InlineBytes>::Hash() const
+{
+    // Racing threads all write the same bytes, and the marker is stored last, with release semantics,
+    // so that anyone who sees it also sees the hash.
+    unsigned char bytes[sizeof(unsigned int)];
+    unsigned int hash;
+    if (HasCachedHash())
+    {
+        for (size_t i = 0; i < sizeof(bytes); ++i) bytes[i] = (unsigned char)MStringLoadByte(&data.heap.unused[i], false);
+        MSTRING_MEMCPY(&hash, bytes, sizeof(hash));
+        return hash;
+    }
+
+    hash = MStringHash(Ptr(), length);
+    if (CachesHash && IsHeap())
+    {
+        MSTRING_MEMCPY(bytes, &hash, sizeof(hash));
+        for (size_t i = 0; i < sizeof(bytes); ++i) MStringStoreByte(&data.heap.unused[i], (char)bytes[i], false);
+        MStringStoreByte(&data.heap.unused[HashMarker], 1, true);
+    }
+    return hash;
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::SetLength(MSTRING_SIZE_T len)
+{
+    MSTRING_ASSERT(len >= 0);
+    if (len == length) return;
+
+    ExpandIfNeeded(len);
+    Ptr()[len] = '\0';
+    length = len;
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::ExpandIfNeeded(MSTRING_SIZE_T required_capacity)
+{
+    if (Capacity() >= required_capacity) return;
+    MSTRING_STAT(expansions, 1);
+    // We'll double in size, or if that isn't enough we will just allocate exactly the required number of bytes.
+    Reserve((Capacity() * 2 > required_capacity) ? Capacity() * 2 : required_capacity);
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::Reserve(MSTRING_SIZE_T capacity)
+{
+    if (Capacity() >= capacity) return;
+    // If we are already on the heap, just reallocate.
+    if (IsHeap()) ReallocateBuffer(capacity);
+    else // Otherwise if we need to move to the heap for the first time, allocate and copy.
+    {
+        MSTRING_STAT(heap_placements, 1);
+        char flags = 0;
+        char* new_ptr = AllocateBuffer(&capacity, &flags, MStringAllocator::Current());
+        if (length) MSTRING_MEMCPY(new_ptr, data.stack, length + 1);
+        data.heap.ptr = new_ptr;
+        data.heap.flags = flags;
+        InvalidateHash(); // The padding still has our old characters in it.
+        SetHeapCapacity(capacity);
+    }
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::ShrinkToFit()
+{
+    if (!IsHeap()) return; // If we aren't on the heap, there is nothing to shrink!
+    MSTRING_SIZE_T fitted = (Allocator()) ? length : MStringRoundCapacity(length, HeaderSize());
+    if (length > MaxShortLength && fitted == data.heap.Capacity()) return;
+    MSTRING_STAT(shrinks, 1);
+    MSTRING_STAT(shrink_bytes_saved, (length <= MaxShortLength) ? HeaderSize() + data.heap.Capacity() + 1 : data.heap.Capacity() - fitted);
+
+    if (length <= MaxShortLength) // Move back onto the stack if we are small enough.
+    {
+        char stack[MaxShortLength + 1] = {};
+        MSTRING_MEMCPY(stack, data.heap.ptr, length + 1);
+        FreeBuffer();
+        MSTRING_MEMCPY(data.stack, stack, MaxShortLength + 1);
+    }
+    else ReallocateBuffer(length);
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T len)
+{
+    MSTRING_ASSERT(str && index <= length && len >= 0);
+    if (len <= 0 || index < 0 || !str) return *this;
+
+    // The source might be part of this string, in which case it can move when we expand.
+    MSTRING_SIZE_T old_length = length;
+    const char* old_ptr = ((const BasicMString*)this)->Ptr();
+    bool aliased = (str >= old_ptr && str < old_ptr + old_length);
+    MSTRING_SIZE_T offset = (MSTRING_SIZE_T)(str - old_ptr);
+
+    SetLength(old_length + len);
+    char* ptr = Ptr();
+    if (index < old_length) MSTRING_MEMMOVE(ptr + index + len, ptr + index, old_length - index);
+    if (!aliased) MSTRING_MEMCPY(ptr + index, str, len);
+    else
+    {
+        // Source bytes before the insertion point stayed put, the ones after it got shifted by len.
+        MSTRING_SIZE_T before = (offset >= index) ? 0 : (index - offset < len) ? index - offset : len;
+        MSTRING_MEMMOVE(ptr + index, ptr + offset, before);
+        MSTRING_MEMMOVE(ptr + index + before, ptr + offset + before + len, len - before);
+    }
+    return *this;
+}
+
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Remove(MSTRING_SIZE_T index, MSTRING_SIZE_T count)
+{
+    MSTRING_SIZE_T shift_index = index + count; // Start index of the bytes we need to shift forwards.
+    MSTRING_ASSERT(index >= 0 && count >= 0 && shift_index <= length);
+    if (count <= 0 || index < 0 || index >= length) return *this;
+
+    if (shift_index < length) MSTRING_MEMMOVE(Ptr() + index, Ptr() + shift_index, length - shift_index);
+    else if (shift_index > length) count = length - index;
+    SetLength(length - count);
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::ToLower()
+{
+    if (length) MStringChangeCase(Ptr(), length, 'A');
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::ToUpper()
+{
+    if (length) MStringChangeCase(Ptr(), length, 'a');
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::TrimLeft()
+{
+    IString self = *this;
+    return Remove(0, length - self.TrimLeft().Length());
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::TrimRight()
+{
+    IString self = *this;
+    SetLength(self.TrimRight().Length());
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::Trim()
+{
+    TrimRight();
+    return TrimLeft();
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::ReplaceAll(IString from, IString to)
+{
+    // An empty needle doesn't match anything, so Count() takes care of that too.
+    const char* old_ptr = ((const BasicMString*)this)->Ptr();
+    IString source(old_ptr, length);
+    MSTRING_SIZE_T count = source.Count(from);
+    if (count == 0) return *this;
+    MSTRING_SIZE_T m = from.Length(), new_length = length - count * m + count * to.Length();
+
+    // Either piece might be part of this string, like in Insert().
+    const char* old_end = old_ptr + Capacity() + 1;
+    bool aliased = (from.Ptr() < old_end && from.Ptr() + m > old_ptr) || (to.Length() && to.Ptr() < old_end && to.Ptr() + to.Length() > old_ptr);
+
+    // Replacements that aren't longer than the match can be written over the string as we go, since
+    // the output never catches up with the part that we still have to search.
+    if (to.Length() <= m && !aliased && !IsShared())
+    {
+        char* ptr = Ptr();
+        MSTRING_SIZE_T read = 0, write = 0;
+        for (MSTRING_SIZE_T match = source.Find(from); match != MStringNotFound; match = source.Find(from, read))
+        {
+            MSTRING_MEMMOVE(ptr + write, ptr + read, match - read);
+            write += match - read;
+            if (to.Length()) MSTRING_MEMCPY(ptr + write, to.Ptr(), to.Length());
+            write += to.Length();
+            read = match + m;
+        }
+        MSTRING_MEMMOVE(ptr + write, ptr + read, length - read);
+        SetLength(new_length);
+        return *this;
+    }
+
+    // Otherwise we build the result in a new buffer of the final size, from the same allocator, and
+    // only let go of the old one at the end.
+    char stack[MaxShortLength + 1] = {};
+    char* out = stack;
+    char flags = 0;
+    MSTRING_SIZE_T capacity = new_length;
+    if (new_length > MaxShortLength)
+    {
+        if (!IsHeap()) MSTRING_STAT(heap_placements, 1);
+        out = AllocateBuffer(&capacity, &flags, IsHeap() ? Allocator() : MStringAllocator::Current());
+    }
+    MSTRING_SIZE_T read = 0, write = 0;
+    for (MSTRING_SIZE_T match = source.Find(from); match != MStringNotFound; match = source.Find(from, read))
+    {
+        MSTRING_MEMCPY(out + write, old_ptr + read, match - read);
+        write += match - read;
+        if (to.Length()) MSTRING_MEMCPY(out + write, to.Ptr(), to.Length());
+        write += to.Length();
+        read = match + m;
+    }
+    MSTRING_MEMCPY(out + write, old_ptr + read, length - read);
+    out[new_length] = '\0';
+
+    if (IsHeap()) FreeBuffer();
+    data = {};
+    if (out == stack) MSTRING_MEMCPY(data.stack, stack, MaxShortLength + 1);
+    else
+    {
+        data.heap.ptr = out;
+        data.heap.flags = flags;
+        SetHeapCapacity(capacity);
+    }
+    length = new_length;
+    return *this;
+}
+
+// Number formatting. Integers are written two digits at a time from a table of digit pairs, straight
+// into the end of the string, which has already been grown to the exact size.
+static const char mstring_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static int MStringDecimalDigitCount(unsigned long long value)
+{
+    int count = 1;
+    for (;;)
+    {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000;
+        count += 4;
+    }
+}
+
+// Writes the digits of value so that they end right before end.
+static void MStringWriteDecimal(char* end, unsigned long long value)
+{
+    while (value >= 100)
+    {
+        unsigned int pair = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--end = mstring_digit_pairs[pair + 1];
+        *--end = mstring_digit_pairs[pair];
+    }
+    if (value >= 10)
+    {
+        *--end = mstring_digit_pairs[value * 2 + 1];
+        *--end = mstring_digit_pairs[value * 2];
+    }
+    else *--end = (char)('0' + value);
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendUInt(unsigned long long value)
+{
+    MSTRING_SIZE_T count = (MSTRING_SIZE_T)MStringDecimalDigitCount(value);
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + count);
+    MStringWriteDecimal(Ptr() + old_length + count, value);
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendInt(long long value)
+{
+    // Negating after the conversion to unsigned also works for the most negative value.
+    unsigned long long magnitude = (value < 0) ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    MSTRING_SIZE_T count = (MSTRING_SIZE_T)MStringDecimalDigitCount(magnitude) + (value < 0);
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + count);
+    char* dst = Ptr() + old_length;
+    if (value < 0) *dst = '-';
+    MStringWriteDecimal(dst + count, magnitude);
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendHex(unsigned long long value, int min_digits)
+{
+    int count = 1;
+    while (count < 16 && (value >> (count * 4))) ++count;
+    if (count < min_digits) count = min_digits;
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + (MSTRING_SIZE_T)count);
+    char* dst = Ptr() + old_length + count;
+    for (int i = 0; i < count; ++i, value >>= 4) *--dst = "0123456789abcdef"[value & 15];
+    return *this;
+}
+
+// Shortest double formatting, using Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly
+// and Accurately with Integers", 2010). Its output always reads back as the same double, and it is the
+// shortest possible output for about 99.9% of doubles. For the rest it is one digit longer than it
+// needs to be. Ryu and friends are always shortest, but they need about 10KB of tables, and Grisu2
+// only needs 79 cached powers of ten.
+struct MStringDiyFp
+{
+    unsigned long long f;
+    int e;
+};
+
+static MStringDiyFp MStringDiyFpNormalize(MStringDiyFp x)
+{
+    while (!(x.f >> 63))
+    {
+        x.f <<= 1;
+        --x.e;
+    }
+    return x;
+}
+
+// The upper 64 bits of the 128-bit product, rounded.
+static MStringDiyFp MStringDiyFpMultiply(MStringDiyFp x, MStringDiyFp y)
+{
+    unsigned long long x_lo = x.f & 0xffffffffu, x_hi = x.f >> 32;
+    unsigned long long y_lo = y.f & 0xffffffffu, y_hi = y.f >> 32;
+    unsigned long long lo_lo = x_lo * y_lo, lo_hi = x_lo * y_hi, hi_lo = x_hi * y_lo, hi_hi = x_hi * y_hi;
+    unsigned long long middle = (lo_lo >> 32) + (lo_hi & 0xffffffffu) + (hi_lo & 0xffffffffu) + (1ull << 31);
+    return {hi_hi + (lo_hi >> 32) + (hi_lo >> 32) + (middle >> 32), x.e + y.e + 64};
+}
+
+// Normalized approximations of 10^k, for k = -300, -292, ..., 324. 10^k ~= f * 2^e.
+struct MStringCachedPower
+{
+    unsigned long long f;
+    int e;
+    int k;
+};
+
+static const MStringCachedPower mstring_cached_powers[] =
+{
+    {0xAB70FE17C79AC6CAULL, -1060, -300},
+    {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+    {0xBE5691EF416BD60CULL, -1007, -284},
+    {0x8DD01FAD907FFC3CULL,  -980, -276},
+    {0xD3515C2831559A83ULL,  -954, -268},
+    {0x9D71AC8FADA6C9B5ULL,  -927, -260},
+    {0xEA9C227723EE8BCBULL,  -901, -252},
+    {0xAECC49914078536DULL,  -874, -244},
+    {0x823C12795DB6CE57ULL,  -847, -236},
+    {0xC21094364DFB5637ULL,  -821, -228},
+    {0x9096EA6F3848984FULL,  -794, -220},
+    {0xD77485CB25823AC7ULL,  -768, -212},
+    {0xA086CFCD97BF97F4ULL,  -741, -204},
+    {0xEF340A98172AACE5ULL,  -715, -196},
+    {0xB23867FB2A35B28EULL,  -688, -188},
+    {0x84C8D4DFD2C63F3BULL,  -661, -180},
+    {0xC5DD44271AD3CDBAULL,  -635, -172},
+    {0x936B9FCEBB25C996ULL,  -608, -164},
+    {0xDBAC6C247D62A584ULL,  -582, -156},
+    {0xA3AB66580D5FDAF6ULL,  -555, -148},
+    {0xF3E2F893DEC3F126ULL,  -529, -140},
+    {0xB5B5ADA8AAFF80B8ULL,  -502, -132},
+    {0x87625F056C7C4A8BULL,  -475, -124},
+    {0xC9BCFF6034C13053ULL,  -449, -116},
+    {0x964E858C91BA2655ULL,  -422, -108},
+    {0xDFF9772470297EBDULL,  -396, -100},
+    {0xA6DFBD9FB8E5B88FULL,  -369,  -92},
+    {0xF8A95FCF88747D94ULL,  -343,  -84},
+    {0xB94470938FA89BCFULL,  -316,  -76},
+    {0x8A08F0F8BF0F156BULL,  -289,  -68},
+    {0xCDB02555653131B6ULL,  -263,  -60},
+    {0x993FE2C6D07B7FACULL,  -236,  -52},
+    {0xE45C10C42A2B3B06ULL,  -210,  -44},
+    {0xAA242499697392D3ULL,  -183,  -36},
+    {0xFD87B5F28300CA0EULL,  -157,  -28},
+    {0xBCE5086492111AEBULL,  -130,  -20},
+    {0x8CBCCC096F5088CCULL,  -103,  -12},
+    {0xD1B71758E219652CULL,   -77,   -4},
+    {0x9C40000000000000ULL,   -50,    4},
+    {0xE8D4A51000000000ULL,   -24,   12},
+    {0xAD78EBC5AC620000ULL,     3,   20},
+    {0x813F3978F8940984ULL,    30,   28},
+    {0xC097CE7BC90715B3ULL,    56,   36},
+    {0x8F7E32CE7BEA5C70ULL,    83,   44},
+    {0xD5D238A4ABE98068ULL,   109,   52},
+    {0x9F4F2726179A2245ULL,   136,   60},
+    {0xED63A231D4C4FB27ULL,   162,   68},
+    {0xB0DE65388CC8ADA8ULL,   189,   76},
+    {0x83C7088E1AAB65DBULL,   216,   84},
+    {0xC45D1DF942711D9AULL,   242,   92},
+    {0x924D692CA61BE758ULL,   269,  100},
+    {0xDA01EE641A708DEAULL,   295,  108},
+    {0xA26DA3999AEF774AULL,   322,  116},
+    {0xF209787BB47D6B85ULL,   348,  124},
+    {0xB454E4A179DD1877ULL,   375,  132},
+    {0x865B86925B9BC5C2ULL,   402,  140},
+    {0xC83553C5C8965D3DULL,   428,  148},
+    {0x952AB45CFA97A0B3ULL,   455,  156},
+    {0xDE469FBD99A05FE3ULL,   481,  164},
+    {0xA59BC234DB398C25ULL,   508,  172},
+    {0xF6C69A72A3989F5CULL,   534,  180},
+    {0xB7DCBF5354E9BECEULL,   561,  188},
+    {0x88FCF317F22241E2ULL,   588,  196},
+    {0xCC20CE9BD35C78A5ULL,   614,  204},
+    {0x98165AF37B2153DFULL,   641,  212},
+    {0xE2A0B5DC971F303AULL,   667,  220},
+    {0xA8D9D1535CE3B396ULL,   694,  228},
+    {0xFB9B7CD9A4A7443CULL,   720,  236},
+    {0xBB764C4CA7A44410ULL,   747,  244},
+    {0x8BAB8EEFB6409C1AULL,   774,  252},
+    {0xD01FEF10A657842CULL,   800,  260},
+    {0x9B10A4E5E9913129ULL,   827,  268},
+    {0xE7109BFBA19C0C9DULL,   853,  276},
+    {0xAC2820D9623BF429ULL,   880,  284},
+    {0x80444B5E7AA7CF85ULL,   907,  292},
+    {0xBF21E44003ACDD2DULL,   933,  300},
+    {0x8E679C2F5E44FF8FULL,   960,  308},
+    {0xD433179D9C8CB841ULL,   986,  316},
+    {0x9E19DB92B4E31BA9ULL,  1013,  324},
+};
+
+// Moves the last digit down for as long as that gets closer to the exact value, without leaving the
+// interval of numbers that round to it.
+static void MStringGrisuRound(char* digits, int count, unsigned long long dist, unsigned long long delta,
+                              unsigned long long rest, unsigned long long ten_k)
+{
+    while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist))
+    {
+        --digits[count - 1];
+        rest += ten_k;
+    }
+}
+
+// Writes the shortest digits of a finite, nonzero double (ignoring its sign) and returns how many
+// there are. The value is digits * 10^exponent.
+static int MStringGrisu2(double value, char* digits, int* exponent)
+{
+    unsigned long long bits;
+    MSTRING_MEMCPY(&bits, &value, sizeof(bits));
+    unsigned long long fraction = bits & ((1ull << 52) - 1);
+    int biased_exponent = (int)((bits >> 52) & 0x7ff);
+    MStringDiyFp v = (biased_exponent == 0) ? MStringDiyFp{fraction, 1 - 1075} : MStringDiyFp{fraction + (1ull << 52), biased_exponent - 1075};
+
+    // Boundaries halfway to the neighboring doubles. At a power of two, the one below is closer.
+    bool lower_is_closer = (fraction == 0 && biased_exponent > 1);
+    MStringDiyFp plus = MStringDiyFpNormalize({2 * v.f + 1, v.e - 1});
+    MStringDiyFp minus = (lower_is_closer) ? MStringDiyFp{4 * v.f - 1, v.e - 2} : MStringDiyFp{2 * v.f - 1, v.e - 1};
+    minus = {minus.f << (minus.e - plus.e), plus.e};
+    v = MStringDiyFpNormalize(v);
+
+    // Scale everything by a cached power of ten, so that the upper boundary's exponent ends up in
+    // [-60, -32]. Then its integer part fits in 32 bits, and its fraction has room for a digit.
+    int target = -60 - plus.e - 1;
+    int k = (target * 78913) / (1 << 18) + (target > 0);
+    const MStringCachedPower& cached = mstring_cached_powers[(300 + k + 7) / 8];
+    MStringDiyFp power = {cached.f, cached.e};
+    MStringDiyFp w = MStringDiyFpMultiply(v, power);
+    MStringDiyFp w_minus = MStringDiyFpMultiply(minus, power);
+    MStringDiyFp w_plus = MStringDiyFpMultiply(plus, power);
+    w_minus.f += 1; // The products can be off by one, so shrink the interval to be safe.
+    w_plus.f -= 1;
+    *exponent = -cached.k;
+
+    // Generate digits of the upper boundary until we are inside the interval. Integer part first...
+    unsigned long long delta = w_plus.f - w_minus.f;
+    unsigned long long dist = w_plus.f - w.f;
+    int shift = -w_plus.e;
+    unsigned long long one = 1ull << shift;
+    unsigned int integer = (unsigned int)(w_plus.f >> shift);
+    unsigned long long fractional = w_plus.f & (one - 1);
+
+    int remaining = 1;
+    unsigned int power10 = 1;
+    while (remaining < 10 && integer / power10 >= 10)
+    {
+        power10 *= 10;
+        ++remaining;
+    }
+
+    int count = 0;
+    while (remaining > 0)
+    {
+        digits[count++] = (char)('0' + integer / power10);
+        integer %= power10;
+        --remaining;
+        unsigned long long rest = ((unsigned long long)integer << shift) + fractional;
+        if (rest <= delta)
+        {
+            *exponent += remaining;
+            MStringGrisuRound(digits, count, dist, delta, rest, (unsigned long long)power10 << shift);
+            return count;
+        }
+        power10 /= 10;
+    }
+
+    // ...then the fraction.
+    for (;;)
+    {
+        fractional *= 10;
+        delta *= 10;
+        dist *= 10;
+        digits[count++] = (char)('0' + (fractional >> shift));
+        fractional &= one - 1;
+        --*exponent;
+        if (fractional <= delta) break;
+    }
+    MStringGrisuRound(digits, count, dist, delta, fractional, one);
+    return count;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::AppendDouble(double value)
+{
+    unsigned long long bits;
+    MSTRING_MEMCPY(&bits, &value, sizeof(bits));
+    bool negative = (bits >> 63) != 0;
+    if (((bits >> 52) & 0x7ff) == 0x7ff)
+    {
+        if (bits & ((1ull << 52) - 1)) return Append("nan", 3);
+        return (negative) ? Append("-inf", 4) : Append("inf", 3);
+    }
+
+    char digits[24];
+    int count = 1, exponent = 0;
+    if ((bits << 1) == 0) digits[0] = '0';
+    else count = MStringGrisu2(value, digits, &exponent);
+
+    // Same layout as JavaScript. Point is where the decimal point goes, relative to the first digit.
+    int point = count + exponent;
+    int scientific_exponent = (point - 1 < 0) ? 1 - point : point - 1;
+    MSTRING_SIZE_T size = negative;
+    if (count <= point && point <= 21) size += point;                      // 1234000
+    else if (0 < point && point <= 21) size += count + 1;                  // 123.4
+    else if (-6 < point && point <= 0) size += 2 - point + count;          // 0.001234
+    else size += count + (count > 1) + 2 + MStringDecimalDigitCount((unsigned long long)scientific_exponent); // 1.234e+56
+
+    MSTRING_SIZE_T old_length = length;
+    SetLength(old_length + size);
+    char* dst = Ptr() + old_length;
+    if (negative) *dst++ = '-';
+    if (count <= point && point <= 21)
+    {
+        MSTRING_MEMCPY(dst, digits, count);
+        for (int i = count; i < point; ++i) dst[i] = '0';
+    }
+    else if (0 < point && point <= 21)
+    {
+        MSTRING_MEMCPY(dst, digits, point);
+        dst[point] = '.';
+        MSTRING_MEMCPY(dst + point + 1, digits + point, count - point);
+    }
+    else if (-6 < point && point <= 0)
+    {
+        dst[0] = '0';
+        dst[1] = '.';
+        for (int i = 0; i < -point; ++i) dst[2 + i] = '0';
+        MSTRING_MEMCPY(dst + 2 - point, digits, count);
+    }
+    else
+    {
+        *dst++ = digits[0];
+        if (count > 1)
+        {
+            *dst++ = '.';
+            MSTRING_MEMCPY(dst, digits + 1, count - 1);
+            dst += count - 1;
+        }
+        *dst++ = 'e';
+        *dst++ = (point - 1 < 0) ? '-' : '+';
+        MStringWriteDecimal(dst + MStringDecimalDigitCount((unsigned long long)scientific_exponent), (unsigned long long)scientific_exponent);
+    }
+    return *this;
+}
+
+// Number parsing.
+static bool MStringIsDigit(char c) {return (unsigned char)(c - '0') < 10;}
+
+// Parses decimal digits, failing if there aren't any or if the result would be bigger than limit.
+static MSTRING_SIZE_T MStringParseDigits(const char* ptr, MSTRING_SIZE_T length, unsigned long long limit, unsigned long long* value)
+{
+    unsigned long long result = 0;
+    MSTRING_SIZE_T i = 0;
+    for (; i < length && MStringIsDigit(ptr[i]); ++i)
+    {
+        unsigned int digit = (unsigned int)(ptr[i] - '0');
+        if (result > (limit - digit) / 10) return 0;
+        result = result * 10 + digit;
+    }
+    if (i > 0) *value = result;
+    return i;
+}
+
+MSTRING_SIZE_T IString::ParseUInt(unsigned long long* value) const
+{
+    MSTRING_SIZE_T sign = (length > 0 && ptr[0] == '+') ? 1 : 0;
+    MSTRING_SIZE_T count = MStringParseDigits(ptr + sign, length - sign, ~0ull, value);
+    return (count) ? sign + count : 0;
+}
+
+MSTRING_SIZE_T IString::ParseInt(long long* value) const
+{
+    bool negative = (length > 0 && ptr[0] == '-');
+    MSTRING_SIZE_T sign = (length > 0 && (ptr[0] == '-' || ptr[0] == '+')) ? 1 : 0;
+    unsigned long long limit = (negative) ? (1ull << 63) : (1ull << 63) - 1, magnitude = 0;
+    MSTRING_SIZE_T count = MStringParseDigits(ptr + sign, length - sign, limit, &magnitude);
+    if (!count) return 0;
+    *value = (negative) ? (long long)(0ull - magnitude) : (long long)magnitude;
+    return sign + count;
+}
+
+// Every power of ten that a double can represent exactly.
+static const double mstring_exact_powers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Correct rounding never needs more significant digits than this (the longest exact halfway point
+// between two doubles has 767), as long as we remember whether anything nonzero came after them.
+constexpr static int MStringMaxParsedDigits = 780;
+
+MSTRING_SIZE_T IString::ParseDouble(double* value) const
+{
+    MSTRING_SIZE_T i = 0;
+    bool negative = false;
+    if (i < length && (ptr[i] == '-' || ptr[i] == '+')) negative = (ptr[i++] == '-');
+    unsigned long long sign_bit = (negative) ? 1ull << 63 : 0;
+
+    auto matches = [this, i](const char* word, MSTRING_SIZE_T word_length)
+    {
+        if (length - i < word_length) return false;
+        for (MSTRING_SIZE_T j = 0; j < word_length; ++j) if ((ptr[i + j] | 0x20) != word[j]) return false;
+        return true;
+    };
+    if (i < length && !MStringIsDigit(ptr[i]) && ptr[i] != '.')
+    {
+        unsigned long long bits = sign_bit | 0x7ff0000000000000ull;
+        MSTRING_SIZE_T word_length = (matches("infinity", 8)) ? 8 : (matches("inf", 3)) ? 3 : 0;
+        if (!word_length && matches("nan", 3))
+        {
+            bits = 0x7ff8000000000000ull;
+            word_length = 3;
+        }
+        if (!word_length) return 0;
+        MSTRING_MEMCPY(value, &bits, sizeof(bits));
+        return i + word_length;
+    }
+
+    // The value is the significant digits (leading zeros don't count) times 10^exponent. The first 19
+    // digits also get accumulated into an integer for the fast path. The rest of text is for strtod.
+    char text[MStringMaxParsedDigits + 32];
+    int digit_count = 0;
+    bool dropped_nonzero = false;
+    unsigned long long mantissa = 0;
+    long long exponent = 0;
+    bool any_digits = false;
+    bool fraction = false;
+    for (; i < length; ++i)
+    {
+        char c = ptr[i];
+        if (c == '.' && !fraction)
+        {
+            fraction = true;
+            continue;
+        }
+        if (!MStringIsDigit(c)) break;
+        any_digits = true;
+        if (fraction) --exponent;
+        if (digit_count == 0 && c == '0') continue;
+        if (digit_count < 19) mantissa = mantissa * 10 + (unsigned long long)(c - '0');
+        if (digit_count < MStringMaxParsedDigits) text[digit_count++] = c;
+        else
+        {
+            dropped_nonzero |= (c != '0');
+            ++exponent;
+        }
+    }
+    if (!any_digits) return 0;
+
+    // An exponent only counts if it has digits. Otherwise the 'e' isn't part of the number.
+    if (i < length && (ptr[i] | 0x20) == 'e')
+    {
+        MSTRING_SIZE_T j = i + 1;
+        bool exponent_negative = false;
+        if (j < length && (ptr[j] == '-' || ptr[j] == '+')) exponent_negative = (ptr[j++] == '-');
+        if (j < length && MStringIsDigit(ptr[j]))
+        {
+            long long explicit_exponent = 0;
+            for (; j < length && MStringIsDigit(ptr[j]); ++j)
+            {
+                if (explicit_exponent < 1000000) explicit_exponent = explicit_exponent * 10 + (ptr[j] - '0');
+            }
+            exponent += (exponent_negative) ? -explicit_exponent : explicit_exponent;
+            i = j;
+        }
+    }
+
+    double result;
+    if (digit_count == 0) result = 0.0;
+    else if (digit_count <= 19 && !dropped_nonzero && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+    {
+        // The mantissa and the power of ten are both exact, so a single operation rounds correctly.
+        result = (double)mantissa;
+        result = (exponent < 0) ? result / mstring_exact_powers_of_ten[-exponent] : result * mstring_exact_powers_of_ten[exponent];
+    }
+    else
+    {
+        // Leave the hard cases to strtod. We give it an integer and an exponent, so that the locale's
+        // decimal point doesn't matter. Anything nonzero that we dropped turns into a trailing 1, which
+        // is enough to break ties the right way. Exponents this big give 0 or inf either way.
+        int text_length = digit_count;
+        if (dropped_nonzero)
+        {
+            text[text_length++] = '1';
+            --exponent;
+        }
+        if (exponent < -99999) exponent = -99999;
+        if (exponent > 99999) exponent = 99999;
+        text[text_length++] = 'e';
+        if (exponent < 0) text[text_length++] = '-';
+        unsigned long long magnitude = (unsigned long long)((exponent < 0) ? -exponent : exponent);
+        text_length += MStringDecimalDigitCount(magnitude);
+        MStringWriteDecimal(text + text_length, magnitude);
+        text[text_length] = '\0';
+        result = MSTRING_STRTOD(text);
+    }
+
+    unsigned long long bits;
+    MSTRING_MEMCPY(&bits, &result, sizeof(bits));
+    bits |= sign_bit;
+    MSTRING_MEMCPY(value, &bits, sizeof(bits));
+    return i;
+}
+
+// Smallest gap we create when the editor runs out of room. Past that, the gap grows with the text.
+constexpr static MSTRING_SIZE_T MStringEditorMinGap = 64;
+
+MStringEditor::MStringEditor(MString str) : buffer(static_cast<MString&&>(str))
+{
+    gap_start = gap_end = buffer.Length();
+}
+
+void MStringEditor::SetCursor(MSTRING_SIZE_T index)
+{
+    MSTRING_ASSERT(index >= 0 && index <= Length());
+    if (index == gap_start) return;
+
+    char* ptr = buffer.Ptr();
+    if (index < gap_start) // Move the text between the new cursor and the gap to the other side of the gap.
+    {
+        MSTRING_SIZE_T count = gap_start - index;
+        MSTRING_MEMMOVE(ptr + gap_end - count, ptr + index, count);
+        gap_start -= count;
+        gap_end -= count;
+    }
+    else
+    {
+        MSTRING_SIZE_T count = index - gap_start;
+        MSTRING_MEMMOVE(ptr + gap_start, ptr + gap_end, count);
+        gap_start += count;
+        gap_end += count;
+    }
+}
+
+void MStringEditor::Grow(MSTRING_SIZE_T required_gap)
+{
+    // Make the gap at least half the length of the text, so growing is amortized O(1) per byte inserted.
+    MSTRING_SIZE_T gap = Length() / 2;
+    if (gap < MStringEditorMinGap) gap = MStringEditorMinGap;
+    if (gap < required_gap) gap = required_gap;
+
+    MSTRING_SIZE_T old_size = buffer.Length();
+    MSTRING_SIZE_T tail = old_size - gap_end;
+    buffer.SetLength(gap_start + gap + tail);
+    char* ptr = buffer.Ptr();
+    MSTRING_MEMMOVE(ptr + gap_start + gap, ptr + gap_end, tail);
+    gap_end = gap_start + gap;
+}
+
+MStringEditor& MStringEditor::Insert(MSTRING_SIZE_T index, const char* str, MSTRING_SIZE_T len)
+{
+    MSTRING_ASSERT(str && len >= 0);
+
+    // The source might be our own text, which moves when the gap does (or when we grow), so keep
+    // track of it by its position in the text instead.
+    const char* old_ptr = static_cast<const MString&>(buffer).Ptr();
+    bool aliased = (str >= old_ptr && str < old_ptr + buffer.Length());
+    MSTRING_SIZE_T offset = aliased ? (MSTRING_SIZE_T)(str - old_ptr) : 0;
+    if (offset >= gap_end) offset -= gap_end - gap_start;
+    else if (offset > gap_start) offset = gap_start;
+
+    SetCursor(index);
+    if (len <= 0 || !str) return *this;
+    if (gap_end - gap_start < len) Grow(len);
+    char* ptr = buffer.Ptr();
+    if (!aliased) MSTRING_MEMCPY(ptr + gap_start, str, len);
+    else
+    {
+        // Source text before the cursor stayed put, and the rest is on the other side of the gap.
+        MSTRING_SIZE_T before = (offset >= gap_start) ? 0 : (gap_start - offset < len) ? gap_start - offset : len;
+        MSTRING_MEMCPY(ptr + gap_start, ptr + offset, before);
+        MSTRING_MEMCPY(ptr + gap_start + before, ptr + gap_end + (offset + before - gap_start), len - before);
+    }
+    gap_start += len;
+    return *this;
+}
+
+MStringEditor& MStringEditor::Erase(MSTRING_SIZE_T count)
+{
+    MSTRING_ASSERT(count >= 0 && gap_start + count <= Length());
+    MSTRING_SIZE_T after = buffer.Length() - gap_end;
+    gap_end += (count < after) ? count : after;
+    return *this;
+}
+
+MStringEditor& MStringEditor::EraseBack(MSTRING_SIZE_T count)
+{
+    MSTRING_ASSERT(count >= 0 && count <= gap_start);
+    gap_start -= (count < gap_start) ? count : gap_start;
+    return *this;
+}
+
+const char* MStringEditor::Ptr()
+{
+    SetCursor(Length());
+    char* ptr = buffer.Ptr();
+    ptr[gap_start] = '\0'; // Either the start of the gap, or the buffer's own null terminator.
+    return ptr;
+}
+
+MString MStringEditor::Take()
+{
+    SetCursor(Length());
+    buffer.SetLength(gap_start);
+    gap_start = gap_end = 0;
+    return static_cast<MString&&>(buffer);
+}
+
+MStringPiece::MStringPiece(const char* str) : ptr(str), length((MSTRING_SIZE_T)MSTRING_STRLEN(str)) {}
+
+char* MStringPiece::Write(char* dst) const
+{
+    if (ptr) MSTRING_MEMCPY(dst, ptr, length);
+    else if (length) *dst = c;
+    return dst + length;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes> MStringBuildChain(BasicMString<InlineBytes>&& head, int head_index, const MStringPiece* pieces, int count)
+{
+    BasicMString<InlineBytes> result = static_cast<BasicMString<InlineBytes>&&>(head);
+    MSTRING_SIZE_T head_length = result.Length(), prefix_length = 0, total = head_length;
+    for (int i = 0; i < count; ++i)
+    {
+        total += pieces[i].Length();
+        if (i < head_index) prefix_length += pieces[i].Length();
+    }
+
+    result.Reserve(total);
+    result.SetLength(total);
+    char* dst = result.Ptr();
+    if (prefix_length && head_length) MSTRING_MEMMOVE(dst + prefix_length, dst, head_length);
+    for (int i = 0; i < head_index; ++i) dst = pieces[i].Write(dst);
+    dst += head_length;
+    for (int i = head_index; i < count; ++i) dst = pieces[i].Write(dst);
+    return result;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>::BasicMString(const BasicMString& other)
+{
+    MSTRING_STAT(copies, 1);
+    if (ShareBuffer(other)) return;
+    if (other.IsHeap())
+    {
+        MSTRING_STAT(heap_placements, 1);
+        data = {};
+        MSTRING_SIZE_T capacity = other.data.heap.Capacity();
+        data.heap.ptr = AllocateBuffer(&capacity, &data.heap.flags, MStringAllocator::Current());
+        MSTRING_MEMCPY(data.heap.ptr, other.data.heap.ptr, other.length + 1);
+        SetHeapCapacity(capacity);
+    }
+    else
+    {
+        MSTRING_STAT(short_placements, 1);
+        data = other.data;
+    }
+    length = other.length;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>::BasicMString(BasicMString&& other)
+{
+    MSTRING_STAT(moves, 1);
+    data = other.data;
+    length = other.length;
+    other.data = {};
+    other.length = 0;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::operator=(const BasicMString& other)
+{
+    if (this != &other)
+    {
+        MSTRING_STAT(copies, 1);
+        Free();
+        if (ShareBuffer(other)) return *this;
+        SetLength(other.length);
+        MSTRING_MEMCPY(Ptr(), other.Ptr(), length);
+    }
+    return *this;
+}
+
+template <int InlineBytes>
+BasicMString<InlineBytes>& BasicMString<InlineBytes>::operator=(BasicMString&& other)
 {
     if (this != &other)
     {
-        Free();
-        SetLength(other.length);
-        MSTRING_MEMCPY(Ptr(), other.Ptr(), length);
+        MSTRING_STAT(moves, 1);
+        Free();
+        data = other.data;
+        length = other.length;
+        other.data = {};
+        other.length = 0;
+    }
+    return *this;
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::Free()
+{
+    if (length > 0) MSTRING_STAT_LENGTH(length);
+    if (IsHeap()) FreeBuffer();
+    data = {};
+    length = 0;
+}
+
+// Heap buffers can have up to three headers in front of the string data: a pointer to the allocator that
+// made them (AllocatorFlag), followed by a reference count (RefCountFlag), followed by the capacity, for
+// strings that don't have room for it (CapacityFlag). All of the headers are padded to the pointer
+// size, so that everything stays aligned.
+#ifdef MSTRING_SINGLE_THREADED
+typedef MSTRING_SIZE_T MStringRefCount;
+static void MStringRetain(MStringRefCount* count) {++*count;}
+static MSTRING_SIZE_T MStringRelease(MStringRefCount* count) {return --*count;}
+static MSTRING_SIZE_T MStringRefs(const MStringRefCount* count) {return *count;}
+#else
+// Same as std::shared_ptr: a new reference can only come from an existing one, so retaining doesn't
+// need to synchronize with anything, but the last release has to see every write from the other owners.
+typedef std::atomic<MSTRING_SIZE_T> MStringRefCount;
+static void MStringRetain(MStringRefCount* count) {count->fetch_add(1, std::memory_order_relaxed);}
+static MSTRING_SIZE_T MStringRelease(MStringRefCount* count) {return count->fetch_sub(1, std::memory_order_acq_rel) - 1;}
+static MSTRING_SIZE_T MStringRefs(const MStringRefCount* count) {return count->load(std::memory_order_acquire);}
+#endif
+
+#ifdef MSTRING_COPY_ON_WRITE
+constexpr static bool MStringCopyOnWrite = true;
+#else
+constexpr static bool MStringCopyOnWrite = false;
+#endif
+
+constexpr static MSTRING_SIZE_T MStringAllocatorHeaderSize = sizeof(MStringAllocator*);
+constexpr static MSTRING_SIZE_T MStringRefCountHeaderSize = (sizeof(MStringRefCount) + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+// The reference count comes before the capacity header, if there is one.
+static MStringRefCount* MStringRefCountOf(const char* ptr, bool capacity_header)
+{
+    return (MStringRefCount*)(ptr - (capacity_header ? MStringCapacityHeaderSize : 0) - MStringRefCountHeaderSize);
+}
+
+static thread_local MStringAllocator* mstring_current_allocator = nullptr;
+
+MStringAllocator* MStringAllocator::Current() {return mstring_current_allocator;}
+
+MStringAllocatorScope::MStringAllocatorScope(MStringAllocator* allocator) : previous(mstring_current_allocator)
+{
+    mstring_current_allocator = allocator;
+}
+
+MStringAllocatorScope::~MStringAllocatorScope() {mstring_current_allocator = previous;}
+
+template <int InlineBytes>
+MSTRING_SIZE_T BasicMString<InlineBytes>::HeaderSize() const
+{
+    return ((data.heap.flags & AllocatorFlag) ? MStringAllocatorHeaderSize : 0) +
+           ((data.heap.flags & RefCountFlag) ? MStringRefCountHeaderSize : 0) +
+           ((data.heap.flags & CapacityFlag) ? MStringCapacityHeaderSize : 0);
+}
+
+template <int InlineBytes>
+MStringAllocator* BasicMString<InlineBytes>::Allocator() const
+{
+    if (!(data.heap.flags & AllocatorFlag)) return nullptr;
+    MStringAllocator* allocator;
+    MSTRING_MEMCPY(&allocator, data.heap.ptr - HeaderSize(), sizeof(allocator));
+    return allocator;
+}
+
+template <int InlineBytes>
+bool BasicMString<InlineBytes>::IsShared() const
+{
+    return (data.heap.flags & RefCountFlag) && MStringRefs(MStringRefCountOf(data.heap.ptr, data.heap.flags & CapacityFlag)) > 1;
+}
+
+template <int InlineBytes>
+char* BasicMString<InlineBytes>::AllocateBuffer(MSTRING_SIZE_T* capacity, char* flags, MStringAllocator* allocator)
+{
+    MSTRING_SIZE_T capacity_header = InlineCapacity ? 0 : MStringCapacityHeaderSize;
+    MSTRING_SIZE_T header = (allocator ? MStringAllocatorHeaderSize : 0) + (MStringCopyOnWrite ? MStringRefCountHeaderSize : 0) + capacity_header;
+    char* block;
+    if (allocator) block = (char*)allocator->Allocate(header + *capacity + 1);
+    else
+    {
+        *capacity = MStringRoundCapacity(*capacity, header);
+        block = (char*)MStringHeapAllocate(header + *capacity + 1);
+    }
+    *flags = HeapFlag;
+    if (allocator)
+    {
+        MSTRING_MEMCPY(block, &allocator, sizeof(allocator));
+        *flags |= AllocatorFlag;
+    }
+    if (MStringCopyOnWrite)
+    {
+        new (block + header - capacity_header - MStringRefCountHeaderSize) MStringRefCount(1);
+        *flags |= RefCountFlag;
+    }
+    if (capacity_header) *flags |= CapacityFlag; // The caller fills it in.
+    MSTRING_STAT(allocations, 1);
+    MSTRING_STAT(bytes_allocated, header + *capacity + 1);
+    return block + header;
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::ReallocateBuffer(MSTRING_SIZE_T capacity)
+{
+    MSTRING_ASSERT(IsHeap() && capacity >= length);
+    if (IsShared()) // The other owners still need the old buffer, so we can't resize it. Copy it instead.
+    {
+        char flags = 0;
+        char* new_ptr = AllocateBuffer(&capacity, &flags, Allocator());
+        MSTRING_MEMCPY(new_ptr, data.heap.ptr, length + 1);
+        FreeBuffer();
+        data.heap.ptr = new_ptr;
+        data.heap.flags = flags;
+    }
+    else
+    {
+        MSTRING_SIZE_T header = HeaderSize();
+        char* block = data.heap.ptr - header;
+        if (MStringAllocator* allocator = Allocator())
+        {
+            block = (char*)allocator->Reallocate(block, header + data.heap.Capacity() + 1, header + capacity + 1);
+        }
+        else
+        {
+            capacity = MStringRoundCapacity(capacity, header);
+            block = (char*)MStringHeapReallocate(block, header + data.heap.Capacity() + 1, header + capacity + 1);
+        }
+        data.heap.ptr = block + header;
+        MSTRING_STAT(reallocations, 1);
+        if (capacity > data.heap.Capacity()) MSTRING_STAT(bytes_allocated, capacity - data.heap.Capacity());
+        else MSTRING_STAT(bytes_freed, data.heap.Capacity() - capacity);
+    }
+    SetHeapCapacity(capacity);
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::FreeBuffer()
+{
+    MSTRING_ASSERT(IsHeap());
+    if ((data.heap.flags & RefCountFlag) && MStringRelease(MStringRefCountOf(data.heap.ptr, data.heap.flags & CapacityFlag)) != 0) return;
+
+    MSTRING_SIZE_T header = HeaderSize();
+    MSTRING_STAT(frees, 1);
+    MSTRING_STAT(bytes_freed, header + data.heap.Capacity() + 1);
+    MSTRING_STAT(freed_capacity, data.heap.Capacity());
+    MSTRING_STAT(freed_length, length);
+    if (MStringAllocator* allocator = Allocator())
+    {
+        allocator->Free(data.heap.ptr - header, header + data.heap.Capacity() + 1);
+    }
+    else MStringHeapFree(data.heap.ptr - header, header + data.heap.Capacity() + 1);
+}
+
+template <int InlineBytes>
+bool BasicMString<InlineBytes>::ShareBuffer(const BasicMString& other)
+{
+    // A copy made inside an MStringAllocatorScope is supposed to live in that scope's allocator, so we
+    // can only share buffers that came from the same place.
+    if (!(other.data.heap.flags & RefCountFlag) || other.Allocator() != MStringAllocator::Current()) return false;
+
+    MStringRetain(MStringRefCountOf(other.data.heap.ptr, other.data.heap.flags & CapacityFlag));
+    MSTRING_STAT(shared_copies, 1);
+    data = {};
+    data.heap.ptr = other.data.heap.ptr;
+    data.heap.flags = other.data.heap.flags;
+    if (InlineCapacity) data.heap.SetCapacity(other.data.heap.Capacity(), false);
+    length = other.length;
+
+    // Copying is a const read, so another thread might be filling in other's hash cache right now.
+    // Read it the same way Hash() does, rather than copying the padding along with everything else.
+    if (other.HasCachedHash())
+    {
+        for (size_t i = 0; i < sizeof(unsigned int); ++i) data.heap.unused[i] = MStringLoadByte(&other.data.heap.unused[i], false);
+        data.heap.unused[HashMarker] = 1;
+    }
+    return true;
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::Detach()
+{
+    if (IsShared()) ReallocateBuffer(data.heap.Capacity());
+}
+
+template <int InlineBytes>
+void BasicMString<InlineBytes>::TakeBuffer(char* ptr, MSTRING_SIZE_T capacity, char flags, MSTRING_SIZE_T len)
+{
+    MSTRING_ASSERT(InlineCapacity || (flags & CapacityFlag));
+    MSTRING_STAT(moves, 1);
+    data = {};
+    data.heap.ptr = ptr;
+    data.heap.flags = flags;
+    SetHeapCapacity(capacity);
+    length = len;
+}
+
+template struct BasicMString<MStringDefaultInlineBytes>;
+template struct BasicMString<MString64InlineBytes>;
+template struct BasicMString<MStringCompactInlineBytes>;
+template MString MStringBuildChain(MString&& head, int head_index, const MStringPiece* pieces, int count);
+template MString64 MStringBuildChain(MString64&& head, int head_index, const MStringPiece* pieces, int count);
+template MStringCompact MStringBuildChain(MStringCompact&& head, int head_index, const MStringPiece* pieces, int count);
+
+// Arena allocations are rounded up to this alignment, so that allocator headers stay aligned.
+constexpr static MSTRING_SIZE_T MStringArenaAlignment = sizeof(void*);
+
+static MSTRING_SIZE_T MStringArenaAlign(MSTRING_SIZE_T size)
+{
+    return (size + MStringArenaAlignment - 1) & ~(MStringArenaAlignment - 1);
+}
+
+MStringArena::~MStringArena()
+{
+    while (blocks)
+    {
+        Block* next = blocks->next;
+        MSTRING_FREE(blocks);
+        blocks = next;
+    }
+}
+
+void* MStringArena::Allocate(MSTRING_SIZE_T size)
+{
+    size = MStringArenaAlign(size);
+    if (!blocks || blocks->size - blocks->used < size)
+    {
+        // Oversized requests get a block of their own, everything else gets a standard-size block.
+        MSTRING_SIZE_T new_size = (size > block_size) ? size : block_size;
+        Block* block = (Block*)MSTRING_MALLOC(MStringArenaAlign(sizeof(Block)) + new_size);
+        block->next = blocks;
+        block->size = new_size;
+        block->used = 0;
+        blocks = block;
+    }
+
+    last = (char*)blocks + MStringArenaAlign(sizeof(Block)) + blocks->used;
+    blocks->used += size;
+    return last;
+}
+
+void* MStringArena::Reallocate(void* ptr, MSTRING_SIZE_T old_size, MSTRING_SIZE_T new_size)
+{
+    if (!ptr) return Allocate(new_size);
+
+    // The newest allocation is always at the end of the current block, so we can resize it in place.
+    if (ptr == last)
+    {
+        MSTRING_SIZE_T start = (MSTRING_SIZE_T)(last - ((char*)blocks + MStringArenaAlign(sizeof(Block))));
+        if (blocks->size - start >= MStringArenaAlign(new_size))
+        {
+            blocks->used = start + MStringArenaAlign(new_size);
+            return ptr;
+        }
+    }
+    else if (new_size <= old_size) return ptr; // Shrinking anything else is free, we just waste the tail.
+
+    void* new_ptr = Allocate(new_size);
+    MSTRING_MEMCPY(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+    return new_ptr;
+}
+
+void MStringArena::Free(void* ptr, MSTRING_SIZE_T size)
+{
+    // Individual frees are no-ops, except that the newest allocation can give its space back.
+    (void)size;
+    if (ptr && ptr == last)
+    {
+        blocks->used = (MSTRING_SIZE_T)(last - ((char*)blocks + MStringArenaAlign(sizeof(Block))));
+        last = nullptr;
+    }
+}
+
+void MStringArena::Reset()
+{
+    if (!blocks) return;
+    while (blocks->next)
+    {
+        Block* next = blocks->next->next;
+        MSTRING_FREE(blocks->next);
+        blocks->next = next;
+    }
+    blocks->used = 0;
+    last = nullptr;
+}
+
+// Each shard is an open-addressed hash table of atom entries, with the entries themselves (header
+// followed by the null-terminated string bytes) living in an arena.
+struct MStringInternTable::Shard
+{
+    struct Slot
+    {
+        unsigned int hash;
+        const IAtom::Entry* entry;
+    };
+
+    std::mutex mutex;
+    MStringArena arena;
+    Slot* slots = nullptr;
+    MSTRING_SIZE_T slot_count = 0; // Always zero or a power of two.
+    MSTRING_SIZE_T count = 0;
+
+    ~Shard() {MSTRING_FREE(slots);}
+
+    const IAtom::Entry* Find(IString str, unsigned int hash) const
+    {
+        if (!slot_count) return nullptr;
+        for (MSTRING_SIZE_T i = hash & (slot_count - 1);; i = (i + 1) & (slot_count - 1))
+        {
+            const Slot& slot = slots[i];
+            if (!slot.entry) return nullptr;
+            if (slot.hash == hash && slot.entry->length == str.Length() &&
+                MSTRING_MEMCMP(slot.entry + 1, str.Ptr(), str.Length()) == 0) return slot.entry;
+        }
+    }
+
+    const IAtom::Entry* Add(IString str, unsigned int hash)
+    {
+        // Keep the load factor under 3/4, so that probe sequences stay short.
+        if ((count + 1) * 4 > slot_count * 3) Grow();
+
+        IAtom::Entry* entry = (IAtom::Entry*)arena.Allocate(sizeof(IAtom::Entry) + str.Length() + 1);
+        entry->length = str.Length();
+        entry->hash = hash;
+        char* chars = (char*)(entry + 1);
+        if (str.Length()) MSTRING_MEMCPY(chars, str.Ptr(), str.Length());
+        chars[str.Length()] = '\0';
+
+        Place(entry);
+        count++;
+        return entry;
+    }
+
+    void Place(const IAtom::Entry* entry)
+    {
+        MSTRING_SIZE_T i = entry->hash & (slot_count - 1);
+        while (slots[i].entry) i = (i + 1) & (slot_count - 1);
+        slots[i] = {entry->hash, entry};
+    }
+
+    void Grow()
+    {
+        Slot* old_slots = slots;
+        MSTRING_SIZE_T old_count = slot_count;
+        slot_count = (slot_count) ? slot_count * 2 : 64;
+        slots = (Slot*)MSTRING_MALLOC(slot_count * sizeof(Slot));
+        for (MSTRING_SIZE_T i = 0; i < slot_count; ++i) slots[i] = {};
+        for (MSTRING_SIZE_T i = 0; i < old_count; ++i) if (old_slots[i].entry) Place(old_slots[i].entry);
+        MSTRING_FREE(old_slots);
+    }
+};
+
+// Thread-safe tables use this many shards, single-threaded tables use just one (and never lock).
+constexpr static unsigned int MStringInternShardCount = 64;
+
+MStringInternTable::MStringInternTable(bool thread_safe) : shard_count(thread_safe ? MStringInternShardCount : 1)
+{
+    shards = new Shard[shard_count];
+}
+
+MStringInternTable::~MStringInternTable() {delete[] shards;}
+
+MStringInternTable::Shard& MStringInternTable::ShardFor(unsigned int hash) const
+{
+    // Slots are picked with the low bits of the hash, so pick shards with the high ones.
+    return shards[(hash >> 24) & (shard_count - 1)];
+}
+
+IAtom MStringInternTable::Intern(IString str)
+{
+    unsigned int hash = MStringHash(str.Ptr(), str.Length());
+    Shard& shard = ShardFor(hash);
+    if (shard_count == 1)
+    {
+        const IAtom::Entry* entry = shard.Find(str, hash);
+        return IAtom(entry ? entry : shard.Add(str, hash));
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const IAtom::Entry* entry = shard.Find(str, hash);
+    return IAtom(entry ? entry : shard.Add(str, hash));
+}
+
+IAtom MStringInternTable::Find(IString str) const
+{
+    unsigned int hash = MStringHash(str.Ptr(), str.Length());
+    Shard& shard = ShardFor(hash);
+    if (shard_count == 1) return IAtom(shard.Find(str, hash));
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return IAtom(shard.Find(str, hash));
+}
+
+MSTRING_SIZE_T MStringInternTable::Count() const
+{
+    MSTRING_SIZE_T count = 0;
+    for (unsigned int i = 0; i < shard_count; ++i)
+    {
+        if (shard_count > 1) shards[i].mutex.lock();
+        count += shards[i].count;
+        if (shard_count > 1) shards[i].mutex.unlock();
+    }
+    return count;
+}
+
+// String sorting. We sort keys instead of the strings themselves. Each key caches the 8 bytes of its
+// string that start at the current depth rounded down to 8 (the window), big-endian and padded with
+// zeros, so that comparing keys as integers compares those bytes. Padding can't be mistaken for a zero
+// byte, since two keys with the same bytes get ordered by length, and the shorter one is a prefix.
+struct MStringSortKey
+{
+    unsigned long long prefix;
+    const char* ptr;
+    MSTRING_SIZE_T length;
+    MSTRING_SIZE_T index;
+};
+
+constexpr static MSTRING_SIZE_T MStringSortInsertionLimit = 32;   // Buckets this small get an insertion sort.
+constexpr static MSTRING_SIZE_T MStringSortParallelGrain = 16384; // Buckets this big can go to other threads.
+constexpr static unsigned int MStringSortMaxThreads = 64;
+
+static unsigned long long MStringSortPrefix(const char* ptr, MSTRING_SIZE_T length, MSTRING_SIZE_T window)
+{
+    if (length >= window + 8) return MStringLoadBigEndian8(ptr + window);
+    // Short tails are zero-padded, which sorts them before anything longer.
+    unsigned char bytes[8] = {};
+    if (length > window) MSTRING_MEMCPY(bytes, ptr + window, length - window);
+    // Big-endian, so comparing prefixes as integers compares the bytes in order.
+    return ((unsigned long long)bytes[0] << 56) | ((unsigned long long)bytes[1] << 48) |
+           ((unsigned long long)bytes[2] << 40) | ((unsigned long long)bytes[3] << 32) |
+           ((unsigned long long)bytes[4] << 24) | ((unsigned long long)bytes[5] << 16) |
+           ((unsigned long long)bytes[6] << 8) | (unsigned long long)bytes[7];
+}
+
+// Compares two keys that are equal before the window.
+static int MStringSortCompare(const MStringSortKey& a, const MStringSortKey& b, MSTRING_SIZE_T window)
+{
+    if (a.prefix != b.prefix) return (a.prefix < b.prefix) ? -1 : 1;
+    MSTRING_SIZE_T end = window + 8;
+    if (a.length > end && b.length > end)
+    {
+        int result = MStringCompareBytes(a.ptr + end, b.ptr + end, ((a.length < b.length) ? a.length : b.length) - end);
+        if (result) return result;
+    }
+    return (a.length < b.length) ? -1 : (a.length > b.length) ? 1 : 0;
+}
+
+static void MStringSortInsertion(MStringSortKey* keys, MSTRING_SIZE_T count, MSTRING_SIZE_T window)
+{
+    for (MSTRING_SIZE_T i = 1; i < count; ++i)
+    {
+        MStringSortKey key = keys[i];
+        MSTRING_SIZE_T j = i;
+        for (; j > 0 && MStringSortCompare(key, keys[j - 1], window) < 0; --j) keys[j] = keys[j - 1];
+        keys[j] = key;
+    }
+}
+
+// Buckets that are waiting for a thread, when sorting in parallel.
+struct MStringSortTask
+{
+    MStringSortKey* keys;
+    MStringSortKey* temp;
+    MSTRING_SIZE_T count;
+    MSTRING_SIZE_T depth;
+};
+
+struct MStringSortTasks
+{
+    std::mutex mutex;
+    std::condition_variable wake;
+    MStringSortTask* tasks = nullptr;
+    MSTRING_SIZE_T task_count = 0;
+    MSTRING_SIZE_T task_capacity = 0;
+    unsigned int busy = 0; // Threads working on a task, which might add more tasks.
+
+    void Push(MStringSortTask task)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (task_count == task_capacity)
+        {
+            task_capacity = task_capacity ? task_capacity * 2 : 64;
+            tasks = (MStringSortTask*)MSTRING_REALLOC(tasks, task_capacity * sizeof(MStringSortTask));
+        }
+        tasks[task_count++] = task;
+        wake.notify_one();
+    }
+};
+
+// Sorts keys that are all equal before depth, and have their prefixes loaded for depth's window
+// (or the one before it, if depth is the start of a new window). temp is scratch space of the same size.
+static void MStringSortRadix(MStringSortKey* keys, MStringSortKey* temp, MSTRING_SIZE_T count, MSTRING_SIZE_T depth, MStringSortTasks* tasks)
+{
+    for (;;)
+    {
+        // Starting a new window. If every key has the same 8 bytes in it, we can skip straight past them.
+        bool same = false;
+        if (depth && (depth & 7) == 0)
+        {
+            same = true;
+            for (MSTRING_SIZE_T i = 0; i < count; ++i)
+            {
+                keys[i].prefix = MStringSortPrefix(keys[i].ptr, keys[i].length, depth);
+                same = same && keys[i].prefix == keys[0].prefix && keys[i].length > depth + 8;
+            }
+        }
+        if (count <= MStringSortInsertionLimit) {MStringSortInsertion(keys, count, depth & ~(MSTRING_SIZE_T)7); return;}
+        if (same) {depth += 8; continue;}
+
+        // Bucket 0 is for strings that end before depth, and the rest are for the byte at depth.
+        MSTRING_SIZE_T counts[257] = {};
+        unsigned int shift = 56 - 8 * (unsigned int)(depth & 7);
+        for (MSTRING_SIZE_T i = 0; i < count; ++i)
+        {
+            counts[(keys[i].length > depth) ? ((keys[i].prefix >> shift) & 0xFF) + 1 : 0]++;
+        }
+        if (counts[0] == count) return; // All equal.
+
+        MSTRING_SIZE_T offsets[257], largest = 1;
+        MSTRING_SIZE_T offset = 0;
+        for (int b = 0; b < 257; ++b)
+        {
+            offsets[b] = offset;
+            offset += counts[b];
+            if (b > 0 && counts[b] > counts[largest]) largest = (MSTRING_SIZE_T)b;
+        }
+        if (counts[largest] != count) // Otherwise every key has the same byte here, and nothing moves.
+        {
+            for (MSTRING_SIZE_T i = 0; i < count; ++i)
+            {
+                temp[offsets[(keys[i].length > depth) ? ((keys[i].prefix >> shift) & 0xFF) + 1 : 0]++] = keys[i];
+            }
+            MSTRING_MEMCPY(keys, temp, count * sizeof(MStringSortKey));
+
+            // Sort every bucket but the largest one, which we carry on with here. That keeps the
+            // recursion at most log2(count) deep.
+            for (int b = 1; b < 257; ++b)
+            {
+                MSTRING_SIZE_T start = offsets[b] - counts[b];
+                if ((MSTRING_SIZE_T)b == largest || counts[b] < 2) continue;
+                if (tasks && counts[b] >= MStringSortParallelGrain) tasks->Push({keys + start, temp + start, counts[b], depth + 1});
+                else MStringSortRadix(keys + start, temp + start, counts[b], depth + 1, tasks);
+            }
+            MSTRING_SIZE_T start = offsets[largest] - counts[largest];
+            keys += start;
+            temp += start;
+            count = counts[largest];
+        }
+        ++depth;
+    }
+}
+
+static void MStringSortWorker(MStringSortTasks* tasks)
+{
+    std::unique_lock<std::mutex> lock(tasks->mutex);
+    for (;;)
+    {
+        while (!tasks->task_count && tasks->busy) tasks->wake.wait(lock);
+        if (!tasks->task_count) return; // Nobody is working, so no more tasks can show up.
+        MStringSortTask task = tasks->tasks[--tasks->task_count];
+        ++tasks->busy;
+        lock.unlock();
+        MStringSortRadix(task.keys, task.temp, task.count, task.depth, tasks);
+        lock.lock();
+        if (--tasks->busy == 0 && !tasks->task_count) tasks->wake.notify_all();
+    }
+}
+
+static unsigned int MStringSortThreads(MSTRING_SIZE_T count, bool parallel)
+{
+    if (!parallel || count < 2 * MStringSortParallelGrain) return 1;
+    unsigned int threads = std::thread::hardware_concurrency();
+    return (threads < 1) ? 1 : (threads > MStringSortMaxThreads) ? MStringSortMaxThreads : threads;
+}
+
+// Runs body(start, end) over [0, count) in one chunk per thread.
+template <class Body>
+static void MStringSortChunks(MSTRING_SIZE_T count, unsigned int threads, Body body)
+{
+    if (threads <= 1) {body((MSTRING_SIZE_T)0, count); return;}
+    std::thread workers[MStringSortMaxThreads];
+    for (unsigned int t = 0; t < threads; ++t) workers[t] = std::thread(body, count * t / threads, count * (t + 1) / threads);
+    for (unsigned int t = 0; t < threads; ++t) workers[t].join();
+}
+
+// Makes a key for every string, and sorts them. The caller frees the keys.
+template <class View>
+static MStringSortKey* MStringSortKeys(MSTRING_SIZE_T count, bool parallel, View view)
+{
+    MStringSortKey* keys = (MStringSortKey*)MSTRING_MALLOC(2 * count * sizeof(MStringSortKey));
+    unsigned int threads = MStringSortThreads(count, parallel);
+    MStringSortChunks(count, threads, [&](MSTRING_SIZE_T start, MSTRING_SIZE_T end)
+    {
+        for (MSTRING_SIZE_T i = start; i < end; ++i)
+        {
+            IString str = view(i);
+            keys[i] = {MStringSortPrefix(str.Ptr(), str.Length(), 0), str.Ptr(), str.Length(), i};
+        }
+    });
+
+    if (threads <= 1) MStringSortRadix(keys, keys + count, count, 0, nullptr);
+    else
+    {
+        MStringSortTasks tasks;
+        tasks.Push({keys, keys + count, count, 0});
+        std::thread workers[MStringSortMaxThreads];
+        for (unsigned int t = 1; t < threads; ++t) workers[t] = std::thread(MStringSortWorker, &tasks);
+        MStringSortWorker(&tasks);
+        for (unsigned int t = 1; t < threads; ++t) workers[t].join();
+        MSTRING_FREE(tasks.tasks);
+    }
+    return keys;
+}
+
+void MStringSort(IString* strings, MSTRING_SIZE_T count, bool parallel)
+{
+    if (count < 2) return;
+    MStringSortKey* keys = MStringSortKeys(count, parallel, [=](MSTRING_SIZE_T i) {return strings[i];});
+    MStringSortChunks(count, MStringSortThreads(count, parallel), [&](MSTRING_SIZE_T start, MSTRING_SIZE_T end)
+    {
+        for (MSTRING_SIZE_T i = start; i < end; ++i) strings[i] = IString(keys[i].ptr, keys[i].length);
+    });
+    MSTRING_FREE(keys);
+}
+
+void MStringSortStructs(void* structs, MSTRING_SIZE_T count, MSTRING_SIZE_T size, IString (*view)(const void*), bool parallel)
+{
+    if (count < 2) return;
+    char* base = (char*)structs;
+    MStringSortKey* keys = MStringSortKeys(count, parallel, [=](MSTRING_SIZE_T i) {return view(base + i * size);});
+    char* sorted = (char*)MSTRING_MALLOC(count * size);
+    MStringSortChunks(count, MStringSortThreads(count, parallel), [&](MSTRING_SIZE_T start, MSTRING_SIZE_T end)
+    {
+        for (MSTRING_SIZE_T i = start; i < end; ++i) MSTRING_MEMCPY(sorted + i * size, base + keys[i].index * size, size);
+    });
+    MSTRING_MEMCPY(base, sorted, count * size);
+    MSTRING_FREE(sorted);
+    MSTRING_FREE(keys);
+}
+
+MSTRING_SIZE_T MStringUnique(IString* strings, MSTRING_SIZE_T count)
+{
+    MSTRING_SIZE_T kept = 0;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        if (!kept || strings[i] != strings[kept - 1]) strings[kept++] = strings[i];
     }
+    return kept;
+}
+
+#ifndef MSTRING_NO_FILES
+MStringMappedFile::MStringMappedFile(MStringMappedFile&& other) : ptr(other.ptr), length(other.length), is_open(other.is_open)
+{
+    other.ptr = nullptr;
+    other.length = 0;
+    other.is_open = false;
+}
+
+MStringMappedFile& MStringMappedFile::operator=(MStringMappedFile&& other)
+{
+    if (this == &other) return *this;
+    Close();
+    ptr = other.ptr;
+    length = other.length;
+    is_open = other.is_open;
+    other.ptr = nullptr;
+    other.length = 0;
+    other.is_open = false;
     return *this;
 }
 
-MString& MString::operator=(MString&& other)
+// Empty files don't get mapped at all, since neither OS will map zero bytes.
+bool MStringMappedFile::Open(const char* path)
 {
-    if (this != &other)
+    Close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(file, &size) && (unsigned long long)size.QuadPart <= (unsigned long long)(MSTRING_SIZE_T)-1 / 2;
+    if (ok && size.QuadPart > 0)
     {
-        Free();
-        data = other.data;
-        other.data = {};
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        ptr = (mapping) ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (mapping) CloseHandle(mapping); // The view keeps the mapping alive.
+        ok = ptr != nullptr;
+    }
+    CloseHandle(file);
+    if (!ok) return false;
+    length = (MSTRING_SIZE_T)size.QuadPart;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    bool ok = fstat(file, &info) == 0 && S_ISREG(info.st_mode) && (unsigned long long)info.st_size <= (unsigned long long)(MSTRING_SIZE_T)-1 / 2;
+    if (ok && info.st_size > 0)
+    {
+        void* mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        ok = mapping != MAP_FAILED;
+        if (ok)
+        {
+            madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+            ptr = (const char*)mapping;
+        }
+    }
+    close(file); // The mapping keeps the file alive.
+    if (!ok) return false;
+    length = (MSTRING_SIZE_T)info.st_size;
+#endif
+    is_open = true;
+    return true;
+}
+
+void MStringMappedFile::Close()
+{
+#ifdef _WIN32
+    if (ptr) UnmapViewOfFile(ptr);
+#else
+    if (ptr) munmap((void*)ptr, (size_t)length);
+#endif
+    ptr = nullptr;
+    length = 0;
+    is_open = false;
+}
+
+bool MStringFileReader::Open(const char* path)
+{
+    Close();
+    file = fopen(path, "rb");
+    return file != nullptr;
+}
+
+void MStringFileReader::Close()
+{
+    if (file) fclose((FILE*)file);
+    file = nullptr;
+    buffer.SetLength(0);
+    start = scanned = 0;
+    at_end = failed = false;
+}
+
+bool MStringFileReader::Next(IString* record, char delimiter) {return Next(record, delimiter, false);}
+bool MStringFileReader::NextLine(IString* line) {return Next(line, '\n', true);}
+
+bool MStringFileReader::Next(IString* record, char delimiter, bool lines)
+{
+    if (!file) return false;
+    for (;;)
+    {
+        const char* ptr = static_cast<const MString&>(buffer).Ptr();
+        MSTRING_SIZE_T filled = buffer.Length();
+        MSTRING_SIZE_T index = MStringFindByte(ptr + scanned, filled - scanned, delimiter);
+        MSTRING_SIZE_T end;
+        if (index != MStringNotFound) end = scanned + index;
+        else if (at_end && start < filled) end = filled;
+        else if (at_end) return false;
+        else
+        {
+            // Move the partial record to the front, and only grow if it fills the whole buffer.
+            scanned = filled - start;
+            if (start > 0) buffer.Remove(0, start);
+            start = 0;
+            if (buffer.Length() == buffer.Capacity() || buffer.Capacity() < buffer_size)
+            {
+                MSTRING_SIZE_T capacity = buffer.Capacity() * 2;
+                buffer.Reserve((capacity > buffer_size) ? capacity : buffer_size);
+            }
+            MSTRING_SIZE_T old_length = buffer.Length();
+            buffer.SetLength(buffer.Capacity());
+            MSTRING_SIZE_T read = (MSTRING_SIZE_T)fread(buffer.Ptr() + old_length, 1, (size_t)(buffer.Length() - old_length), (FILE*)file);
+            buffer.SetLength(old_length + read);
+            if (read == 0)
+            {
+                at_end = true;
+                failed = ferror((FILE*)file) != 0;
+            }
+            continue;
+        }
+
+        *record = IString(ptr + start, end - start);
+        start = scanned = (end < filled) ? end + 1 : end;
+        if (lines && record->Length() && (*record)[record->Length() - 1] == '\r') *record = IString(record->Ptr(), record->Length() - 1);
+        return true;
+    }
+}
+
+bool MStringReadFile(const char* path, MString* contents)
+{
+    contents->SetLength(0);
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    // Regular files get read in one go. Anything else (or a file that grew since we checked its
+    // size) falls back to reading until the end, growing as needed.
+#ifdef _WIN32
+    long long size = _filelengthi64(_fileno(file));
+#else
+    struct stat info;
+    long long size = (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)) ? (long long)info.st_size : -1;
+#endif
+    if (size > 0 && (unsigned long long)size <= (unsigned long long)(MSTRING_SIZE_T)-1 / 2)
+    {
+        contents->Reserve((MSTRING_SIZE_T)size);
+        contents->SetLength((MSTRING_SIZE_T)size);
+        MSTRING_SIZE_T read = (MSTRING_SIZE_T)fread(contents->Ptr(), 1, (size_t)size, file);
+        contents->SetLength(read);
+    }
+    for (;;)
+    {
+        char chunk[4096];
+        size_t read = fread(chunk, 1, sizeof(chunk), file);
+        if (read == 0) break;
+        contents->Append(chunk, (MSTRING_SIZE_T)read);
     }
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+#endif
+
+// String tables. Saved tables start with this header, and the index and the data follow it. The
+// entries are packed to 4 bytes, so the index stays aligned in a mapped file.
+struct MStringTableHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int byte_order; // Reads back differently on a machine with the other byte order.
+    unsigned long long count;
+    unsigned long long data_length;
+};
+static_assert(sizeof(MStringTableHeader) == 32, "The header is part of the file format.");
+static const char mstring_table_magic[8] = "MStrTab";
+constexpr static unsigned int MStringTableVersion = 1;
+constexpr static unsigned int MStringTableByteOrder = 0x01020304;
+constexpr static MSTRING_SIZE_T MStringTableMinEntries = 16;
+constexpr static MSTRING_SIZE_T MStringTableMinData = 256;
+
+MStringTable::MStringTable(MStringTable&& other) {*this = static_cast<MStringTable&&>(other);}
+
+MStringTable& MStringTable::operator=(MStringTable&& other)
+{
+    if (this == &other) return *this;
+    Clear();
+    entries = other.entries;
+    data = other.data;
+    entry_count = other.entry_count;
+    entry_capacity = other.entry_capacity;
+    data_length = other.data_length;
+    data_capacity = other.data_capacity;
+    wasted = other.wasted;
+    mapped = other.mapped;
+#ifndef MSTRING_NO_FILES
+    file = static_cast<MStringMappedFile&&>(other.file);
+#endif
+    other.entries = nullptr;
+    other.data = nullptr;
+    other.entry_count = other.entry_capacity = other.data_length = other.data_capacity = other.wasted = 0;
+    other.mapped = false;
     return *this;
 }
 
-void MString::Free()
+void MStringTable::Clear()
 {
-    if (IsHeap()) MSTRING_FREE(data.heap.ptr);
-    data = {};
+    if (!mapped)
+    {
+        if (entries) MSTRING_FREE(entries);
+        if (data) MSTRING_FREE(data);
+    }
+#ifndef MSTRING_NO_FILES
+    file.Close();
+#endif
+    entries = nullptr;
+    data = nullptr;
+    entry_count = entry_capacity = data_length = data_capacity = wasted = 0;
+    mapped = false;
+}
+
+// Copies a mapped table into memory, so that we can change it.
+void MStringTable::Own()
+{
+    if (!mapped) return;
+    Entry* new_entries = (entry_count) ? (Entry*)MSTRING_MALLOC(entry_count * sizeof(Entry)) : nullptr;
+    char* new_data = (data_length) ? (char*)MSTRING_MALLOC(data_length) : nullptr;
+    if (entry_count) MSTRING_MEMCPY(new_entries, entries, entry_count * sizeof(Entry));
+    if (data_length) MSTRING_MEMCPY(new_data, data, data_length);
+#ifndef MSTRING_NO_FILES
+    file.Close();
+#endif
+    entries = new_entries;
+    data = new_data;
+    entry_capacity = entry_count;
+    data_capacity = data_length;
+    mapped = false;
+}
+
+// These grow by doubling, or to exactly the required size if that isn't enough.
+void MStringTable::GrowEntries(MSTRING_SIZE_T required)
+{
+    Own();
+    if (required <= entry_capacity) return;
+    MSTRING_SIZE_T capacity = (entry_capacity * 2 > required) ? entry_capacity * 2 : required;
+    if (capacity < MStringTableMinEntries) capacity = MStringTableMinEntries;
+    entries = (Entry*)MSTRING_REALLOC(entries, capacity * sizeof(Entry));
+    entry_capacity = capacity;
+}
+
+void MStringTable::GrowData(MSTRING_SIZE_T required)
+{
+    Own();
+    if (required <= data_capacity) return;
+    MSTRING_SIZE_T capacity = (data_capacity * 2 > required) ? data_capacity * 2 : required;
+    if (capacity < MStringTableMinData) capacity = MStringTableMinData;
+    data = (char*)MSTRING_REALLOC(data, capacity);
+    data_capacity = capacity;
+}
+
+void MStringTable::Reserve(MSTRING_SIZE_T count, MSTRING_SIZE_T data_bytes)
+{
+    Own();
+    if (count > entry_capacity)
+    {
+        entries = (Entry*)MSTRING_REALLOC(entries, count * sizeof(Entry));
+        entry_capacity = count;
+    }
+    if (data_bytes > data_capacity)
+    {
+        data = (char*)MSTRING_REALLOC(data, data_bytes);
+        data_capacity = data_bytes;
+    }
+}
+
+MSTRING_SIZE_T MStringTable::Append(IString str)
+{
+    MSTRING_ASSERT((unsigned long long)str.Length() <= 0xffffffffull);
+    // The string might be one of ours, in which case it moves when we grow (or copy a mapped table).
+    bool aliased = str.Length() && str.Ptr() >= data && str.Ptr() < data + data_length;
+    MSTRING_SIZE_T offset = (aliased) ? (MSTRING_SIZE_T)(str.Ptr() - data) : 0;
+
+    GrowEntries(entry_count + 1);
+    GrowData(data_length + str.Length() + 1);
+    if (str.Length()) MSTRING_MEMCPY(data + data_length, (aliased) ? data + offset : str.Ptr(), str.Length());
+    data[data_length + str.Length()] = '\0';
+    entries[entry_count].offset = data_length;
+    entries[entry_count].length = (unsigned int)str.Length();
+    data_length += str.Length() + 1;
+    return entry_count++;
+}
+
+void MStringTable::Append(const IString* strings, MSTRING_SIZE_T count)
+{
+    MSTRING_SIZE_T bytes = 0;
+    bool aliased = false;
+    for (MSTRING_SIZE_T i = 0; i < count; ++i)
+    {
+        bytes += strings[i].Length() + 1;
+        aliased |= strings[i].Length() && strings[i].Ptr() >= data && strings[i].Ptr() < data + data_length;
+    }
+    // Growing up front would move any strings that point into our own buffer, so those go one at a time.
+    if (!aliased)
+    {
+        GrowEntries(entry_count + count);
+        GrowData(data_length + bytes);
+    }
+    for (MSTRING_SIZE_T i = 0; i < count; ++i) Append(strings[i]);
+}
+
+void MStringTable::Set(MSTRING_SIZE_T index, IString str)
+{
+    MSTRING_ASSERT(index < entry_count && (unsigned long long)str.Length() <= 0xffffffffull);
+    bool aliased = str.Length() && str.Ptr() >= data && str.Ptr() < data + data_length;
+    MSTRING_SIZE_T offset = (aliased) ? (MSTRING_SIZE_T)(str.Ptr() - data) : 0;
+    Own();
+
+    MSTRING_SIZE_T old_length = entries[index].length;
+    if (str.Length() <= old_length)
+    {
+        char* dst = data + entries[index].offset;
+        if (str.Length()) MSTRING_MEMMOVE(dst, (aliased) ? data + offset : str.Ptr(), str.Length());
+        dst[str.Length()] = '\0';
+        wasted += old_length - str.Length();
+        entries[index].length = (unsigned int)str.Length();
+        return;
+    }
+    GrowData(data_length + str.Length() + 1);
+    MSTRING_MEMCPY(data + data_length, (aliased) ? data + offset : str.Ptr(), str.Length());
+    data[data_length + str.Length()] = '\0';
+    wasted += old_length + 1;
+    entries[index].offset = data_length;
+    entries[index].length = (unsigned int)str.Length();
+    data_length += str.Length() + 1;
 }
 
-#endif
\ No newline at end of file
+void MStringTable::Remove(MSTRING_SIZE_T index)
+{
+    MSTRING_ASSERT(index < entry_count);
+    Own();
+    wasted += entries[index].length + 1;
+    MSTRING_MEMMOVE(entries + index, entries + index + 1, (entry_count - index - 1) * sizeof(Entry));
+    entry_count--;
+}
+
+void MStringTable::Compact()
+{
+    if (wasted == 0) return;
+    MSTRING_SIZE_T new_length = data_length - wasted;
+    char* new_data = (new_length) ? (char*)MSTRING_MALLOC(new_length) : nullptr;
+    MSTRING_SIZE_T at = 0;
+    for (MSTRING_SIZE_T i = 0; i < entry_count; ++i)
+    {
+        MSTRING_SIZE_T size = entries[i].length + 1;
+        MSTRING_MEMCPY(new_data + at, data + entries[i].offset, size);
+        entries[i].offset = at;
+        at += size;
+    }
+    MSTRING_ASSERT(at == new_length);
+    if (data) MSTRING_FREE(data);
+    data = new_data;
+    data_length = data_capacity = new_length;
+    wasted = 0;
+}
+
+bool MStringTable::Validate() const
+{
+    for (MSTRING_SIZE_T i = 0; i < entry_count; ++i)
+    {
+        unsigned long long offset = entries[i].offset, length = entries[i].length;
+        if (offset >= data_length || data_length - offset <= length || data[offset + length] != '\0') return false;
+    }
+    return true;
+}
+
+#ifndef MSTRING_NO_FILES
+bool MStringTable::Save(const char* path) const
+{
+    FILE* out = fopen(path, "wb");
+    if (!out) return false;
+    MStringTableHeader header = {};
+    MSTRING_MEMCPY(header.magic, mstring_table_magic, sizeof(header.magic));
+    header.version = MStringTableVersion;
+    header.byte_order = MStringTableByteOrder;
+    header.count = entry_count;
+    header.data_length = data_length - wasted;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    if (wasted == 0)
+    {
+        if (ok && entry_count) ok = fwrite(entries, sizeof(Entry), (size_t)entry_count, out) == (size_t)entry_count;
+        if (ok && data_length) ok = fwrite(data, 1, (size_t)data_length, out) == (size_t)data_length;
+    }
+    else
+    {
+        // Write the index with the offsets that it would have after Compact(), a chunk at a time, and
+        // then the strings in the same order.
+        Entry chunk[1024];
+        unsigned long long offset = 0;
+        for (MSTRING_SIZE_T start = 0; ok && start < entry_count; start += 1024)
+        {
+            size_t count = (size_t)((entry_count - start < 1024) ? entry_count - start : 1024);
+            for (size_t i = 0; i < count; ++i)
+            {
+                chunk[i].offset = offset;
+                chunk[i].length = entries[start + i].length;
+                offset += chunk[i].length + 1ull;
+            }
+            ok = fwrite(chunk, sizeof(Entry), count, out) == count;
+        }
+        for (MSTRING_SIZE_T i = 0; ok && i < entry_count; ++i)
+        {
+            size_t size = (size_t)entries[i].length + 1;
+            ok = fwrite(data + entries[i].offset, 1, size, out) == size;
+        }
+    }
+    return (fclose(out) == 0) && ok;
+}
+
+bool MStringTable::Load(const char* path)
+{
+    MStringMappedFile new_file;
+    if (!new_file.Open(path)) return false;
+    IString contents = new_file.Contents();
+    MStringTableHeader header;
+    if (contents.Length() < sizeof(header)) return false;
+    MSTRING_MEMCPY(&header, contents.Ptr(), sizeof(header));
+    if (MSTRING_MEMCMP(header.magic, mstring_table_magic, sizeof(header.magic)) != 0 ||
+        header.version != MStringTableVersion || header.byte_order != MStringTableByteOrder) return false;
+    unsigned long long rest = contents.Length() - sizeof(header);
+    if (header.count > rest / sizeof(Entry) || header.data_length != rest - header.count * sizeof(Entry)) return false;
+#ifndef _WIN32
+    // The mapped file asks for sequential reads, but tables mostly get read at random.
+    madvise((void*)contents.Ptr(), (size_t)contents.Length(), MADV_NORMAL);
+#endif
+
+    Clear();
+    file = static_cast<MStringMappedFile&&>(new_file);
+    entries = (Entry*)(contents.Ptr() + sizeof(header));
+    data = (char*)(contents.Ptr() + sizeof(header) + header.count * sizeof(Entry));
+    entry_count = (MSTRING_SIZE_T)header.count;
+    data_length = (MSTRING_SIZE_T)header.data_length;
+    mapped = true;
+    return true;
+}
+#endif
+
+#endif
@@ -4,6 +4,9 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <map>
+#include <thread>
 
 // Just runs a few basic sanity checks for MString and IString. Doesn't test every edge-case,
 // doesn't validate that move/copy semantics are correct, and doesn't do any checking for
@@ -13,7 +16,7 @@ int main()
     printf("MString properties: Size of length type: %lld\n"
     "Size of structure: %lld\n"
     "Maximum short string length: %lld\n",
-    sizeof(MString::MaxShortLength), sizeof(MString), (size_t)MString::MaxShortLength);
+    (long long)sizeof(MString::MaxShortLength), (long long)sizeof(MString), (long long)MString::MaxShortLength);
 
     printf("Testing Default Initialization:\n");
     {
@@ -81,13 +84,75 @@ int main()
 
         MString another = MString("SomePath").Prepend('\\').Prepend("MyFavoriteUser").Prepend('\\').Prepend("Users").Prepend("C:\\");
         assert(appended == another);
+
+        // Chains that start from lvalues, prepend onto a temporary, or mix in IStrings.
+        MString user = "MyFavoriteUser";
+        MString path = user + '\\' + IString("SomePath", 4) + "Path";
+        assert(path == "MyFavoriteUser\\SomePath" && user == "MyFavoriteUser");
+        assert(MString("C:\\Users\\" + path) == "C:\\Users\\MyFavoriteUser\\SomePath");
+        assert(MString("C:\\" + user + '\\' + MString("SomePath")) == "C:\\MyFavoriteUser\\SomePath");
+        assert(MString(user + user) == "MyFavoriteUserMyFavoriteUser");
+        assert(MString(MString("short") + " and" + '!') == "short and!");
+        assert(MStringConcat("C:\\Users", '\\', user, IString("\\SomePath")) == appended);
+        assert(MStringConcat(user) == user && MStringConcat("") == "");
+
+        // Later temporaries get copied in straight away, so a chain kept with auto doesn't point at them
+        // after they're gone.
+        MString folder = "SomeFolderWithALongEnoughName";
+        auto both = MString(user) + MString(folder);
+        auto middle = '\\' + MString(user) + MString(folder) + '\\';
+        auto chained = user + '\\' + MString(folder) + MString64(user) + (user + folder);
+        assert(MString(static_cast<decltype(both)&&>(both)) == MStringConcat(user, folder));
+        assert(MString(static_cast<decltype(middle)&&>(middle)) == MStringConcat('\\', user, folder, '\\'));
+        assert(MString(static_cast<decltype(chained)&&>(chained)) == MStringConcat(user, '\\', folder, user, user, folder));
+
+        // A chain can still be used as a string in the statement that made it, like the MString it turns into.
+        auto view = [](IString str) {return str;};
+        assert(view(user + folder) == MStringConcat(user, folder));
+        assert((user + '\\' + folder) == MStringConcat(user, '\\', folder) && "C:" + user != user);
+        assert(user < (user + folder) && (user + folder) >= user && (MString(folder) + user) > "Some");
+        assert(strcmp((MString("C:") + '\\' + user).Ptr(), "C:\\MyFavoriteUser") == 0);
+        assert(MString(user + (MString(user) + folder)) == MStringConcat(user, user, folder));
+        MString64 wide = user + '\\' + folder;
+        assert(wide == MStringConcat(user, '\\', folder));
+
+        // A chain only allocates once, no matter how many pieces it has.
+        struct CountingAllocator : MStringAllocator
+        {
+            int allocations = 0;
+            void* Allocate(MSTRING_SIZE_T size) override {++allocations; return malloc(size);}
+            void* Reallocate(void* ptr, MSTRING_SIZE_T, MSTRING_SIZE_T new_size) override {++allocations; return realloc(ptr, new_size);}
+            void Free(void* ptr, MSTRING_SIZE_T) override {free(ptr);}
+        } counter;
+        {
+            MStringAllocatorScope scope(&counter);
+            MString chained = MString("C:\\") + "Users" + '\\' + user + '\\' + "Documents" + '\\' + "SomePath";
+            assert(chained == "C:\\Users\\MyFavoriteUser\\Documents\\SomePath" && counter.allocations == 1);
+            assert(chained.Capacity() == chained.Length());
+            MString concatenated = MStringConcat(chained, '\\', user, '\\', "SomeFile.txt");
+            assert(concatenated.Length() == chained.Length() + 28 && counter.allocations == 2);
+        }
     }
 
     printf("Testing insert:\n");
     {
         MString test = "some string wherewas inserted.";
-        test.Insert(17, "another string ");
+        test.Insert(17, " another string ");
         assert(test == "some string where another string was inserted.");
+
+        // Inserting part of a string into itself, from before, across, and after the insertion point.
+        MString self = "0123456789";
+        self.Insert(5, self.Ptr() + 1, 3);
+        assert(self == "0123412356789");
+        self = "0123456789";
+        self.Insert(5, self.Ptr() + 3, 4);
+        assert(self == "01234345656789");
+        self = "0123456789";
+        self.Insert(2, self.Ptr() + 6, 4);
+        assert(self == "01678923456789");
+        self = "a string that is long enough to move when it grows";
+        self += self;
+        assert(self == "a string that is long enough to move when it growsa string that is long enough to move when it grows");
     }
 
     printf("Testing non-ascii characters and null bytes:\n");
@@ -100,5 +165,974 @@ int main()
         assert(str.Length() > 10);
     }
 
+    printf("Testing custom allocators:\n");
+    {
+        MStringArena arena(256);
+        MString outside = "This string is long enough to go on the heap, but it was made outside of the scope.";
+        {
+            MStringAllocatorScope scope(&arena);
+            MString str = "short";
+            assert(str.Allocator() == nullptr);
+            str += " string that grows until it needs to move onto the heap";
+            assert(str.IsHeap() && str.Allocator() == &arena);
+
+            // Growing the newest allocation should happen in place.
+            const char* before = str.Ptr();
+            str.ExpandIfNeeded(str.Capacity() + 8);
+            assert(str.Ptr() == before);
+
+            MString copy = outside;
+            assert(copy == outside && copy.Allocator() == &arena);
+            MString moved = static_cast<MString&&>(copy);
+            assert(moved == outside && moved.Allocator() == &arena && copy.Length() == 0);
+
+            // Outgrowing a block should still work, and the string keeps its allocator after the scope ends.
+            for (int i = 0; i < 20; ++i) str += " and some more";
+            outside = str;
+            assert(outside == str);
+        }
+        assert(outside.Allocator() == &arena);
+        outside += "!";
+        outside.SetLength(4);
+        outside.ShrinkToFit();
+        assert(!outside.IsHeap() && outside == "shor");
+    }
+
+    printf("Testing string interning:\n");
+    {
+        for (int thread_safe = 0; thread_safe < 2; ++thread_safe)
+        {
+            MStringInternTable table(thread_safe != 0);
+            IAtom a = table.Intern("Content-Type");
+            IAtom b = table.Intern(MString(MString("Content-") + "Type"));
+            IAtom c = table.Intern("Content-Length");
+            assert(a == b && a != c && a.Ptr() == b.Ptr());
+            assert(a.Length() == 12 && a.Hash() == MStringHash("Content-Type", 12) && (IString)a == "Content-Type");
+            assert(table.Find("Content-Length") == c && !table.Find("Accept"));
+            assert(table.Intern("") != IAtom() && table.Intern("").Length() == 0);
+
+            // Enough strings to make the table grow a few times, and to overflow an arena block.
+            char buffer[64];
+            for (int i = 0; i < 5000; ++i) table.Intern(IString(buffer, snprintf(buffer, sizeof(buffer), "key number %d", i)));
+            assert(table.Count() == 5003);
+            assert(table.Find("key number 1234") == table.Intern("key number 1234") && table.Intern("Content-Type") == a);
+        }
+    }
+
+    printf("Testing sorting and deduplication:\n");
+    {
+        // Prefixes, zero bytes and empty strings.
+        IString small[] = {"banana", "apple", "", "app", "apple", IString("ab\0c", 4), IString("ab\0", 3), "ab", "banana", "b"};
+        IString expected[] = {"", "ab", IString("ab\0", 3), IString("ab\0c", 4), "app", "apple", "apple", "b", "banana", "banana"};
+        MStringSort(small, 10);
+        for (int i = 0; i < 10; ++i) assert(small[i] == expected[i] && small[i].Length() == expected[i].Length());
+        assert(MStringUnique(small, 10) == 8 && small[5] == "apple" && small[6] == "b" && small[7] == "banana");
+
+        MStringCompact compact[] = {MStringCompact("a string that goes on the heap"), MStringCompact("short"), MStringCompact("a string")};
+        MStringSort(compact, 3);
+        assert(compact[0] == "a string" && compact[1] == "a string that goes on the heap" && compact[2] == "short");
+
+        // Enough strings for the parallel mode to kick in, with long shared prefixes, lots of duplicates,
+        // and lengths on both sides of every 8 byte window.
+        const int count = 100000;
+        MString* strings = new MString[count];
+        MString* originals = new MString[count];
+        IString* views = new IString[count];
+        unsigned int seed = 1, hashes = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            MString& str = strings[i];
+            str = (seed >> 28 & 1) ? "module/component/with/a/long/shared/path/" : "key";
+            unsigned int number = (seed >> 8) % 2000;
+            str.AppendUInt(number);
+            str.Append("\0.\0.\0.\0.\0.\0.\0.\0.\0.\0.\0.\0.", number % 24);
+            originals[i] = str;
+            views[i] = originals[i];
+            hashes += str.Hash();
+        }
+        auto in_order = [](IString a, IString b)
+        {
+            int result = memcmp(a.Ptr(), b.Ptr(), (a.Length() < b.Length()) ? a.Length() : b.Length());
+            return result < 0 || (result == 0 && a.Length() <= b.Length());
+        };
+        MStringSort(views, count);
+        MStringSort(strings, count, true);
+        unsigned int sorted_hashes = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            assert(strings[i] == views[i]);
+            assert(i == 0 || in_order(views[i - 1], views[i]));
+            sorted_hashes += strings[i].Hash();
+        }
+        assert(sorted_hashes == hashes);
+
+        MSTRING_SIZE_T unique = MStringUnique(strings, count);
+        assert(unique < count / 2 && MStringUnique(views, count) == unique);
+        for (MSTRING_SIZE_T i = 1; i < unique; ++i) assert(strings[i - 1] != strings[i] && !in_order(strings[i], strings[i - 1]));
+        assert(strings[count - 1].Length() == 0);
+        delete[] strings;
+        delete[] originals;
+        delete[] views;
+    }
+
+    printf("Testing hashing:\n");
+    {
+        // Every length up to a few long-hash blocks, so that all of the tail handling gets exercised.
+        char buffer[3000];
+        for (int i = 0; i < (int)sizeof(buffer); ++i) buffer[i] = (char)(i * 7 + (i >> 5));
+        for (MSTRING_SIZE_T len = 0; len < sizeof(buffer); len += (len < 300) ? 1 : 37)
+        {
+            IString str(buffer, len);
+            assert(str.Hash() == MStringHash(buffer, len) && MStringConstHash(buffer, len) == str.Hash());
+            assert(MString(str).Hash() == str.Hash());
+            if (len) assert(IString(buffer + 1, len).Hash() != str.Hash());
+        }
+        assert(MStringHash("abc", 3, 1) != MStringHash("abc", 3, 2));
+        assert(std::hash<IString>()("key") == std::hash<MString>()(MString("key")));
+
+        auto view = [](const MString& str) {return IString(str.Ptr(), str.Length());};
+        MString str = "A heap string that is long enough to have its hash cached.";
+        unsigned int hash = str.Hash();
+        assert(str.Hash() == hash);
+        str[0] = 'B';
+        assert(str.Hash() != hash && str.Hash() == view(str).Hash());
+        hash = str.Hash();
+        str.Insert(1, "xyz");
+        assert(str.Hash() == view(str).Hash());
+        str.Remove(1, 3);
+        assert(str.Hash() == hash);
+
+        MString other = str;
+        other[other.Length() - 1] = '!';
+        other.Hash();
+        assert(str != other);
+        other[other.Length() - 1] = '.';
+        assert(str == other);
+
+        // A short string that moves to the heap has its old characters in the padding, which mustn't
+        // look like a cached hash.
+        MString moved = "A short string, full up";
+        moved.Reserve(100);
+        assert(moved.Hash() == view(moved).Hash());
+
+        // Const strings can be hashed from several threads at once, like keys in a shared map.
+        const MString shared = "A heap string that several threads look up at the same time.";
+        std::thread threads[4];
+        bool matched[4] = {};
+        for (int i = 0; i < 4; ++i) threads[i] = std::thread([&shared, &matched, i]() {matched[i] = shared.Hash() == MStringHash(shared.Ptr(), shared.Length()) && shared == shared;});
+        for (int i = 0; i < 4; ++i) threads[i].join();
+        assert(matched[0] && matched[1] && matched[2] && matched[3]);
+
+        // Copying is a const read too, and with MSTRING_COPY_ON_WRITE a copy takes the cached hash along.
+        const MString copied = "A heap string that some threads hash while others copy it.";
+        for (int i = 0; i < 4; ++i)
+        {
+            threads[i] = std::thread([&copied, &matched, i]()
+            {
+                if (i % 2) {matched[i] = copied.Hash() == MStringHash(copied.Ptr(), copied.Length()); return;}
+                MString copy = copied;
+                matched[i] = copy == copied && copy.Hash() == MStringHash(copy.Ptr(), copy.Length());
+            });
+        }
+        for (int i = 0; i < 4; ++i) threads[i].join();
+        assert(matched[0] && matched[1] && matched[2] && matched[3]);
+    }
+
+    printf("Testing compile-time literals:\n");
+    {
+        constexpr IString key = "Content-Type"_is;
+        static_assert(key.Length() == 12 && "a\0b"_is.Length() == 3 && ""_is.Length() == 0, "literal lengths");
+        constexpr unsigned int hash = "Content-Type"_hash;
+        static_assert(hash != "Content-Length"_hash && hash == MStringConstHash("Content-Type", 12), "literal hashes");
+        assert(key == "Content-Type" && hash == key.Hash() && hash == MStringHash("Content-Type", 12));
+
+        // A long literal takes the other hash path.
+        #define MSTRING_TEST_64 "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        constexpr unsigned int long_hash = MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 "!"_hash;
+        assert(long_hash == IString(MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 MSTRING_TEST_64 "!").Hash());
+        #undef MSTRING_TEST_64
+
+        auto classify = [](IString header)
+        {
+            switch (header.Hash())
+            {
+                case "Content-Type"_hash:   if (header == "Content-Type"_is) return 1; break;
+                case "Content-Length"_hash: if (header == "Content-Length"_is) return 2; break;
+                case "Accept"_hash:         if (header == "Accept"_is) return 3; break;
+            }
+            return 0;
+        };
+        MString header = "Content-";
+        header += "Length"_is;
+        assert(classify(header) == 2 && classify("Accept") == 3 && classify("Content-Type") == 1 && classify("Accepts") == 0);
+        assert((MString("Accept"_is) + "-Language"_is).Length() == 15 && header.StartsWith("Content"_is));
+    }
+
+    printf("Testing searching:\n");
+    {
+        IString text = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n\r\n";
+        assert(text.Find('\r') == 24 && text.Find('\r', 25) == 43 && text.RFind('\r') == 58 && text.Find('#') == MStringNotFound);
+        assert(text.Find("\r\n\r\n") == 56 && text.Find("Host:") == 26 && text.Find("HTTP", 20) == MStringNotFound);
+        assert(text.RFind("\r\n") == 58 && text.RFind("GET") == 0 && text.RFind("POST") == MStringNotFound);
+        assert(text.FindAnyOf(":/") == 4 && text.FindAnyOf("\r\n", 30) == 43 && text.FindNotOf("GET /") == 5);
+        assert(text.Count('\n') == 4 && text.Count("\r\n") == 4 && text.Count("*") == 2);
+        assert(text.StartsWith("GET ") && text.EndsWith("\r\n\r\n") && !text.StartsWith("POST") && text.Contains("index"));
+        assert(IString().Find('a') == MStringNotFound && IString().Find("") == 0 && text.Find("", 10) == 10);
+
+        MString mstring = "key=value; other=thing";
+        assert(mstring.Find('=') == 3 && mstring.Find("other") == 11 && mstring.Count('=') == 2 && mstring.EndsWith("thing"));
+
+        // Compare against simple loops on inputs with a tiny alphabet, so that there are lots of partial matches.
+        char haystack[600], needle[40];
+        unsigned seed = 12345;
+        auto random = [&seed]() {seed = seed * 1103515245u + 12345u; return (seed >> 16) & 0x7fff;};
+        for (int round = 0; round < 400; ++round)
+        {
+            MSTRING_SIZE_T n = random() % sizeof(haystack), m = 1 + random() % ((round % 4 == 0) ? 3 : sizeof(needle) - 1);
+            for (MSTRING_SIZE_T i = 0; i < n; ++i) haystack[i] = (round % 8 == 0) ? 'a' : (char)('a' + random() % 3);
+            for (MSTRING_SIZE_T i = 0; i < m; ++i) needle[i] = (round % 8 == 0 && i + 1 < m) ? 'a' : (char)('a' + random() % 3);
+            IString h(haystack, n), s(needle, m);
+
+            MSTRING_SIZE_T expected = MStringNotFound, expected_last = MStringNotFound;
+            for (MSTRING_SIZE_T i = 0; i + m <= n; ++i)
+            {
+                if (memcmp(haystack + i, needle, m) != 0) continue;
+                if (expected == MStringNotFound) expected = i;
+                expected_last = i;
+            }
+            assert(h.Find(s) == expected && h.RFind(s) == expected_last);
+            assert(MStringTwoWay<false>(haystack, n, needle, m) == expected && MStringTwoWay<true>(haystack, n, needle, m) == expected_last);
+
+            MSTRING_SIZE_T expected_any = MStringNotFound, expected_not = MStringNotFound, expected_count = 0;
+            for (MSTRING_SIZE_T i = 0; i < n; ++i)
+            {
+                bool in_set = memchr(needle, haystack[i], (m < 9) ? m : 9) != nullptr;
+                if (in_set && expected_any == MStringNotFound) expected_any = i;
+                if (!in_set && expected_not == MStringNotFound) expected_not = i;
+                expected_count += (haystack[i] == needle[0]);
+            }
+            IString set(needle, (m < 9) ? m : 9);
+            assert(h.FindAnyOf(set) == expected_any && h.FindNotOf(set) == expected_not && h.Count(needle[0]) == expected_count);
+        }
+
+        // Periodic needles make every position a near-match, which used to make RFind() quadratic. It
+        // hands off to Two-Way (backwards) like Find() does, so these have to agree with the simple loop.
+        MString periodic = {};
+        for (int i = 0; i < 5000; ++i) periodic.Append('a');
+        MString tail = MString(IString(periodic.Ptr(), 300)).Append('b');
+        assert(periodic.RFind(tail) == MStringNotFound && periodic.Find(tail) == MStringNotFound);
+        periodic.Insert(1000, "b");
+        assert(periodic.RFind(tail) == 700 && periodic.Find(tail) == 700);
+        assert(periodic.RFind(IString(tail.Ptr() + 1, 300)) == 701);
+
+        // Bytes with the high bit set go through a different lookup table in the vectorized set search.
+        char bytes[256];
+        for (int i = 0; i < 256; ++i) bytes[i] = (char)i;
+        IString all(bytes, 256);
+        for (int i = 0; i < 256; ++i) assert(all.FindAnyOf(IString(bytes + i, 1)) == (MSTRING_SIZE_T)i);
+        assert(all.FindNotOf(IString(bytes, 200)) == 200 && all.FindAnyOf("\xfe\x90\x85") == 0x85);
+    }
+
+    printf("Testing case, trimming and replacing:\n");
+    {
+        MString header = "  Content-Type: Text/HTML; charset=UTF-8 \xc3\x89t\xc3\xa9 @[`{\r\n";
+        header.ToLower();
+        assert(header == "  content-type: text/html; charset=utf-8 \xc3\x89t\xc3\xa9 @[`{\r\n");
+        header.ToUpper();
+        assert(header == "  CONTENT-TYPE: TEXT/HTML; CHARSET=UTF-8 \xc3\x89T\xc3\xa9 @[`{\r\n");
+
+        // Every byte value, at every offset, so that each one goes through the vector and scalar paths.
+        char bytes[300];
+        for (int i = 0; i < 300; ++i) bytes[i] = (char)(i + 7);
+        for (int start = 0; start < 40; ++start)
+        {
+            MString lower(bytes + start, 300 - start), upper = lower;
+            lower.ToLower();
+            upper.ToUpper();
+            for (MSTRING_SIZE_T i = 0; i < lower.Length(); ++i)
+            {
+                char c = bytes[start + i];
+                assert(lower[i] == ((c >= 'A' && c <= 'Z') ? c + 32 : c) && upper[i] == ((c >= 'a' && c <= 'z') ? c - 32 : c));
+            }
+        }
+
+        IString padded = " \t\r\n value with  spaces \v\f";
+        assert(padded.Trim() == "value with  spaces" && padded.TrimLeft() == "value with  spaces \v\f" && padded.TrimRight() == " \t\r\n value with  spaces");
+        assert(IString("   ").Trim().Length() == 0 && IString().Trim().Length() == 0 && IString("x").Trim() == "x");
+        MString trimmed = "\n\n  a heap string that is long enough to be on the heap\t ";
+        trimmed.Trim();
+        assert(trimmed == "a heap string that is long enough to be on the heap");
+        trimmed = "  left";
+        assert(trimmed.TrimRight() == "  left" && trimmed.TrimLeft() == "left");
+        trimmed = " \t ";
+        assert(trimmed.Trim().Length() == 0 && trimmed == "");
+
+        MString replaced = "Hello {name}, welcome to {place}. Bye {name}!";
+        replaced.ReplaceAll("{name}", "Frog").ReplaceAll("{place}", "the pond");
+        assert(replaced == "Hello Frog, welcome to the pond. Bye Frog!");
+        replaced.ReplaceAll("o", "").ReplaceAll("", "x").ReplaceAll("missing", "y");
+        assert(replaced == "Hell Frg, welcme t the pnd. Bye Frg!");
+        replaced = "aaaaa";
+        assert(replaced.ReplaceAll("aa", "b") == "bba" && replaced.ReplaceAll("b", "a long replacement ") == "a long replacement a long replacement a");
+        replaced.ReplaceAll("a long replacement ", "s");
+        assert(replaced == "ssa" && replaced.Length() == 3);
+
+        // Pieces that point into the string itself.
+        replaced = "abcabcabc";
+        replaced.ReplaceAll(IString(replaced.Ptr(), 3), IString(replaced.Ptr() + 1, 1));
+        assert(replaced == "bbb");
+        replaced = "x-y-z, and then some more to go on the heap";
+        replaced.ReplaceAll(IString(replaced.Ptr() + 1, 1), IString(replaced.Ptr(), 3));
+        assert(replaced == "xx-yyx-yz, and then some more to go on the heap");
+
+        MString original = "a shared heap string, and another shared one", copy = original;
+        copy.ReplaceAll("shared", "own");
+        assert(original == "a shared heap string, and another shared one" && copy == "a own heap string, and another own one");
+
+        // Heap strings keep their allocator, even when they grow.
+        MStringArena arena;
+        {
+            MStringAllocatorScope scope(&arena);
+            replaced = MString("a string that is long enough to live in the arena");
+        }
+        replaced.ReplaceAll(" ", "___");
+        assert(replaced.Allocator() == &arena && replaced == "a___string___that___is___long___enough___to___live___in___the___arena");
+        replaced.Free();
+
+        // Compare against the quadratic loop of Remove() and Insert() that ReplaceAll() replaces.
+        unsigned seed = 777;
+        auto random = [&seed]() {seed = seed * 1103515245u + 12345u; return (seed >> 16) & 0x7fff;};
+        for (int round = 0; round < 300; ++round)
+        {
+            char text[200], from[4], to[6];
+            MSTRING_SIZE_T n = random() % sizeof(text), m = 1 + random() % sizeof(from), k = random() % sizeof(to);
+            for (MSTRING_SIZE_T i = 0; i < n; ++i) text[i] = (char)('a' + random() % 2);
+            for (MSTRING_SIZE_T i = 0; i < m; ++i) from[i] = (char)('a' + random() % 2);
+            for (MSTRING_SIZE_T i = 0; i < k; ++i) to[i] = (char)('a' + random() % 3);
+
+            MString expected(text, n), actual(text, n);
+            for (MSTRING_SIZE_T i = expected.Find(IString(from, m)); i != MStringNotFound; i = expected.Find(IString(from, m), i + k))
+            {
+                expected.Remove(i, m).Insert(i, to, k);
+            }
+            actual.ReplaceAll(IString(from, m), IString(to, k));
+            assert(actual == expected);
+        }
+    }
+
+    printf("Testing comparison and ordering:\n");
+    {
+        IString apple = "apple", apricot = "apricot", app = "app";
+        assert(apple.Compare(apricot) < 0 && apricot.Compare(apple) > 0 && apple.Compare("apple") == 0 && app.Compare(apple) < 0);
+        assert(app < apple && apple < apricot && apricot > "apple" && "apple" <= apple && "b" >= apricot && !(apple < apple));
+        assert(IString().Compare(IString()) == 0 && IString().Compare(app) < 0 && IString("\xff").Compare("\x01") > 0);
+
+        // Short strings with leftovers from longer contents past their length, which mustn't matter.
+        MString a = "same prefix, different tail", b = "same prefix";
+        a.SetLength(11);
+        assert(a == b && !(a < b) && !(b < a) && a.Compare(b) == 0 && a <= b && a >= b);
+        a.Append('!');
+        b.Append('?');
+        assert(a != b && a < b && b > a && a < "same prefix?" && "same prefix?" > a && IString("same prefix") < a);
+        MString64 long_inline = "a short string for MString64, but a heap one for MString";
+        MString heap(long_inline);
+        assert(long_inline == heap && !(heap < long_inline) && heap.Compare(long_inline) == 0 && MString(b) > heap);
+
+        // Compare against memcmp() for every combination of short and heap strings, with lengths on
+        // both sides of every load size, and every byte value.
+        unsigned seed = 4242;
+        auto random = [&seed]() {seed = seed * 1103515245u + 12345u; return (seed >> 16) & 0x7fff;};
+        for (int round = 0; round < 20000; ++round)
+        {
+            char x[300], y[300];
+            MSTRING_SIZE_T n = random() % ((round % 4) ? 40 : 300), m = (round % 3) ? n : random() % 40;
+            for (MSTRING_SIZE_T i = 0; i < n; ++i) x[i] = (char)random();
+            for (MSTRING_SIZE_T i = 0; i < m; ++i) y[i] = (i < n && random() % 8) ? x[i] : (char)random();
+            MSTRING_SIZE_T common = (n < m) ? n : m;
+            int expected = memcmp(x, y, common);
+            if (expected == 0) expected = (n < m) ? -1 : (n > m) ? 1 : 0;
+            expected = (expected > 0) - (expected < 0);
+
+            IString ix(x, n), iy(y, m);
+            MString mx(ix), my(iy);
+            MString64 wx(ix), wy(iy);
+            MStringCompact cx(ix), cy(iy);
+            auto sign = [](int value) {return (value > 0) - (value < 0);};
+            assert(sign(ix.Compare(iy)) == expected && sign(mx.Compare(my)) == expected && sign(wx.Compare(wy)) == expected);
+            assert(sign(cx.Compare(cy)) == expected && sign(mx.Compare(wy)) == expected && sign(cx.Compare(iy)) == expected);
+            assert((ix == iy) == (expected == 0) && (mx == my) == (expected == 0) && (wx == wy) == (expected == 0) && (cx == cy) == (expected == 0));
+            assert((mx < my) == (expected < 0) && (wx > wy) == (expected > 0) && (cx <= cy) == (expected <= 0) && (mx >= wy) == (expected >= 0));
+        }
+
+        std::map<MString, int> ordered;
+        ordered[MString("pear")] = 3;
+        ordered[MString("a long key that goes on the heap")] = 1;
+        ordered[MString("fig")] = 2;
+        ordered[MString("pear")] = 4;
+        assert(ordered.size() == 3 && ordered.begin()->second == 1 && ordered.rbegin()->second == 4);
+
+#ifdef MSTRING_THREE_WAY_COMPARE
+        assert((apple <=> apricot) < 0 && (a <=> b) < 0 && (b <=> a) > 0 && (heap <=> long_inline) == 0 && ("fig" <=> a) < 0);
+#endif
+    }
+
+    printf("Testing gap buffer editing:\n");
+    {
+        MStringEditor editor(IString("Hello world"));
+        assert(editor.Length() == 11 && editor.Cursor() == 11);
+        editor.Insert("!");
+        editor.SetCursor(5);
+        editor.Insert(",");
+        editor.Insert(' ');
+        editor.Erase(1);
+        assert(editor.Cursor() == 7 && editor[7] == 'w' && editor.Length() == 13);
+        assert((IString)editor == "Hello, world!");
+        editor.Insert(0, "Oh, ").Remove(4, 7).EraseBack(2);
+        assert(editor.Cursor() == 2 && (IString)editor == "Ohworld!" && editor.Cursor() == 8);
+        editor.SetCursor(2);
+        assert(strlen(editor) == 8 && editor.Cursor() == 8);
+        editor.SetCursor(2);
+        assert(editor == "Ohworld!" && MString("Ohworld!") == editor && editor != IString("Oh") && "Oh" < editor && editor.Cursor() == 8);
+
+        // Pasting the editor's own text, when the gap has to move past it, or grow.
+        MStringEditor pasted(IString("0123456789"));
+        pasted.Insert(2, pasted.Ptr() + 5, 3);
+        assert((IString)pasted == "0156723456789");
+        pasted.Insert(4, pasted.Ptr() + 2, 6);
+        assert((IString)pasted == "0156567234723456789");
+        pasted.Insert(pasted.Ptr() + 17, 2);
+        assert((IString)pasted == "015656723472345678989");
+        MString long_text = {};
+        while (long_text.Length() < 98) long_text.Append("0123456789");
+        long_text.SetLength(98);
+        MStringEditor grown{MString(long_text)};
+        grown.Insert(0, grown.Ptr(), 80);
+        assert(grown.Length() == 178 && (IString)grown == MStringConcat(IString(long_text.Ptr(), 80), long_text));
+
+        // Lots of edits around a wandering cursor, checked against plain MString inserts and removes.
+        MString expected = "The quick brown fox jumps over the lazy dog.";
+        MStringEditor edited{MString(expected)};
+        unsigned seed = 7;
+        for (int i = 0; i < 2000; ++i)
+        {
+            seed = seed * 1103515245u + 12345u;
+            MSTRING_SIZE_T at = (seed >> 8) % (expected.Length() + 1);
+            if ((seed >> 4) % 3 && expected.Length() > 0 && at < expected.Length())
+            {
+                MSTRING_SIZE_T count = 1 + (seed >> 20) % 4;
+                if (count > expected.Length() - at) count = expected.Length() - at;
+                expected.Remove(at, count);
+                edited.Remove(at, count);
+            }
+            else
+            {
+                expected.Insert(at, "insert");
+                edited.Insert(at, "insert");
+            }
+            assert(edited.Length() == expected.Length());
+        }
+        assert((IString)edited == expected);
+        MString taken = edited.Take();
+        assert(taken == expected && taken.Length() == expected.Length() && edited.Length() == 0);
+    }
+
+    printf("Testing number formatting and parsing:\n");
+    {
+        MString str = "n=";
+        str.AppendInt(-42).Append(' ').AppendUInt(18446744073709551615ull).Append(' ').AppendInt(-9223372036854775807ll - 1);
+        str.Append(' ').AppendHex(0xbeef).Append(' ').AppendHex(0x1f, 4).Append(' ').AppendInt(0);
+        assert(str == "n=-42 18446744073709551615 -9223372036854775808 beef 001f 0");
+
+        const char* doubles[] = {"0", "-0", "1", "0.1", "-2.5", "100", "123.456", "0.000001", "1e-7", "1e+21",
+                                 "100000000000000000000", "1.7976931348623157e+308", "5e-324", "inf", "-inf", "nan"};
+        for (const char* expected : doubles)
+        {
+            double value = 0.0;
+            assert(IString(expected).ParseDouble(&value) == strlen(expected));
+            MString formatted = {};
+            formatted.AppendDouble(value);
+            assert(formatted == expected);
+        }
+
+        // Shortest output still has to read back as exactly the same double.
+        unsigned long long seed = 12345;
+        for (int i = 0; i < 100000; ++i)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            double value;
+            memcpy(&value, &seed, sizeof(value));
+            if (value != value) continue;
+            MString formatted = {};
+            formatted.AppendDouble(value);
+            double parsed;
+            assert(formatted.ParseDouble(&parsed) == formatted.Length() && memcmp(&parsed, &value, sizeof(value)) == 0);
+        }
+
+        long long i = 7;
+        unsigned long long u = 7;
+        double d = 7.0;
+        assert(IString("-123abc").ParseInt(&i) == 4 && i == -123);
+        assert(IString("+9223372036854775807").ParseInt(&i) == 20 && i == 9223372036854775807ll);
+        assert(IString("-9223372036854775808").ParseInt(&i) == 20 && i == -9223372036854775807ll - 1);
+        assert(IString("9223372036854775808").ParseInt(&i) == 0 && i == -9223372036854775807ll - 1);
+        assert(IString("18446744073709551615").ParseUInt(&u) == 20 && u == 18446744073709551615ull);
+        assert(IString("18446744073709551616").ParseUInt(&u) == 0 && IString("-1").ParseUInt(&u) == 0);
+        assert(IString("").ParseInt(&i) == 0 && IString("-").ParseInt(&i) == 0 && IString(" 1").ParseInt(&i) == 0);
+
+        // No null terminator needed, and nothing past the end gets read.
+        assert(IString("12345", 3).ParseInt(&i) == 3 && i == 123);
+        assert(IString("1.5e10", 4).ParseDouble(&d) == 3 && d == 1.5);
+        assert(IString(".5").ParseDouble(&d) == 2 && d == 0.5 && IString("5.").ParseDouble(&d) == 2 && d == 5.0);
+        assert(IString("2e").ParseDouble(&d) == 1 && d == 2.0 && IString("2e+x").ParseDouble(&d) == 1);
+        assert(IString("-.e1").ParseDouble(&d) == 0 && IString("e1").ParseDouble(&d) == 0 && IString("infinite").ParseDouble(&d) == 3);
+        assert(IString("1e400").ParseDouble(&d) == 5 && d > 1.7976931348623157e308 && IString("1e-400").ParseDouble(&d) == 6 && d == 0.0);
+        assert(IString("0.30000000000000004").ParseDouble(&d) == 19 && d == 0.1 + 0.2);
+        assert(IString("9007199254740993").ParseDouble(&d) == 16 && d == 9007199254740992.0);
+        assert(IString("9007199254740993000000000000000000000001e-24").ParseDouble(&d) == 44 && d == 9007199254740994.0);
+    }
+
+    printf("Testing UTF-8:\n");
+    {
+        const char* text = (const char*)u8"Hello, مرحبا بالعالم, 你好, 😀!";
+        IString str = text;
+        assert(str.IsValidUTF8() && str.CountCodepoints() == 28 && str.UTF16Length() == 29);
+        char32_t utf32[128];
+        char16_t utf16[128];
+        assert(str.ToUTF32(utf32) == 28 && utf32[7] == U'م' && utf32[26] == U'😀' && utf32[27] == U'!');
+        assert(str.ToUTF16(utf16) == 29 && utf16[26] == 0xD83D && utf16[27] == 0xDE00);
+        MString round_trip = {};
+        round_trip.AppendUTF16(utf16, 29);
+        assert(round_trip == str);
+        round_trip.SetLength(0);
+        round_trip.AppendUTF32(utf32, 28);
+        assert(round_trip == str);
+
+        char32_t decoded[64];
+        int count = 0;
+        for (char32_t c : str.Codepoints()) decoded[count++] = c;
+        assert(count == 28 && memcmp(decoded, utf32, sizeof(char32_t) * 28) == 0);
+
+        // Invalid sequences, each at every offset, to cross block boundaries in the SIMD validators.
+        const char* invalid[] = {"\x80", "\xBF", "\xC0\x80", "\xC1\xBF", "\xC2", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xED\xA0\x80",
+                                 "\xED\xBF\xBF", "\xE1\x80", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", "\xF4\x90\x80\x80",
+                                 "\xF5\x80\x80\x80", "\xF1\x80\x80", "\xFF", "\xC2\x80\x80", "\xE1\x80\x80\x80"};
+        const char* valid[] = {"\x7F", "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+                               "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF", "\xF3\xBF\xBF\xBF"};
+        char padding[70];
+        memset(padding, 'a', sizeof(padding));
+        for (int offset = 0; offset < 70; ++offset)
+        {
+            for (const char* sequence : invalid)
+            {
+                MString test = MString(MString(padding, offset) + sequence + "tail");
+                assert(!test.IsValidUTF8() && test.ToUTF32(utf32) == MStringNotFound && test.ToUTF16(utf16) == MStringNotFound);
+                test.SetLength(offset + strlen(sequence));
+                assert(!test.IsValidUTF8());
+            }
+            for (const char* sequence : valid)
+            {
+                MString test = MString(MString(padding, offset) + sequence + "tail");
+                assert(test.IsValidUTF8() && test.CountCodepoints() == (MSTRING_SIZE_T)offset + 5);
+                test.SetLength(offset + strlen(sequence));
+                assert(test.IsValidUTF8() && test.ToUTF32(utf32) == (MSTRING_SIZE_T)offset + 1);
+            }
+        }
+
+        // Random bytes, mostly ASCII and valid sequences so that long valid runs happen too.
+        unsigned long long seed = 54321;
+        char bytes[200];
+        char32_t* units = new char32_t[200];
+        for (int i = 0; i < 20000; ++i)
+        {
+            int length = 0;
+            while (length < (int)sizeof(bytes) - 4)
+            {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                unsigned kind = (unsigned)(seed >> 60), value = (unsigned)(seed >> 32);
+                if (kind < 8) bytes[length++] = (char)(value & 0x7F);
+                else if (kind < 15) length += (int)MStringEncodeUTF8(value % 0x110000, bytes + length);
+                else bytes[length++] = (char)value;
+                if ((seed & 0xFF) == 0) break;
+            }
+            IString test(bytes, length);
+            MSTRING_SIZE_T non_continuation = 0;
+            for (int j = 0; j < length; ++j) non_continuation += (bytes[j] & 0xC0) != 0x80;
+            assert(test.CountCodepoints() == non_continuation);
+            assert(test.IsValidUTF8() == (test.ToUTF32(units) != MStringNotFound));
+        }
+        delete[] units;
+
+        // Invalid input decodes as U+FFFD, one maximal subpart at a time.
+        count = 0;
+        for (char32_t c : IString("a\xF0\x9F\x98" "b\xED\xA0\x80\xC2").Codepoints()) decoded[count++] = c;
+        const char32_t expected[] = {U'a', 0xFFFD, U'b', 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD};
+        assert(count == 7 && memcmp(decoded, expected, sizeof(expected)) == 0);
+
+        MString encoded = {};
+        encoded.AppendCodepoint(U'é').AppendCodepoint(0xD800).AppendCodepoint(0x110000).AppendCodepoint(0x10FFFF);
+        assert(encoded == "\xC3\xA9\xEF\xBF\xBD\xEF\xBF\xBD\xF4\x8F\xBF\xBF");
+        const char16_t unpaired[] = {0xDC00, u'x', 0xD800};
+        encoded.SetLength(0);
+        encoded.AppendUTF16(unpaired, 3);
+        assert(encoded == "\xEF\xBF\xBDx\xEF\xBF\xBD" && encoded.IsValidUTF8());
+    }
+
+    printf("Testing splitting and files:\n");
+    {
+        const char* expected_lines[] = {"first", "", "third", "fourth", "", "last"};
+        const char* text = "first\n\nthird\r\nfourth\n\r\nlast";
+        int count = 0;
+        for (IString line : IString(text).Lines()) assert(line == IString(expected_lines[count++]));
+        assert(count == 6);
+
+        count = 0;
+        const char* expected_fields[] = {"a", "", "b c", ""};
+        MStringSplit fields = IString("a,,b c,,").Split(',');
+        IString field;
+        while (fields.Next(&field)) assert(field == IString(expected_fields[count++]));
+        assert(count == 4);
+        count = 0;
+        for (IString piece : IString("").Split(',')) count += piece.Length() + 1;
+        for (IString piece : IString("x\n").Lines()) count += (piece == "x");
+        for (IString piece : IString("\n").Lines()) count += (piece.Length() == 0);
+        assert(count == 2);
+
+#ifndef MSTRING_NO_FILES
+        // A file with a long line in the middle, so the reader has to grow its buffer, and lots of
+        // short ones that cross buffer boundaries.
+        const char* path = "MStringTests.tmp";
+        MString contents = {};
+        for (int i = 0; i < 500; ++i)
+        {
+            if (i == 250) for (int j = 0; j < 300; ++j) contents.Append("long");
+            contents.AppendInt(i).Append((i % 3) ? "\n" : "\r\n");
+        }
+        contents.Append("no newline at the end");
+        FILE* file = fopen(path, "wb");
+        assert(file && fwrite(contents.Ptr(), 1, contents.Length(), file) == contents.Length());
+        fclose(file);
+
+        MString read = "old contents";
+        assert(MStringReadFile(path, &read) && read == contents);
+#ifndef MSTRING_POOL
+        assert(read.Capacity() == contents.Length());
+#endif
+        MStringMappedFile mapped(path);
+        assert(mapped.IsOpen() && mapped.Contents() == contents);
+        MStringFileReader reader(64);
+        assert(reader.Open(path));
+        MStringSplit lines = mapped.Lines();
+        IString expected, line;
+        count = 0;
+        while (lines.Next(&expected))
+        {
+            assert(reader.NextLine(&line) && line == expected);
+            count++;
+        }
+        assert(count == 501 && !reader.NextLine(&line) && !reader.Failed());
+        assert(reader.Open(path) && reader.Next(&line, '\r') && line.Length() == 1 && line == "0");
+
+        MStringMappedFile moved = static_cast<MStringMappedFile&&>(mapped);
+        assert(!mapped.IsOpen() && moved.Contents() == contents);
+        moved.Close();
+        reader.Close();
+        file = fopen(path, "wb");
+        fclose(file);
+        assert(moved.Open(path) && moved.Contents().Length() == 0 && MStringReadFile(path, &read) && read.Length() == 0);
+        assert(reader.Open(path) && !reader.NextLine(&line));
+        moved.Close();
+        reader.Close();
+        remove(path);
+        assert(!moved.Open(path) && !reader.Open(path) && !MStringReadFile(path, &read));
+#endif
+    }
+
+    printf("Testing string tables:\n");
+    {
+        MStringTable table;
+        assert(table.Append("alpha") == 0 && table.Append(IString()) == 1 && table.Append(IString("nul\0byte", 8)) == 2);
+        assert(table.Count() == 3 && table[0] == "alpha" && table[1].Length() == 0 && table[2] == IString("nul\0byte", 8));
+        assert(table[0].Ptr()[5] == '\0' && table.DataLength() == 16 && table.WastedBytes() == 0);
+
+        // Strings that point into the table, while it grows.
+        for (int i = 0; i < 200; ++i) table.Append(table[i % 3]);
+        assert(table.Count() == 203 && table[202] == table[1] && table[201] == "alpha");
+
+        MString more[] = {MString("a string long enough to be on the heap"), MString("short")};
+        IString views[] = {"first view", more[1], table[0]};
+        table.Append(more, 2);
+        table.Append(views, 3);
+        assert(table.Count() == 208 && table[203] == more[0] && table[205] == "first view" && table[207] == "alpha");
+
+        table.Set(0, "alp");
+        table.Set(205, "a replacement that is longer than the string that it replaces");
+        table.Set(1, table[203]);
+        table.Remove(2);
+        assert(table[0] == "alp" && table[204] == "a replacement that is longer than the string that it replaces" && table[1] == more[0]);
+        assert(table.Count() == 207 && table[2] == "alpha" && table.WastedBytes() == 2 + 11 + 1 + 9 && table.Validate());
+        MSTRING_SIZE_T used = table.DataLength() - table.WastedBytes();
+        table.Compact();
+        assert(table.WastedBytes() == 0 && table.DataLength() == used && table[0] == "alp" && table[206] == "alpha" && table.Validate());
+
+#ifndef MSTRING_NO_FILES
+        // Save with garbage, load it back mapped, and check that a change copies it into memory.
+        table.Set(3, "x");
+        const char* path = "MStringTable.tmp";
+        assert(table.Save(path));
+        MStringTable loaded;
+        loaded.Append("replaced by the load");
+        assert(loaded.Load(path) && loaded.IsMapped() && loaded.Count() == table.Count() && loaded.Validate());
+        assert(loaded.DataLength() == table.DataLength() - table.WastedBytes());
+        for (MSTRING_SIZE_T i = 0; i < table.Count(); ++i) assert(loaded[i] == table[i]);
+        MStringTable moved = static_cast<MStringTable&&>(loaded);
+        assert(loaded.Count() == 0 && !loaded.IsMapped() && moved.IsMapped() && moved[3] == "x");
+        moved.Append(moved[1]);
+        assert(!moved.IsMapped() && moved[moved.Count() - 1] == more[0] && moved[0] == "alp");
+        moved.Clear();
+
+        // Empty tables, and files that aren't tables.
+        MStringTable empty;
+        assert(empty.Save(path) && empty.Load(path) && empty.Count() == 0 && empty.IsMapped() && empty.Validate());
+        empty.Clear();
+        FILE* file = fopen(path, "wb");
+        fputs("MStrTab but not really a table at all", file);
+        fclose(file);
+        assert(!empty.Load(path) && !empty.IsMapped());
+        remove(path);
+        assert(!empty.Load(path));
+#endif
+    }
+
+    printf("Testing buffer pool:\n");
+    {
+        // These pass either way, but sizes only get rounded up when the implementation has MSTRING_POOL.
+        MString str = "This string is long enough to need the heap";
+        MSTRING_SIZE_T capacity = str.Capacity();
+        assert(capacity >= str.Length());
+        str.SetLength(capacity);
+        assert(str.Capacity() == capacity);
+        str.ShrinkToFit();
+        str.ShrinkToFit();
+        assert(str.Capacity() >= str.Length() && str.Capacity() <= capacity);
+        str.SetLength(10);
+        str.ShrinkToFit();
+        assert(!str.IsHeap() && str == "This strin");
+#ifdef MSTRING_POOL
+        // Every buffer (headers included) is a whole size class, and the smallest one that fits.
+        MSTRING_SIZE_T header = MStringCopyOnWrite ? MStringRefCountHeaderSize : 0;
+        for (MSTRING_SIZE_T wanted = MString::MaxShortLength + 1; wanted < 40000; wanted += wanted / 8)
+        {
+            MString reserved = {};
+            reserved.Reserve(wanted);
+            MSTRING_SIZE_T block = reserved.Capacity() + 1 + header;
+            assert(reserved.Capacity() >= wanted && MStringPoolGoodSize(wanted + 1 + header) == block);
+        }
+#endif
+
+        // Strings that get made on one thread and freed on another, while a third thread makes more.
+        MString made[2][256] = {};
+        auto make = [&](int side)
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                made[side][i] = MString("Strings just past the short limit: ");
+                made[side][i].AppendInt(i);
+                for (int j = 0; j < i % 8; ++j) made[side][i].Append(made[side][i]);
+            }
+        };
+        auto free_all = [&](int side) {for (MString& str : made[side]) str.Free();};
+        std::thread(make, 0).join();
+        for (int round = 0; round < 20; ++round)
+        {
+            std::thread making(make, 1 - round % 2), freeing(free_all, round % 2);
+            making.join();
+            freeing.join();
+        }
+        free_all(0);
+        free_all(1);
+        MStringPoolTrim();
+        MString after = MString("Allocating after a trim still works, ") + "of course";
+        assert(after.Length() == 46);
+    }
+
+    printf("Testing inline sizes:\n");
+    {
+        assert(sizeof(MString64) == 64 && MString64::MaxShortLength == 63 - sizeof(char*));
+        assert(sizeof(MStringCompact) == ((sizeof(MSTRING_SIZE_T) < sizeof(char*)) ? 16 : 24) && MStringCompact::MaxShortLength < MString::MaxShortLength);
+
+        IString id = "an identifier that is too long for a short MString";
+        MString64 wide = MString64(id);
+        assert(!wide.IsHeap() && wide == id && wide.Hash() == id.Hash());
+        wide += " and then some";
+        assert(wide.IsHeap() && wide.Length() == id.Length() + 14);
+
+        // Compact strings keep their heap capacity in a header, but otherwise work the same.
+        MStringCompact tiny = "abc";
+        assert(!tiny.IsHeap() && tiny == "abc");
+        for (int i = 0; i < 10; ++i) tiny += tiny;
+        assert(tiny.IsHeap() && tiny.Length() == 3 * 1024 && tiny.Capacity() >= tiny.Length());
+        assert(tiny.Count('a') == 1024 && tiny.Hash() == MStringHash(tiny.Ptr(), tiny.Length()));
+        MStringCompact tiny_copy = tiny;
+        assert(tiny_copy == tiny);
+        tiny.Remove(2, tiny.Length() - 2);
+        tiny.ShrinkToFit();
+        assert(!tiny.IsHeap() && tiny == "ab");
+
+        // Moves between sizes hand over the heap buffer when they can.
+        const char* buffer = tiny_copy.Ptr();
+        MString normal = MString(static_cast<MStringCompact&&>(tiny_copy));
+        assert(normal.Ptr() == buffer && normal.Length() == 3 * 1024 && tiny_copy.Length() == 0);
+        normal += "!";
+        assert(normal.Length() == 3 * 1024 + 1 && normal.Capacity() >= normal.Length());
+        buffer = normal.Ptr();
+        MStringCompact back = MStringCompact(static_cast<MString&&>(normal));
+        assert(back.Length() == 3 * 1024 + 1 && back[3 * 1024] == '!' && normal.Length() == 0);
+        MString64 from_compact = MString64(static_cast<MStringCompact&&>(back));
+        assert(from_compact.IsHeap() && from_compact.Length() == 3 * 1024 + 1 && back.Length() == 0);
+        MString wide_move = MString(static_cast<MString64&&>(wide));
+        assert(wide_move.IsHeap() && wide_move.Length() == id.Length() + 14 && wide.Length() == 0);
+        MStringCompact short_copy = MStringCompact(MString("short"));
+        assert(!short_copy.IsHeap() && short_copy == "short");
+
+        // Different sizes compare with each other, and with everything else, through IString.
+        assert(short_copy == MString64("short") && short_copy != MString("shorter"));
+        assert(MString(short_copy) == short_copy && IString(short_copy.Ptr(), 5) == short_copy);
+
+        // + chains work for every size, and build into the size of the left hand string (or the only one).
+        MString64 first = "first", second = "second";
+        MString64 joined = first + ' ' + second + MString64("!") + (MString64("?") + first);
+        assert(joined == "first second!?first" && MString64("[" + first + ']') == "[first]");
+        assert((MString64(first) + MString("x")).head.MaxShortLength == MString64::MaxShortLength);
+        MStringCompact left = "ab", right = "cd";
+        MStringCompact compact_joined = left + right + MStringCompact("ef") + "gh" + IString("ij");
+        assert(compact_joined == "abcdefghij" && MStringCompact('x' + left) == "xab" && (left + right) == "abcd");
+        assert((left + MString64(id)).head.MaxShortLength == MStringCompact::MaxShortLength);
+        assert((left + MString64(id)).Length() == id.Length() + 2 && MString(MString("x") + left) == "xab");
+
+        // Compact strings still work with allocators, which puts both headers in front of the buffer.
+        MStringArena arena(256);
+        MStringAllocatorScope scope(&arena);
+        MStringCompact arena_str = "a string that is long enough for the heap";
+        assert(arena_str.Allocator() == &arena);
+        arena_str.Append(arena_str);
+        assert(arena_str.Allocator() == &arena && arena_str.Length() == 82 && arena_str.Capacity() >= 82);
+        MString arena_moved = MString(static_cast<MStringCompact&&>(arena_str));
+        assert(arena_moved.Allocator() == &arena && arena_moved.Length() == 82);
+    }
+
+    printf("Testing copy-on-write:\n");
+    {
+        // These pass either way, but only share anything when the implementation has MSTRING_COPY_ON_WRITE.
+#ifdef MSTRING_COPY_ON_WRITE
+        constexpr bool shares = true;
+#else
+        constexpr bool shares = false;
+#endif
+        const MString original = "A string that is long enough to live on the heap, and be shared.";
+        auto buffer = [](const MString& str) {return str.Ptr();}; // Non-const Ptr() would count as a mutation.
+        unsigned int hash = original.Hash();
+        MString a = original, b = original, c = {};
+        c = original;
+        assert(a == original && b == original && c == original);
+        assert(original.IsShared() == shares && (buffer(a) == buffer(original)) == shares && (buffer(c) == buffer(original)) == shares);
+        assert(a.Hash() == hash);
+
+        // Reading through const char* (or testing it in a condition) isn't a mutation, so it keeps sharing.
+        MString reader = original;
+        auto read = [](const char* str) {return strlen(str);};
+        assert(read(reader) == original.Length() && reader && reader.IsShared() == shares && (buffer(reader) == buffer(a)) == shares);
+        reader.Free();
+
+        // Every kind of mutation has to give the string its own buffer first.
+        a.Insert(0, "Hello. ");
+        b.Remove(0, 2);
+        c.SetLength(8);
+        assert(a == "Hello. A string that is long enough to live on the heap, and be shared.");
+        assert(b == "string that is long enough to live on the heap, and be shared.");
+        assert(c == "A string");
+        MString d = original, e = original, f = original, g = original;
+        d[0] = 'a';
+        e.Ptr()[0] = 'b';
+        *f.begin() = 'c';
+        ((char*)g)[0] = 'd';
+        assert(d[0] == 'a' && e[0] == 'b' && f[0] == 'c' && g[0] == 'd' && original[0] == 'A');
+        assert(original.Hash() == hash && MStringHash(original.Ptr(), original.Length()) == hash);
+
+        // Only the original is left holding its buffer now, so mutating it doesn't need another copy.
+        MString last = original;
+        assert(!a.IsShared() && last.IsShared() == shares);
+        const char* before = buffer(last);
+        last[0] = 'B';
+        assert(!original.IsShared() && !last.IsShared() && (buffer(last) != before) == shares && original[0] == 'A');
+
+        // Copies share across threads too, and the buffer is freed by whichever copy goes last.
+        MString copies[8] = {};
+        for (int i = 0; i < 8; ++i) copies[i] = original;
+        std::thread threads[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            threads[i] = std::thread([&copies, i]()
+            {
+                MString mine = copies[i];
+                copies[i].Free();
+                mine += '!';
+            });
+        }
+        for (int i = 0; i < 8; ++i) threads[i].join();
+        assert(!original.IsShared() && original[0] == 'A');
+    }
+
+    printf("Testing memory instrumentation:\n");
+    {
+        // Without MSTRING_STATS the snapshot is always empty, and the rest of this is skipped.
+        MStringStatsReset();
+        {
+            MString small = "short";
+            MString big = "A string that is long enough to live on the heap.";
+            MString copy = big;
+            big += " And then some more, so that it has to grow.";
+            big.ShrinkToFit();
+            MString moved = static_cast<MString&&>(copy);
+        }
+        std::thread thread([]()
+        {
+            for (int i = 0; i < 10; ++i) MString str = "Another string that is long enough to live on the heap.";
+        });
+        thread.join();
+
+        MStringStats stats = MStringStatsSnapshot();
+#ifdef MSTRING_STATS
+        assert(stats.enabled);
+#endif
+        if (stats.enabled)
+        {
+            assert(stats.constructions == 12 && stats.copies == 1 && stats.moves == 1 && stats.expansions == 1);
+            assert(stats.short_placements == 1 && stats.heap_placements + stats.shared_copies == 12 && stats.shrinks == 1);
+            assert(stats.allocations == stats.frees && stats.bytes_allocated == stats.bytes_freed && stats.allocations >= 12);
+            assert(stats.freed_capacity >= stats.freed_length && stats.shrink_bytes_saved > 0);
+            unsigned long long histogram_total = 0;
+            for (unsigned long long count : stats.length_histogram) histogram_total += count;
+            assert(histogram_total == 13 && stats.length_histogram[2] == 1 && stats.length_histogram[5] == 11 && stats.length_histogram[6] == 1);
+
+            MStringStatsReset();
+            stats = MStringStatsSnapshot();
+            assert(stats.enabled && stats.constructions == 0 && stats.allocations == 0 && stats.length_histogram[5] == 0);
+
+            // A string freed by a thread_local destructor after the thread's counters are gone still counts.
+            // It is constructed empty, before the counters exist, so it gets destroyed after them.
+            std::thread late_thread([]()
+            {
+                struct LateFree {MString str;};
+                thread_local LateFree late;
+                late.str.Append("A string that gets freed after this thread's counters are gone.");
+            });
+            late_thread.join();
+            stats = MStringStatsSnapshot();
+            assert(stats.allocations == 1 && stats.frees == 1 && stats.bytes_freed == stats.bytes_allocated);
+        }
+        else assert(MStringStatsSnapshot().constructions == 0);
+    }
+
     return 0;
-}
\ No newline at end of file
+}
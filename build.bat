@@ -4,7 +4,10 @@ REM In particular, you may need to adjust the output executable name, include pa
 
 REM Set build tool and library paths as well as compile flags here.
 
-set common_flags=/W4 /Gm- /utf-8 /EHsc /nologo /Fe: MStringTests.exe /I ..\.. ..\..\Tests.cpp
+set common_flags=/W4 /Gm- /utf-8 /EHsc /nologo /I ..\..
+set tests_flags=/Fe: MStringTests.exe ..\..\Tests.cpp
+set options_tests_flags=/D MSTRING_COPY_ON_WRITE /D MSTRING_STATS /D MSTRING_POOL /Fe: MStringTestsOptions.exe ..\..\Tests.cpp
+set benchmarks_flags=/Fe: MStringBenchmarks.exe ..\..\Benchmarks.cpp
 set debug_flags=/Od /Z7 /MTd
 set release_flags=/O2 /GL /MT /analyze- /D NDEBUG
 
@@ -41,7 +44,19 @@ pushd bin\%mode%
 REM Perform the actual build.
 
 echo.     -Compiling:
-call cl %flags% /link %linker_flags%
+call cl %flags% %tests_flags% /link %linker_flags%
+if %errorlevel% neq 0 (
+echo Error during compilation!
+popd
+goto :fail
+)
+call cl %flags% %options_tests_flags% /link %linker_flags%
+if %errorlevel% neq 0 (
+echo Error during compilation!
+popd
+goto :fail
+)
+call cl %flags% %benchmarks_flags% /link %linker_flags%
 if %errorlevel% neq 0 (
 echo Error during compilation!
 popd
@@ -0,0 +1,33 @@
+#!/bin/sh
+# C++ build script for GCC or Clang, same as build.bat but for Linux (or anything else with a unix shell).
+# Set CXX to choose the compiler, and pass "release" as the first argument for an optimized build.
+
+set -e
+cd "$(dirname "$0")"
+
+# Set compiler and flags here. The library checks for negative sizes in case MSTRING_SIZE_T is signed,
+# which -Wextra complains about when it isn't.
+cxx=${CXX:-c++}
+common_flags="-std=c++17 -Wall -Wextra -Wno-type-limits -pthread -I."
+debug_flags="-O0 -g"
+release_flags="-O2 -DNDEBUG"
+options_flags="-DMSTRING_COPY_ON_WRITE -DMSTRING_STATS -DMSTRING_POOL"
+benchmarks_flags="-DMSTRING_BENCHMARK_COMMIT=\"$(git rev-parse --short HEAD 2>/dev/null || echo unknown)\""
+
+mode=debug
+if [ "$1" = "release" ]; then mode=release; fi
+if [ $mode = debug ]; then flags="$common_flags $debug_flags"; else flags="$common_flags $release_flags"; fi
+echo "Building in $mode mode with $cxx."
+mkdir -p bin/$mode
+
+# The tests are nothing but asserts, so they keep them in release builds too. They get built a second
+# time with the optional features turned on, since some of the tests only check anything with those.
+# The benchmarks get built three times, so that we can compare the short string limits of both size
+# types, and the buffer pool.
+$cxx $flags -UNDEBUG Tests.cpp -o bin/$mode/MStringTests
+$cxx $flags -UNDEBUG $options_flags Tests.cpp -o bin/$mode/MStringTestsOptions
+$cxx $flags $benchmarks_flags Benchmarks.cpp -o bin/$mode/MStringBenchmarks
+$cxx $flags $benchmarks_flags "-DMSTRING_SIZE_TYPE=unsigned int" Benchmarks.cpp -o bin/$mode/MStringBenchmarks32
+$cxx $flags $benchmarks_flags -DMSTRING_POOL Benchmarks.cpp -o bin/$mode/MStringBenchmarksPool
+
+echo "Build complete!"
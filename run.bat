@@ -4,4 +4,9 @@ if /i $%1 equ $release set mode=release
 if not exist bin\%mode% exit /b 0
 pushd bin\%mode%
 call MStringTests.exe
+if %errorlevel% neq 0 (
+popd
+exit /b %errorlevel%
+)
+call MStringTestsOptions.exe
 popd
\ No newline at end of file
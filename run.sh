@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs the tests, same as run.bat. Pass "release" to run the release build, and "benchmarks" to run the
+# benchmarks too. Benchmark results get written as CSV and JSON next to the executables.
+
+cd "$(dirname "$0")"
+mode=debug
+benchmarks=0
+for arg in "$@"; do
+    if [ "$arg" = "release" ]; then mode=release; fi
+    if [ "$arg" = "benchmarks" ]; then benchmarks=1; fi
+done
+if [ ! -d bin/$mode ]; then exit 0; fi
+cd bin/$mode
+
+./MStringTests || exit $?
+./MStringTestsOptions || exit $?
+if [ $benchmarks = 1 ]; then
+    ./MStringBenchmarks --csv benchmarks.csv --json benchmarks.json || exit $?
+    ./MStringBenchmarks32 --csv benchmarks32.csv --json benchmarks32.json || exit $?
+    ./MStringBenchmarksPool --csv benchmarks_pool.csv --json benchmarks_pool.json || exit $?
+fi